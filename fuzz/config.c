@@ -0,0 +1,35 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// Option and environment values: one per line, in the order --vid, --rgb,
+// --als-thresholds, --mode, --transport
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *s = fuzz_strdup(data, size);
+    if (!s) return 0;
+    char *lines[5] = { "", "", "", "", "" };
+    char *p = s;
+    for (int i = 0; i < 5 && p; i++) {
+        lines[i] = p;
+        p = strchr(p, '\n');
+        if (p) *p++ = '\0';
+    }
+
+    config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    parse_vid_list(lines[0], &cfg);
+    rgb_override_t ov = { -1, -1, -1, -1 };
+    (void)parse_rgb_spec(lines[1], &ov);
+    als_t als;
+    memset(&als, 0, sizeof(als));
+    (void)parse_als_thresholds(lines[2], &als);
+    (void)parse_mode(lines[3]);
+    (void)transport_select(lines[4]);
+    g_transport = &transport_hidraw;
+    free(s);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// fuzz/fuzz.h
+//
+// Shared by the fuzzing harnesses. The daemon is compiled into each harness
+// with its main() renamed, so the parsers keep their static linkage and are
+// fuzzed exactly as built. Harnesses define LLVMFuzzerTestOneInput() for
+// libFuzzer (or AFL++ through its libFuzzer driver); see `make fuzz`.
+
+#ifndef FW16_KBD_ULEDS_FUZZ_H
+#define FW16_KBD_ULEDS_FUZZ_H
+
+#define main fw16_kbd_uleds_main
+#include "../fw16-kbd-uleds.c"
+#undef main
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// NUL-terminated copy of the input for the string parsers
+static char *fuzz_strdup(const uint8_t *data, size_t size) {
+    char *s = malloc(size + 1);
+    if (!s) return NULL;
+    memcpy(s, data, size);
+    s[size] = '\0';
+    return s;
+}
+
+#endif
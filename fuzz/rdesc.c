@@ -0,0 +1,18 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// HID report descriptors, as read from sysfs or HIDIOCGRDESC
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size > HID_MAX_DESCRIPTOR_SIZE) return 0;
+    unsigned char *desc = malloc(size ? size : 1);
+    if (!desc) return 0;
+    memcpy(desc, data, size);
+    (void)rdesc_has_raw_page(desc, size);
+    free(desc);
+    return 0;
+}
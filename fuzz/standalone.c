@@ -0,0 +1,31 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// Runs a harness over the given files once each, for compilers without
+// libFuzzer (e.g. `make fuzz FUZZ_CC=gcc FUZZ_ENGINE=fuzz/standalone.c` to
+// replay a corpus or a crash under the sanitizers).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        uint8_t *buf = malloc(1 << 20);
+        size_t n = buf ? fread(buf, 1, 1 << 20, f) : 0;
+        fclose(f);
+        (void)LLVMFuzzerTestOneInput(buf, n);
+        free(buf);
+    }
+    return 0;
+}
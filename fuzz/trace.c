@@ -0,0 +1,32 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// --replay trace files: parse, then answer a few lookups from them
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    unsigned char *buf = malloc(size ? size : 1);
+    if (!buf) return 0;
+    memcpy(buf, data, size);
+    if (replay_parse(buf, size) < 0) return 0;
+
+    g_clock_virtual = 1; // recorded round trip times must not sleep
+    g_replay.ans_pos = 0;
+    g_replay.t0_us = now_us();
+    char hidraw[64];
+    unsigned char resp[32];
+    qmk_req_t reqs[2] = { { .cmd = QMK_CMD_GET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_EFFECT },
+                          { .cmd = QMK_CMD_GET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_SPEED } };
+    if (replay_find(0x32ac, 0x0012, hidraw, sizeof(hidraw)) == 0) {
+        const unsigned char req[32] = { QMK_CMD_GET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS };
+        (void)replay_xfer(hidraw, req, resp);
+        (void)replay_batch(hidraw, reqs, 2);
+        (void)replay_suspended(hidraw);
+    }
+    (void)replay_deadline();
+    replay_free();
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// Kernel uevent messages (NUL-separated "KEY=value" strings)
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // An exact-size copy, so reads past the message are caught
+    char *buf = malloc(size ? size : 1);
+    if (!buf) return 0;
+    memcpy(buf, data, size);
+    (void)uevent_maybe_relevant(buf, (ssize_t)size);
+    free(buf);
+    return 0;
+}
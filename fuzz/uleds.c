@@ -0,0 +1,22 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// Brightness events read from /dev/uleds (the main loop reads up to 8 bytes).
+// The first input byte is the configured max brightness.
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 1 || size > 9) return 0;
+    unsigned max = data[0] ? data[0] : 100; // main() turns 0 into 100
+    size_t n = size - 1;
+    unsigned char *buf = malloc(n ? n : 1);
+    if (!buf) return 0;
+    memcpy(buf, data + 1, n);
+    unsigned raw = decode_uleds(buf, (ssize_t)n);
+    (void)pct_to_level((raw * 100) / max);
+    free(buf);
+    return 0;
+}
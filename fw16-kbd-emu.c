@@ -0,0 +1,403 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// fw16-kbd-emu.c
+//
+// Virtual Framework 16 input modules for testing fw16-kbd-uleds without the
+// hardware. Each module is a /dev/uhid device with the Framework VID/PID and
+// the QMK VIA raw HID report descriptor (usage page 0xFF60), so the kernel
+// creates a real hidraw node and the daemon's discovery, hotplug handling
+// and HID transfers run unchanged against it.
+//
+// The modules answer the VIA custom value commands the daemon uses (get,
+// set and save on the backlight and RGB matrix channels) from the module
+// model in fw16-kbd-uleds-via.h, which the daemon's mock transport shares.
+// Replies can be delayed, dropped, and the modules unplugged and replugged
+// periodically.
+// SIGUSR1 steps every module's brightness like Fn+Space does; SIGINT/SIGTERM
+// remove the devices and print transfer statistics.
+//
+// Build:
+//   make emu
+//
+// Requires:
+//   - kernel module: uhid (root or write access to /dev/uhid)
+//
+// Example (keyboard and macropad, 5 ms replies, 10% dropped):
+//   sudo ./fw16-kbd-emu -m 0012 -m 0013 -l 5 -D 10
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fw16-kbd-uleds-via.h"
+
+/* -------------------- QMK VIA protocol -------------------- */
+
+// QMK raw HID interface: 32-byte input and output reports, no report IDs
+static const uint8_t via_report_desc[] = {
+    0x06, 0x60, 0xFF, // Usage Page (Vendor 0xFF60)
+    0x09, 0x61,       // Usage (0x61)
+    0xA1, 0x01,       // Collection (Application)
+    0x09, 0x62,       //   Usage (0x62)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x26, 0xFF, 0x00, //   Logical Maximum (255)
+    0x95, 0x20,       //   Report Count (32)
+    0x75, 0x08,       //   Report Size (8)
+    0x81, 0x02,       //   Input (Data, Variable, Absolute)
+    0x09, 0x63,       //   Usage (0x63)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x26, 0xFF, 0x00, //   Logical Maximum (255)
+    0x95, 0x20,       //   Report Count (32)
+    0x75, 0x08,       //   Report Size (8)
+    0x91, 0x02,       //   Output (Data, Variable, Absolute)
+    0xC0              // End Collection
+};
+
+/* -------------------- Modules -------------------- */
+
+#define MAX_MODULES 8
+#define MAX_PENDING 16
+
+typedef struct {
+    uint64_t due;
+    uint8_t data[VIA_REPORT_LEN];
+} reply_t;
+
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    int fd;                  // /dev/uhid, -1 while unplugged
+    via_module_t via;
+    reply_t pending[MAX_PENDING];
+    size_t pending_len;
+    uint64_t requests;
+    uint64_t replies;
+    uint64_t dropped;
+} module_t;
+
+typedef struct {
+    unsigned latency_ms;
+    unsigned jitter_ms;
+    unsigned drop_pct;
+    unsigned unplug_every_ms; // 0 = never
+    unsigned unplug_for_ms;
+    int verbose;
+} emu_config_t;
+
+static volatile sig_atomic_t g_stop = 0;
+static volatile sig_atomic_t g_step = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+static const char *module_name(uint16_t pid) {
+    switch (pid) {
+    case 0x0012: return "Framework Laptop 16 Keyboard Module - ANSI";
+    case 0x0018: return "Framework Laptop 16 Keyboard Module - ISO";
+    case 0x0019: return "Framework Laptop 16 Keyboard Module - JIS";
+    case 0x0013: return "Framework Laptop 16 RGB Macropad";
+    case 0x0014: return "Framework Laptop 16 Numpad Module";
+    default: return "Framework Laptop 16 Module (emulated)";
+    }
+}
+
+static int uhid_send(int fd, const struct uhid_event *ev) {
+    ssize_t n = write(fd, ev, sizeof(*ev));
+    return n == (ssize_t)sizeof(*ev) ? 0 : -1;
+}
+
+static int module_plug(module_t *m, int index) {
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) return -1;
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", module_name(m->pid));
+    snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "fw16-kbd-emu/input%d", index);
+    snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "EMU%04x%d", m->pid, index);
+    memcpy(ev.u.create2.rd_data, via_report_desc, sizeof(via_report_desc));
+    ev.u.create2.rd_size = sizeof(via_report_desc);
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = m->vid;
+    ev.u.create2.product = m->pid;
+    ev.u.create2.version = 0x0100;
+    if (uhid_send(fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    m->fd = fd;
+    m->pending_len = 0;
+    return 0;
+}
+
+static void module_unplug(module_t *m) {
+    if (m->fd < 0) return;
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_DESTROY;
+    (void)uhid_send(m->fd, &ev);
+    close(m->fd);
+    m->fd = -1;
+    m->pending_len = 0;
+}
+
+static void module_queue_reply(module_t *m, const uint8_t *data, const emu_config_t *cfg) {
+    if (cfg->drop_pct && (unsigned)(rand() % 100) < cfg->drop_pct) {
+        m->dropped++;
+        if (cfg->verbose) fprintf(stderr, "%04x:%04x: dropping reply to %02x %02x %02x\n", m->vid, m->pid, data[0], data[1], data[2]);
+        return;
+    }
+    if (m->pending_len == MAX_PENDING) {
+        m->dropped++;
+        return;
+    }
+    unsigned delay = cfg->latency_ms + (cfg->jitter_ms ? (unsigned)rand() % (cfg->jitter_ms + 1) : 0);
+    reply_t *r = &m->pending[m->pending_len++];
+    r->due = now_ms() + delay;
+    memcpy(r->data, data, VIA_REPORT_LEN);
+}
+
+static void module_send_due(module_t *m, uint64_t now) {
+    size_t keep = 0;
+    for (size_t i = 0; i < m->pending_len; i++) {
+        reply_t *r = &m->pending[i];
+        if (r->due > now) {
+            m->pending[keep++] = *r;
+            continue;
+        }
+        struct uhid_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = UHID_INPUT2;
+        ev.u.input2.size = VIA_REPORT_LEN;
+        memcpy(ev.u.input2.data, r->data, VIA_REPORT_LEN);
+        if (uhid_send(m->fd, &ev) == 0) m->replies++;
+    }
+    m->pending_len = keep;
+}
+
+static void module_read(module_t *m, const emu_config_t *cfg) {
+    struct uhid_event ev;
+    while (read(m->fd, &ev, sizeof(ev)) > 0) {
+        switch (ev.type) {
+        case UHID_OUTPUT: {
+            // hidraw passes the (zero) report ID through for devices without IDs
+            const uint8_t *p = ev.u.output.data;
+            size_t len = ev.u.output.size;
+            if (len == VIA_REPORT_LEN + 1 && p[0] == 0) {
+                p++;
+                len--;
+            }
+            if (len < 3) break;
+            uint8_t data[VIA_REPORT_LEN] = {0};
+            memcpy(data, p, len < VIA_REPORT_LEN ? len : VIA_REPORT_LEN);
+            m->requests++;
+            if (cfg->verbose) fprintf(stderr, "%04x:%04x: request %02x %02x %02x %02x\n", m->vid, m->pid, data[0], data[1], data[2], data[3]);
+            via_handle(&m->via, data);
+            module_queue_reply(m, data, cfg);
+            break;
+        }
+        case UHID_GET_REPORT: {
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = ev.u.get_report.id;
+            reply.u.get_report_reply.err = EIO;
+            (void)uhid_send(m->fd, &reply);
+            break;
+        }
+        case UHID_SET_REPORT: {
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = ev.u.set_report.id;
+            reply.u.set_report_reply.err = EIO;
+            (void)uhid_send(m->fd, &reply);
+            break;
+        }
+        default:
+            break; // START, STOP, OPEN, CLOSE
+        }
+    }
+}
+
+// Fn+Space
+static void module_step(module_t *m) {
+    uint8_t next = via_step(&m->via);
+    fprintf(stderr, "%04x:%04x: brightness -> %u\n", m->vid, m->pid, next);
+}
+
+/* -------------------- Main -------------------- */
+
+static void on_signal(int sig) {
+    if (sig == SIGUSR1) g_step = 1;
+    else g_stop = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -m, --module <[vid:]pid>       Module to emulate, repeatable (default: 32ac:0012)\n");
+    fprintf(stderr, "  -b, --brightness <0-255>       Initial brightness (default: 170)\n");
+    fprintf(stderr, "  -l, --latency-ms <ms>          Delay before each reply (default: 0)\n");
+    fprintf(stderr, "  -j, --jitter-ms <ms>           Extra random delay of up to this much (default: 0)\n");
+    fprintf(stderr, "  -D, --drop <percent>           Drop this share of replies (default: 0)\n");
+    fprintf(stderr, "  -u, --unplug-every <ms>        Unplug all modules periodically (default: 0, never)\n");
+    fprintf(stderr, "  -U, --unplug-for <ms>          How long modules stay unplugged (default: 1000)\n");
+    fprintf(stderr, "  -V, --verbose                  Log every request\n");
+    fprintf(stderr, "  -h, --help                     Show this help\n");
+    fprintf(stderr, "\nSignals: SIGUSR1 steps the brightness like Fn+Space.\n");
+}
+
+int main(int argc, char **argv) {
+    emu_config_t cfg = { .unplug_for_ms = 1000 };
+    module_t mods[MAX_MODULES];
+    size_t num_mods = 0;
+    unsigned brightness = 170;
+
+    static const struct option long_opts[] = {
+        {"module", required_argument, 0, 'm'},
+        {"brightness", required_argument, 0, 'b'},
+        {"latency-ms", required_argument, 0, 'l'},
+        {"jitter-ms", required_argument, 0, 'j'},
+        {"drop", required_argument, 0, 'D'},
+        {"unplug-every", required_argument, 0, 'u'},
+        {"unplug-for", required_argument, 0, 'U'},
+        {"verbose", no_argument, 0, 'V'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:b:l:j:D:u:U:Vh", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'm': {
+            if (num_mods == MAX_MODULES) {
+                fprintf(stderr, "error: at most %d modules\n", MAX_MODULES);
+                return 1;
+            }
+            module_t *m = &mods[num_mods++];
+            memset(m, 0, sizeof(*m));
+            const char *colon = strchr(optarg, ':');
+            m->vid = colon ? (uint16_t)strtoul(optarg, NULL, 16) : 0x32ac;
+            m->pid = (uint16_t)strtoul(colon ? colon + 1 : optarg, NULL, 16);
+            break;
+        }
+        case 'b': brightness = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'l': cfg.latency_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'j': cfg.jitter_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'D': cfg.drop_pct = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'u': cfg.unplug_every_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'U': cfg.unplug_for_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'V': cfg.verbose = 1; break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (brightness > 255) brightness = 255;
+    if (cfg.drop_pct > 100) cfg.drop_pct = 100;
+    if (num_mods == 0) {
+        memset(&mods[0], 0, sizeof(mods[0]));
+        mods[0].vid = 0x32ac;
+        mods[0].pid = 0x0012;
+        num_mods = 1;
+    }
+
+    srand((unsigned)now_ms());
+    for (size_t i = 0; i < num_mods; i++) {
+        module_t *m = &mods[i];
+        via_module_init(&m->via, m->pid, (uint8_t)brightness);
+        if (module_plug(m, (int)i) < 0) {
+            fprintf(stderr, "error: failed to create %04x:%04x via /dev/uhid: %s\n", m->vid, m->pid, strerror(errno));
+            return 1;
+        }
+        fprintf(stderr, "created %04x:%04x (%s)\n", m->vid, m->pid, module_name(m->pid));
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    int plugged = 1;
+    uint64_t next_plug_change = cfg.unplug_every_ms ? now_ms() + cfg.unplug_every_ms : 0;
+
+    while (!g_stop) {
+        uint64_t now = now_ms();
+        if (g_step) {
+            g_step = 0;
+            for (size_t i = 0; i < num_mods; i++) module_step(&mods[i]);
+        }
+        if (next_plug_change && now >= next_plug_change) {
+            plugged = !plugged;
+            for (size_t i = 0; i < num_mods; i++) {
+                if (!plugged) {
+                    module_unplug(&mods[i]);
+                } else if (module_plug(&mods[i], (int)i) < 0) {
+                    fprintf(stderr, "warning: replug of %04x:%04x failed: %s\n", mods[i].vid, mods[i].pid, strerror(errno));
+                }
+            }
+            fprintf(stderr, "%s\n", plugged ? "replugged" : "unplugged");
+            next_plug_change = now + (plugged ? cfg.unplug_every_ms : cfg.unplug_for_ms);
+        }
+
+        struct pollfd pfds[MAX_MODULES];
+        int timeout = -1;
+        for (size_t i = 0; i < num_mods; i++) {
+            module_t *m = &mods[i];
+            pfds[i] = (struct pollfd){ .fd = m->fd, .events = POLLIN };
+            for (size_t j = 0; j < m->pending_len; j++) {
+                int t = (m->pending[j].due <= now) ? 0 : (int)(m->pending[j].due - now);
+                if (timeout < 0 || t < timeout) timeout = t;
+            }
+        }
+        if (next_plug_change) {
+            int t = (next_plug_change <= now) ? 0 : (int)(next_plug_change - now);
+            if (timeout < 0 || t < timeout) timeout = t;
+        }
+
+        if (poll(pfds, num_mods, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        now = now_ms();
+        for (size_t i = 0; i < num_mods; i++) {
+            if (mods[i].fd < 0) continue;
+            if (pfds[i].revents & POLLIN) module_read(&mods[i], &cfg);
+            module_send_due(&mods[i], now);
+        }
+    }
+
+    for (size_t i = 0; i < num_mods; i++) {
+        module_t *m = &mods[i];
+        module_unplug(m);
+        printf("%04x:%04x requests=%llu replies=%llu dropped=%llu saves=%llu\n", m->vid, m->pid,
+               (unsigned long long)m->requests, (unsigned long long)m->replies,
+               (unsigned long long)m->dropped, (unsigned long long)m->via.saves);
+    }
+    return 0;
+}
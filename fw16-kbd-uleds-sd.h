@@ -0,0 +1,976 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// fw16-kbd-uleds-sd.h
+//
+// Built-in stand-ins for the few libsystemd calls fw16-kbd-uleds makes, used
+// by `make DBUS=builtin` so the daemon links without libsystemd (and can be
+// linked statically). Only what the daemon needs is implemented:
+//
+//   - D-Bus over a unix socket: SASL EXTERNAL authentication (completed by
+//     sd_bus_process(), so connecting never waits for the server), little- and
+//     big-endian messages with basic types (i u b s o g) and arrays of them,
+//     asynchronous method calls whose replies and timeouts are dispatched
+//     from sd_bus_process(), and a flat vtable for exported objects.
+//   - sd_journal_sendv() over the journal's native datagram socket.
+//
+// Connections are allocated when they are made; sending, receiving and
+// dispatching work in fixed per-connection buffers and do not allocate.
+// Messages that do not fit the receive buffer are skipped. Every exported
+// method is callable by anyone the bus policy lets through; vtable flags are
+// accepted but ignored.
+
+#ifndef FW16_KBD_ULEDS_SD_H
+#define FW16_KBD_ULEDS_SD_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------- Types -------------------- */
+
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+typedef struct sd_bus_slot sd_bus_slot; // never created, callers pass NULL
+
+typedef struct {
+    const char *name;
+    const char *message;
+    int _need_free;
+} sd_bus_error;
+
+#define SD_BUS_ERROR_NULL { NULL, NULL, 0 }
+
+typedef int (*sd_bus_message_handler_t)(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+typedef struct {
+    char type; // 'S' start, 'M' method, 'G' signal, 'E' end
+    const char *member;
+    const char *signature;
+    sd_bus_message_handler_t handler;
+} sd_bus_vtable;
+
+#define SD_BUS_VTABLE_UNPRIVILEGED 0
+#define SD_BUS_VTABLE_START(flags) { 'S', NULL, NULL, NULL }
+#define SD_BUS_METHOD(member, signature, result, handler, flags) { 'M', member, signature, handler }
+#define SD_BUS_SIGNAL(member, signature, flags) { 'G', member, signature, NULL }
+#define SD_BUS_VTABLE_END { 'E', NULL, NULL, NULL }
+
+// sd_bus_request_name() flags, as in libsystemd (not the D-Bus wire values)
+#define SD_BUS_NAME_REPLACE_EXISTING 1
+#define SD_BUS_NAME_ALLOW_REPLACEMENT 2
+#define SD_BUS_NAME_QUEUE 4
+
+#define BUS_MSG_CALL 1
+#define BUS_MSG_RETURN 2
+#define BUS_MSG_ERROR 3
+#define BUS_MSG_SIGNAL 4
+#define BUS_FLAG_NO_REPLY 0x1
+
+#define BUS_FIELD_PATH 1
+#define BUS_FIELD_INTERFACE 2
+#define BUS_FIELD_MEMBER 3
+#define BUS_FIELD_ERROR_NAME 4
+#define BUS_FIELD_REPLY_SERIAL 5
+#define BUS_FIELD_DESTINATION 6
+#define BUS_FIELD_SENDER 7
+#define BUS_FIELD_SIGNATURE 8
+
+#define BUS_RBUF_LEN 16384
+#define BUS_WBUF_LEN 8192
+#define BUS_BODY_LEN 256
+#define BUS_STRS_LEN 512
+#define BUS_MAX_PENDING 16
+#define BUS_MAX_OBJECTS 4
+#define BUS_CALL_TIMEOUT_US 25000000ULL
+#define BUS_START_TIMEOUT_MS 5000
+#define BUS_DEFAULT_SYSTEM_ADDRESS "unix:path=/run/dbus/system_bus_socket"
+
+struct sd_bus_message {
+    sd_bus *bus;
+    int pooled;                 // outgoing message taken from the bus's pool
+    uint8_t type;
+    uint8_t flags;
+    int big_endian;
+    uint32_t serial;
+    uint32_t reply_serial;
+    const char *path;
+    const char *interface;
+    const char *member;
+    const char *destination;
+    const char *sender;
+    const char *error_name;
+    const char *signature;
+    // Outgoing messages keep their strings, signature and body here
+    char strs[BUS_STRS_LEN];
+    size_t strs_len;
+    char sig[32];
+    unsigned char obody[BUS_BODY_LEN];
+    // Body being read (incoming: points into the receive buffer)
+    const unsigned char *body;
+    size_t body_len;
+    size_t rpos;                // read cursor
+    size_t rend;                // end of the current array, or of the body
+    char relem;                 // element type inside an array, 0 at top level
+    const char *rsig;           // next top-level type to read
+    sd_bus_error error;
+};
+
+typedef struct {
+    uint32_t serial;            // 0 = free slot
+    uint64_t deadline;
+    sd_bus_message_handler_t callback;
+    void *userdata;
+} bus_pending_t;
+
+typedef struct {
+    char path[128];
+    char interface[64];
+    const sd_bus_vtable *vtable;
+    void *userdata;
+} bus_object_t;
+
+struct sd_bus {
+    int fd;
+    int bus_client;
+    char sock[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    uint32_t serial;
+    unsigned char rbuf[BUS_RBUF_LEN];
+    size_t rlen;
+    size_t skip;                // bytes of an oversized message still to discard
+    unsigned char wbuf[BUS_WBUF_LEN];
+    size_t wlen;
+    uint64_t auth_deadline;     // nonzero until the server accepted the authentication
+    bus_pending_t pending[BUS_MAX_PENDING];
+    bus_object_t objects[BUS_MAX_OBJECTS];
+    sd_bus_message in;
+    sd_bus_message out[2];
+};
+
+static uint64_t bus_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static size_t bus_align(size_t n, size_t a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+/* -------------------- Marshalling -------------------- */
+
+typedef struct {
+    unsigned char *p;
+    size_t len;
+    size_t cap;
+    int err;
+} bus_buf_t;
+
+static void bus_put(bus_buf_t *b, const void *data, size_t n) {
+    if (b->err || n > b->cap - b->len) {
+        b->err = 1;
+        return;
+    }
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+}
+
+static void bus_pad(bus_buf_t *b, size_t a) {
+    static const unsigned char zero[8];
+    bus_put(b, zero, bus_align(b->len, a) - b->len);
+}
+
+static void bus_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+// Messages are always written little-endian ('l')
+static void bus_put_u32(bus_buf_t *b, uint32_t v) {
+    unsigned char le[4];
+    bus_le32(le, v);
+    bus_pad(b, 4);
+    bus_put(b, le, 4);
+}
+
+static void bus_put_str(bus_buf_t *b, const char *s) {
+    size_t n = strlen(s);
+    bus_put_u32(b, (uint32_t)n);
+    bus_put(b, s, n + 1);
+}
+
+static void bus_put_sig(bus_buf_t *b, const char *s) {
+    unsigned char n = (unsigned char)strlen(s);
+    bus_put(b, &n, 1);
+    bus_put(b, s, (size_t)n + 1);
+}
+
+static void bus_put_field(bus_buf_t *b, unsigned char code, char type, const char *s, uint32_t u) {
+    if (type != 'u' && !s) return;
+    char sig[2] = { type, '\0' };
+    bus_pad(b, 8);
+    bus_put(b, &code, 1);
+    bus_put_sig(b, sig);
+    if (type == 'u') bus_put_u32(b, u);
+    else if (type == 'g') bus_put_sig(b, s);
+    else bus_put_str(b, s);
+}
+
+static uint32_t bus_rd32(const unsigned char *p, int big_endian) {
+    if (big_endian) return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+// String-like value at *pos in p[0..end): 's'/'o' have a u32 length, 'g' a
+// byte length; all are NUL terminated. Returns NULL if malformed.
+static const char *bus_rd_str(const unsigned char *p, size_t *pos, size_t end, char type, int big_endian) {
+    size_t n;
+    if (type == 'g') {
+        if (*pos + 1 > end) return NULL;
+        n = p[*pos];
+        *pos += 1;
+    } else {
+        *pos = bus_align(*pos, 4);
+        if (*pos + 4 > end) return NULL;
+        n = bus_rd32(p + *pos, big_endian);
+        *pos += 4;
+    }
+    if (n >= end - *pos || p[*pos + n] != '\0') return NULL;
+    const char *s = (const char *)p + *pos;
+    if (memchr(s, '\0', n)) return NULL;
+    *pos += n + 1;
+    return s;
+}
+
+// Total length of the message at the start of p, or 0 if the fixed header is
+// not complete yet. Returns SIZE_MAX for a header no message could have.
+static size_t bus_msg_size(const unsigned char *p, size_t n) {
+    if (n < 16) return 0;
+    if ((p[0] != 'l' && p[0] != 'B') || p[3] != 1) return SIZE_MAX;
+    int be = p[0] == 'B';
+    uint64_t fields = bus_rd32(p + 12, be);
+    uint64_t body = bus_rd32(p + 4, be);
+    if (fields > (1u << 26) || body > (1u << 27)) return SIZE_MAX;
+    return (size_t)(bus_align(16 + (size_t)fields, 8) + body);
+}
+
+// Parse a complete message of `n` bytes in place. Strings point into p.
+static int bus_msg_parse(sd_bus_message *m, const unsigned char *p, size_t n) {
+    sd_bus *bus = m->bus;
+    memset(m, 0, sizeof(*m));
+    m->bus = bus;
+    m->big_endian = p[0] == 'B';
+    m->type = p[1];
+    m->flags = p[2];
+    m->body_len = bus_rd32(p + 4, m->big_endian);
+    m->serial = bus_rd32(p + 8, m->big_endian);
+    size_t end = 16 + (size_t)bus_rd32(p + 12, m->big_endian);
+    size_t hdr = bus_align(end, 8);
+    if (end > n || hdr + m->body_len != n || m->type < BUS_MSG_CALL || m->type > BUS_MSG_SIGNAL) return -EBADMSG;
+
+    size_t pos = 16;
+    while (pos < end) {
+        pos = bus_align(pos, 8);
+        if (pos + 4 > end) return -EBADMSG;
+        unsigned char code = p[pos];
+        // variant signature: one basic type
+        if (p[pos + 1] != 1 || p[pos + 3] != '\0') return -EBADMSG;
+        char type = (char)p[pos + 2];
+        pos += 4;
+        const char *s = NULL;
+        uint32_t u = 0;
+        if (type == 'u') {
+            pos = bus_align(pos, 4);
+            if (pos + 4 > end) return -EBADMSG;
+            u = bus_rd32(p + pos, m->big_endian);
+            pos += 4;
+        } else if (type == 's' || type == 'o' || type == 'g') {
+            if (!(s = bus_rd_str(p, &pos, end, type, m->big_endian))) return -EBADMSG;
+        } else {
+            return -EBADMSG;
+        }
+        switch (code) {
+        case BUS_FIELD_PATH: m->path = s; break;
+        case BUS_FIELD_INTERFACE: m->interface = s; break;
+        case BUS_FIELD_MEMBER: m->member = s; break;
+        case BUS_FIELD_ERROR_NAME: m->error_name = s; break;
+        case BUS_FIELD_REPLY_SERIAL: m->reply_serial = u; break;
+        case BUS_FIELD_DESTINATION: m->destination = s; break;
+        case BUS_FIELD_SENDER: m->sender = s; break;
+        case BUS_FIELD_SIGNATURE: m->signature = s; break;
+        default: break; // unknown fields are ignored
+        }
+    }
+
+    m->body = p + hdr;
+    m->rend = m->body_len;
+    m->rsig = m->signature ? m->signature : "";
+    if (m->type == BUS_MSG_ERROR) {
+        m->error.name = m->error_name ? m->error_name : "org.freedesktop.DBus.Error.Failed";
+        m->error.message = "";
+        if (m->rsig[0] == 's') {
+            size_t rpos = 0;
+            const char *msg = bus_rd_str(m->body, &rpos, m->body_len, 's', m->big_endian);
+            if (msg) m->error.message = msg;
+        }
+    }
+    return 0;
+}
+
+static const char *bus_msg_strdup(sd_bus_message *m, const char *s) {
+    if (!s) return NULL;
+    size_t n = strlen(s) + 1;
+    if (n > sizeof(m->strs) - m->strs_len) return NULL;
+    char *d = m->strs + m->strs_len;
+    memcpy(d, s, n);
+    m->strs_len += n;
+    return d;
+}
+
+static void bus_msg_init(sd_bus_message *m, sd_bus *bus, uint8_t type, const char *destination,
+                         const char *path, const char *interface, const char *member) {
+    memset(m, 0, sizeof(*m));
+    m->bus = bus;
+    m->type = type;
+    m->destination = bus_msg_strdup(m, destination);
+    m->path = bus_msg_strdup(m, path);
+    m->interface = bus_msg_strdup(m, interface);
+    m->member = bus_msg_strdup(m, member);
+    m->signature = m->sig;
+    m->body = m->obody;
+}
+
+static int bus_msg_appendv(sd_bus_message *m, const char *types, va_list ap) {
+    bus_buf_t b = { m->obody, m->body_len, sizeof(m->obody), 0 };
+    size_t sl = strlen(m->sig);
+    for (const char *t = types; *t; t++) {
+        if (sl + 1 >= sizeof(m->sig)) return -E2BIG;
+        switch (*t) {
+        case 'i':
+        case 'u':
+        case 'b':
+            bus_put_u32(&b, (uint32_t)va_arg(ap, int));
+            break;
+        case 's':
+        case 'o': {
+            const char *s = va_arg(ap, const char *);
+            bus_put_str(&b, s ? s : "");
+            break;
+        }
+        default:
+            return -EINVAL;
+        }
+        m->sig[sl++] = *t;
+        m->sig[sl] = '\0';
+    }
+    if (b.err) return -E2BIG;
+    m->body_len = b.len;
+    return 0;
+}
+
+/* -------------------- Connection -------------------- */
+
+static int bus_flush_some(sd_bus *bus) {
+    while (bus->wlen > 0) {
+        ssize_t n = send(bus->fd, bus->wbuf, bus->wlen, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN) ? 0 : -errno;
+        }
+        memmove(bus->wbuf, bus->wbuf + n, bus->wlen - (size_t)n);
+        bus->wlen -= (size_t)n;
+    }
+    return 0;
+}
+
+// Serialize `m` onto the connection's write queue and try to send it.
+static int bus_msg_send(sd_bus *bus, sd_bus_message *m, uint32_t *serial) {
+    if (bus->fd < 0) return -ENOTCONN;
+    uint32_t s = bus->serial + 1;
+    if (s == 0) s = 1;
+    bus_buf_t b = { bus->wbuf + bus->wlen, 0, sizeof(bus->wbuf) - bus->wlen, 0 };
+    unsigned char fixed[4] = { 'l', m->type, m->flags, 1 };
+    bus_put(&b, fixed, 4);
+    bus_put_u32(&b, (uint32_t)m->body_len);
+    bus_put_u32(&b, s);
+    bus_put_u32(&b, 0); // header field array length, patched below
+    bus_put_field(&b, BUS_FIELD_PATH, 'o', m->path, 0);
+    bus_put_field(&b, BUS_FIELD_INTERFACE, 's', m->interface, 0);
+    bus_put_field(&b, BUS_FIELD_MEMBER, 's', m->member, 0);
+    bus_put_field(&b, BUS_FIELD_ERROR_NAME, 's', m->error_name, 0);
+    if (m->reply_serial) bus_put_field(&b, BUS_FIELD_REPLY_SERIAL, 'u', NULL, m->reply_serial);
+    bus_put_field(&b, BUS_FIELD_DESTINATION, 's', m->destination, 0);
+    if (m->body_len) bus_put_field(&b, BUS_FIELD_SIGNATURE, 'g', m->sig, 0);
+    uint32_t fields = (uint32_t)(b.len - 16);
+    bus_pad(&b, 8);
+    bus_put(&b, m->obody, m->body_len);
+    if (b.err) return -ENOBUFS;
+    bus_le32(b.p + 12, fields);
+    bus->wlen += b.len;
+    bus->serial = s;
+    m->serial = s;
+    if (serial) *serial = s;
+    return bus_flush_some(bus);
+}
+
+static int bus_pending_add(sd_bus *bus, uint32_t serial, sd_bus_message_handler_t callback, void *userdata) {
+    for (int i = 0; i < BUS_MAX_PENDING; i++) {
+        bus_pending_t *p = &bus->pending[i];
+        if (p->serial) continue;
+        *p = (bus_pending_t){ serial, bus_now_us() + BUS_CALL_TIMEOUT_US, callback, userdata };
+        return 0;
+    }
+    return -ENOBUFS;
+}
+
+static int sd_bus_new(sd_bus **ret) {
+    sd_bus *bus = calloc(1, sizeof(*bus));
+    if (!bus) return -ENOMEM;
+    bus->fd = -1;
+    *ret = bus;
+    return 0;
+}
+
+static int sd_bus_set_address(sd_bus *bus, const char *address) {
+    static const char prefix[] = "unix:path=";
+    if (strncmp(address, prefix, sizeof(prefix) - 1) != 0) return -EPROTONOSUPPORT;
+    const char *path = address + sizeof(prefix) - 1;
+    size_t n = strcspn(path, ",;");
+    if (n == 0 || n >= sizeof(bus->sock)) return -EINVAL;
+    memcpy(bus->sock, path, n);
+    bus->sock[n] = '\0';
+    return 0;
+}
+
+static int sd_bus_set_bus_client(sd_bus *bus, int b) {
+    bus->bus_client = b;
+    return 0;
+}
+
+// Consume the server's reply line to the authentication. Returns 1 once it
+// was accepted, 0 if the line is incomplete.
+static int bus_auth_reply(sd_bus *bus) {
+    unsigned char *eol = memmem(bus->rbuf, bus->rlen, "\r\n", 2);
+    if (!eol) {
+        if (bus->rlen == sizeof(bus->rbuf)) return -EBADMSG;
+        return bus_now_us() >= bus->auth_deadline ? -ETIMEDOUT : 0;
+    }
+    if (bus->rlen < 3 || memcmp(bus->rbuf, "OK ", 3) != 0) return -EPERM;
+    size_t line = (size_t)(eol - bus->rbuf) + 2;
+    memmove(bus->rbuf, bus->rbuf + line, bus->rlen - line);
+    bus->rlen -= line;
+    bus->auth_deadline = 0;
+    return 1;
+}
+
+// Connect as the effective uid (which is what the server sees through
+// SO_PEERCRED) and queue the authentication, with BEGIN and Hello pipelined
+// behind it; the server's answer is handled by sd_bus_process(). Does not
+// block, so the caller may drop a temporary euid right after.
+static int sd_bus_start(sd_bus *bus) {
+    if (!*bus->sock) return -EINVAL;
+    bus->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bus->fd < 0) return -errno;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    memcpy(sa.sun_path, bus->sock, strlen(bus->sock) + 1);
+    if (connect(bus->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) return -errno;
+
+    // The uid goes in as hex-encoded decimal digits; BEGIN is pipelined
+    char uid[16], auth[64];
+    int ul = snprintf(uid, sizeof(uid), "%u", (unsigned)geteuid());
+    size_t al = 0;
+    auth[al++] = '\0';
+    al += (size_t)snprintf(auth + al, sizeof(auth) - al, "AUTH EXTERNAL ");
+    for (int i = 0; i < ul; i++) al += (size_t)snprintf(auth + al, sizeof(auth) - al, "%02x", (unsigned char)uid[i]);
+    al += (size_t)snprintf(auth + al, sizeof(auth) - al, "\r\nBEGIN\r\n");
+    memcpy(bus->wbuf, auth, al);
+    bus->wlen = al;
+    bus->auth_deadline = bus_now_us() + BUS_START_TIMEOUT_MS * 1000ULL;
+    int r = bus_flush_some(bus);
+    if (r < 0) return r;
+
+    if (bus->bus_client) {
+        sd_bus_message *m = &bus->out[0];
+        bus_msg_init(m, bus, BUS_MSG_CALL, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "Hello");
+        r = bus_msg_send(bus, m, NULL);
+        if (r < 0) return r;
+    }
+    return 0;
+}
+
+static sd_bus *sd_bus_unref(sd_bus *bus);
+
+static int sd_bus_open_system(sd_bus **ret) {
+    const char *addr = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    if (!addr || !*addr) addr = BUS_DEFAULT_SYSTEM_ADDRESS;
+    sd_bus *bus = NULL;
+    int r = sd_bus_new(&bus);
+    if (r < 0) return r;
+    r = sd_bus_set_address(bus, addr);
+    if (r >= 0) r = sd_bus_set_bus_client(bus, 1);
+    if (r >= 0) r = sd_bus_start(bus);
+    if (r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+    *ret = bus;
+    return 0;
+}
+
+static int sd_bus_flush(sd_bus *bus) {
+    if (bus->fd < 0) return -ENOTCONN;
+    while (bus->wlen > 0) {
+        int r = bus_flush_some(bus);
+        if (r < 0) return r;
+        if (bus->wlen == 0) break;
+        struct pollfd pfd = { .fd = bus->fd, .events = POLLOUT };
+        if (poll(&pfd, 1, BUS_START_TIMEOUT_MS) == 0) return -ETIMEDOUT;
+    }
+    return 0;
+}
+
+static sd_bus *sd_bus_unref(sd_bus *bus) {
+    if (!bus) return NULL;
+    if (bus->fd >= 0) close(bus->fd);
+    free(bus);
+    return NULL;
+}
+
+static sd_bus *sd_bus_close_unref(sd_bus *bus) {
+    return sd_bus_unref(bus);
+}
+
+static sd_bus *sd_bus_flush_close_unref(sd_bus *bus) {
+    if (bus && bus->fd >= 0) (void)sd_bus_flush(bus);
+    return sd_bus_unref(bus);
+}
+
+static int sd_bus_get_fd(sd_bus *bus) {
+    return bus->fd;
+}
+
+static int sd_bus_get_events(sd_bus *bus) {
+    return POLLIN | (bus->wlen ? POLLOUT : 0);
+}
+
+// Earliest reply deadline (CLOCK_MONOTONIC, µs), UINT64_MAX if none
+static int sd_bus_get_timeout(sd_bus *bus, uint64_t *usec) {
+    uint64_t t = bus->auth_deadline ? bus->auth_deadline : UINT64_MAX;
+    for (int i = 0; i < BUS_MAX_PENDING; i++) {
+        if (bus->pending[i].serial && bus->pending[i].deadline < t) t = bus->pending[i].deadline;
+    }
+    *usec = t;
+    return t != UINT64_MAX;
+}
+
+/* -------------------- Messages -------------------- */
+
+static int sd_bus_message_new_method_call(sd_bus *bus, sd_bus_message **m, const char *destination,
+                                          const char *path, const char *interface, const char *member) {
+    for (size_t i = 0; i < sizeof(bus->out) / sizeof(bus->out[0]); i++) {
+        if (bus->out[i].pooled) continue;
+        bus_msg_init(&bus->out[i], bus, BUS_MSG_CALL, destination, path, interface, member);
+        bus->out[i].pooled = 1;
+        *m = &bus->out[i];
+        return 0;
+    }
+    return -ENOBUFS;
+}
+
+static sd_bus_message *sd_bus_message_unref(sd_bus_message *m) {
+    if (m) m->pooled = 0;
+    return NULL;
+}
+
+static int sd_bus_message_append(sd_bus_message *m, const char *types, ...) {
+    va_list ap;
+    va_start(ap, types);
+    int r = bus_msg_appendv(m, types, ap);
+    va_end(ap);
+    return r;
+}
+
+static int sd_bus_message_set_expect_reply(sd_bus_message *m, int b) {
+    if (b) m->flags &= (uint8_t)~BUS_FLAG_NO_REPLY;
+    else m->flags |= BUS_FLAG_NO_REPLY;
+    return 0;
+}
+
+// Replies to a call sent this way are dropped when they arrive.
+static int sd_bus_send(sd_bus *bus, sd_bus_message *m, uint64_t *cookie) {
+    uint32_t serial;
+    int r = bus_msg_send(bus ? bus : m->bus, m, &serial);
+    if (r < 0) return r;
+    if (cookie) *cookie = serial;
+    return 1;
+}
+
+static int sd_bus_call_method_async(sd_bus *bus, sd_bus_slot **slot, const char *destination, const char *path,
+                                    const char *interface, const char *member, sd_bus_message_handler_t callback,
+                                    void *userdata, const char *types, ...) {
+    (void)slot;
+    sd_bus_message m;
+    bus_msg_init(&m, bus, BUS_MSG_CALL, destination, path, interface, member);
+    va_list ap;
+    va_start(ap, types);
+    int r = bus_msg_appendv(&m, types, ap);
+    va_end(ap);
+    if (r < 0) return r;
+    uint32_t serial;
+    r = bus_msg_send(bus, &m, &serial);
+    if (r < 0) return r;
+    if (callback) r = bus_pending_add(bus, serial, callback, userdata);
+    return r < 0 ? r : 1;
+}
+
+static int sd_bus_emit_signal(sd_bus *bus, const char *path, const char *interface, const char *member,
+                              const char *types, ...) {
+    sd_bus_message m;
+    bus_msg_init(&m, bus, BUS_MSG_SIGNAL, NULL, path, interface, member);
+    m.flags = BUS_FLAG_NO_REPLY;
+    va_list ap;
+    va_start(ap, types);
+    int r = bus_msg_appendv(&m, types, ap);
+    va_end(ap);
+    return r < 0 ? r : bus_msg_send(bus, &m, NULL);
+}
+
+static void bus_reply_init(sd_bus_message *m, const sd_bus_message *call, uint8_t type) {
+    bus_msg_init(m, call->bus, type, call->sender, NULL, NULL, NULL);
+    m->reply_serial = call->serial;
+    m->flags = BUS_FLAG_NO_REPLY;
+}
+
+static int sd_bus_reply_method_return(sd_bus_message *call, const char *types, ...) {
+    if (call->flags & BUS_FLAG_NO_REPLY) return 0;
+    sd_bus_message m;
+    bus_reply_init(&m, call, BUS_MSG_RETURN);
+    va_list ap;
+    va_start(ap, types);
+    int r = bus_msg_appendv(&m, types, ap);
+    va_end(ap);
+    return r < 0 ? r : bus_msg_send(call->bus, &m, NULL);
+}
+
+static int bus_reply_error(sd_bus_message *call, const char *name, const char *message) {
+    if (call->flags & BUS_FLAG_NO_REPLY) return 0;
+    sd_bus_message m;
+    bus_reply_init(&m, call, BUS_MSG_ERROR);
+    m.error_name = bus_msg_strdup(&m, name);
+    int r = sd_bus_message_append(&m, "s", message);
+    return r < 0 ? r : bus_msg_send(call->bus, &m, NULL);
+}
+
+static int sd_bus_error_set_const(sd_bus_error *e, const char *name, const char *message) {
+    if (e) *e = (sd_bus_error){ name, message, 0 };
+    return -EINVAL;
+}
+
+static int sd_bus_message_is_method_error(sd_bus_message *m, const char *name) {
+    return m->type == BUS_MSG_ERROR && (!name || !strcmp(m->error.name, name));
+}
+
+static const sd_bus_error *sd_bus_message_get_error(sd_bus_message *m) {
+    return m->type == BUS_MSG_ERROR ? &m->error : NULL;
+}
+
+// Only arrays of basic types are supported.
+static int sd_bus_message_enter_container(sd_bus_message *m, char type, const char *contents) {
+    if (type != 'a' || m->relem || !contents || !contents[0] || contents[1]) return -EINVAL;
+    if (m->rsig[0] != 'a' || m->rsig[1] != contents[0]) return -ENXIO;
+    m->rpos = bus_align(m->rpos, 4);
+    if (m->rpos + 4 > m->rend) return -EBADMSG;
+    size_t n = bus_rd32(m->body + m->rpos, m->big_endian);
+    m->rpos += 4;
+    // Elements of all supported types are 4-aligned, and so is the first one
+    if (n > m->rend - m->rpos) return -EBADMSG;
+    m->rsig += 2;
+    m->relem = contents[0];
+    m->rend = m->rpos + n;
+    return 1;
+}
+
+static int sd_bus_message_read(sd_bus_message *m, const char *types, ...) {
+    va_list ap;
+    va_start(ap, types);
+    int r = 1;
+    for (const char *t = types; *t && r > 0; t++) {
+        if (m->relem) {
+            if (*t != m->relem) r = -ENXIO;
+            else if (m->rpos >= m->rend) r = 0;
+        } else if (*m->rsig != *t) {
+            r = -ENXIO;
+        } else {
+            m->rsig++;
+        }
+        if (r <= 0) break;
+        switch (*t) {
+        case 'i':
+        case 'u':
+        case 'b':
+            m->rpos = bus_align(m->rpos, 4);
+            if (m->rpos + 4 > m->rend) {
+                r = -EBADMSG;
+                break;
+            }
+            *va_arg(ap, uint32_t *) = bus_rd32(m->body + m->rpos, m->big_endian);
+            m->rpos += 4;
+            break;
+        case 's':
+        case 'o':
+        case 'g': {
+            const char *s = bus_rd_str(m->body, &m->rpos, m->rend, *t, m->big_endian);
+            if (!s) r = -EBADMSG;
+            else *va_arg(ap, const char **) = s;
+            break;
+        }
+        default:
+            r = -EINVAL;
+        }
+    }
+    va_end(ap);
+    return r;
+}
+
+/* -------------------- Dispatch -------------------- */
+
+static int sd_bus_add_object_vtable(sd_bus *bus, sd_bus_slot **slot, const char *path, const char *interface,
+                                    const sd_bus_vtable *vtable, void *userdata) {
+    (void)slot;
+    if (strlen(path) >= sizeof(bus->objects[0].path) || strlen(interface) >= sizeof(bus->objects[0].interface))
+        return -EINVAL;
+    for (int i = 0; i < BUS_MAX_OBJECTS; i++) {
+        bus_object_t *o = &bus->objects[i];
+        if (o->vtable) continue;
+        snprintf(o->path, sizeof(o->path), "%s", path);
+        snprintf(o->interface, sizeof(o->interface), "%s", interface);
+        o->vtable = vtable;
+        o->userdata = userdata;
+        return 0;
+    }
+    return -ENOBUFS;
+}
+
+static int bus_dispatch_call(sd_bus *bus, sd_bus_message *m) {
+    if (!m->path || !m->member) return 0;
+    if (m->interface && !strcmp(m->interface, "org.freedesktop.DBus.Peer") && !strcmp(m->member, "Ping"))
+        return sd_bus_reply_method_return(m, "");
+
+    int known_path = 0;
+    for (int i = 0; i < BUS_MAX_OBJECTS; i++) {
+        bus_object_t *o = &bus->objects[i];
+        if (!o->vtable || strcmp(o->path, m->path)) continue;
+        known_path = 1;
+        if (m->interface && strcmp(o->interface, m->interface)) continue;
+        for (const sd_bus_vtable *v = o->vtable; v->type != 'E'; v++) {
+            if (v->type != 'M' || strcmp(v->member, m->member)) continue;
+            if (strcmp(v->signature, m->rsig))
+                return bus_reply_error(m, "org.freedesktop.DBus.Error.InvalidArgs", "Invalid arguments");
+            sd_bus_error err = SD_BUS_ERROR_NULL;
+            int r = v->handler(m, o->userdata, &err);
+            if (r >= 0) return 0;
+            if (err.name) return bus_reply_error(m, err.name, err.message ? err.message : "");
+            return bus_reply_error(m, "org.freedesktop.DBus.Error.Failed", strerror(-r));
+        }
+    }
+    if (!known_path) return bus_reply_error(m, "org.freedesktop.DBus.Error.UnknownObject", "Unknown object");
+    return bus_reply_error(m, "org.freedesktop.DBus.Error.UnknownMethod", "Unknown method");
+}
+
+static int bus_dispatch_reply(sd_bus *bus, sd_bus_message *m) {
+    for (int i = 0; i < BUS_MAX_PENDING; i++) {
+        bus_pending_t *p = &bus->pending[i];
+        if (!p->serial || p->serial != m->reply_serial) continue;
+        bus_pending_t call = *p;
+        p->serial = 0;
+        sd_bus_error err = SD_BUS_ERROR_NULL;
+        (void)call.callback(m, call.userdata, &err);
+        return 1;
+    }
+    return 1; // nobody waits for it
+}
+
+// Dispatch the next complete message in the receive buffer. Returns 1 if
+// one was consumed, 0 if more data is needed.
+static int bus_dispatch_one(sd_bus *bus) {
+    if (bus->skip) {
+        size_t n = bus->skip < bus->rlen ? bus->skip : bus->rlen;
+        memmove(bus->rbuf, bus->rbuf + n, bus->rlen - n);
+        bus->rlen -= n;
+        bus->skip -= n;
+        return n > 0;
+    }
+    size_t size = bus_msg_size(bus->rbuf, bus->rlen);
+    if (size == SIZE_MAX) return -EBADMSG;
+    if (size == 0) return 0;
+    if (size > sizeof(bus->rbuf)) {
+        bus->skip = size;
+        return 1;
+    }
+    if (bus->rlen < size) return 0;
+
+    sd_bus_message *m = &bus->in;
+    m->bus = bus;
+    int r = bus_msg_parse(m, bus->rbuf, size);
+    if (r >= 0) {
+        if (m->type == BUS_MSG_CALL) r = bus_dispatch_call(bus, m);
+        else if (m->type == BUS_MSG_RETURN || m->type == BUS_MSG_ERROR) r = bus_dispatch_reply(bus, m);
+        // signals (NameAcquired etc.) are not subscribed to and ignored
+    }
+    memmove(bus->rbuf, bus->rbuf + size, bus->rlen - size);
+    bus->rlen -= size;
+    return r < 0 ? r : 1;
+}
+
+// Fail the first call whose reply is overdue. Returns 1 if one was.
+static int bus_dispatch_timeout(sd_bus *bus) {
+    uint64_t now = bus_now_us();
+    for (int i = 0; i < BUS_MAX_PENDING; i++) {
+        bus_pending_t *p = &bus->pending[i];
+        if (!p->serial || p->deadline > now) continue;
+        bus_pending_t call = *p;
+        p->serial = 0;
+        sd_bus_message *m = &bus->in;
+        memset(m, 0, sizeof(*m));
+        m->bus = bus;
+        m->type = BUS_MSG_ERROR;
+        m->reply_serial = call.serial;
+        m->rsig = "";
+        m->error = (sd_bus_error){ "org.freedesktop.DBus.Error.NoReply", "Method call timed out", 0 };
+        sd_bus_error err = SD_BUS_ERROR_NULL;
+        (void)call.callback(m, call.userdata, &err);
+        return 1;
+    }
+    return 0;
+}
+
+// Do one unit of work without blocking: write queued data, fail an overdue
+// call, or read and dispatch one message. Returns >0 if something was done.
+static int sd_bus_process(sd_bus *bus, sd_bus_message **ret) {
+    if (ret) *ret = NULL;
+    if (bus->fd < 0) return -ENOTCONN;
+    int r = bus_flush_some(bus);
+    if (r < 0) return r;
+    if (bus->auth_deadline) {
+        r = bus_auth_reply(bus);
+        if (r != 0) return r;
+    } else {
+        if (bus_dispatch_timeout(bus)) return 1;
+        r = bus_dispatch_one(bus);
+        if (r != 0) return r;
+    }
+    if (bus->rlen == sizeof(bus->rbuf)) return -EBADMSG;
+    ssize_t n = recv(bus->fd, bus->rbuf + bus->rlen, sizeof(bus->rbuf) - bus->rlen, MSG_DONTWAIT);
+    if (n == 0) return -ECONNRESET;
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+    bus->rlen += (size_t)n;
+    return 1;
+}
+
+typedef struct {
+    int done;
+    int32_t result;
+    int error;
+} bus_sync_t;
+
+static int bus_sync_reply(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)err;
+    bus_sync_t *s = userdata;
+    s->done = 1;
+    if (sd_bus_message_is_method_error(m, NULL)) {
+        s->error = !strcmp(m->error.name, "org.freedesktop.DBus.Error.AccessDenied") ? -EACCES : -EIO;
+        return 0;
+    }
+    uint32_t v = 0;
+    if (sd_bus_message_read(m, "u", &v) > 0) s->result = (int32_t)v;
+    return 0;
+}
+
+// Blocks until the bus answers; only used while starting up. Like libsystemd,
+// asks not to be queued unless SD_BUS_NAME_QUEUE is given, so a name that is
+// already taken fails with -EEXIST instead of silently waiting in line.
+static int sd_bus_request_name(sd_bus *bus, const char *name, uint64_t flags) {
+    // D-Bus wire flags: 1 allow replacement, 2 replace existing, 4 do not queue
+    uint32_t param = 0;
+    if (flags & SD_BUS_NAME_ALLOW_REPLACEMENT) param |= 1;
+    if (flags & SD_BUS_NAME_REPLACE_EXISTING) param |= 2;
+    if (!(flags & SD_BUS_NAME_QUEUE)) param |= 4;
+
+    bus_sync_t s = { 0, 0, 0 };
+    int r = sd_bus_call_method_async(bus, NULL, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                     "org.freedesktop.DBus", "RequestName", bus_sync_reply, &s, "su",
+                                     name, param);
+    while (r >= 0 && !s.done) {
+        r = sd_bus_process(bus, NULL);
+        if (r != 0) continue;
+        uint64_t until;
+        sd_bus_get_timeout(bus, &until);
+        uint64_t now = bus_now_us();
+        struct pollfd pfd = { .fd = bus->fd, .events = (short)sd_bus_get_events(bus) };
+        if (poll(&pfd, 1, until <= now ? 0 : (int)((until - now + 999) / 1000)) < 0 && errno != EINTR) r = -errno;
+    }
+    if (r < 0) return r;
+    if (s.error) return s.error;
+    // 1: primary owner, 2: queued, 3: exists, 4: already owner
+    if (s.result == 2) return (flags & SD_BUS_NAME_QUEUE) ? 0 : -EEXIST;
+    if (s.result == 3) return -EEXIST;
+    if (s.result == 4) return -EALREADY;
+    return s.result == 1 ? 1 : -EIO;
+}
+
+/* -------------------- Journal -------------------- */
+
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+// Native protocol: "FIELD=value\n" per field; values containing a newline
+// use "FIELD\n" + 64-bit little-endian length + value + "\n".
+static int sd_journal_sendv(const struct iovec *iov, int n) {
+    static int fd = -1;
+    if (fd < 0) {
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -errno;
+    }
+    unsigned char buf[4096];
+    bus_buf_t b = { buf, 0, sizeof(buf), 0 };
+    for (int i = 0; i < n; i++) {
+        const char *f = iov[i].iov_base;
+        const char *eq = memchr(f, '=', iov[i].iov_len);
+        if (!eq) continue;
+        size_t name = (size_t)(eq - f), vlen = iov[i].iov_len - name - 1;
+        if (memchr(eq + 1, '\n', vlen)) {
+            unsigned char le[8];
+            bus_le32(le, (uint32_t)vlen);
+            bus_le32(le + 4, 0);
+            bus_put(&b, f, name);
+            bus_put(&b, "\n", 1);
+            bus_put(&b, le, 8);
+            bus_put(&b, eq + 1, vlen);
+        } else {
+            bus_put(&b, f, iov[i].iov_len);
+        }
+        bus_put(&b, "\n", 1);
+    }
+    if (b.err) return -ENOBUFS;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX, .sun_path = JOURNAL_SOCKET };
+    if (sendto(fd, buf, b.len, MSG_NOSIGNAL, (struct sockaddr *)&sa,
+               offsetof(struct sockaddr_un, sun_path) + sizeof(JOURNAL_SOCKET)) < 0)
+        return -errno;
+    return 0;
+}
+
+#endif
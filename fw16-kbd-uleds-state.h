@@ -0,0 +1,103 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// fw16-kbd-uleds-state.h
+//
+// Layout of the status page the daemon keeps in /run/fw16-kbd-uleds/state.
+// Monitoring tools mmap() the file read-only and take consistent snapshots
+// with fw16_state_snapshot(); no syscalls or IPC are needed per read.
+//
+// The page is updated under a seqlock: `seq` is odd while the daemon is
+// writing, and a snapshot is only valid if `seq` was even and unchanged
+// across the copy. Fields are only ever appended; readers should check
+// `magic`, `version` and `size` before use. The file is replaced when the
+// daemon restarts (compare `pid`).
+
+#ifndef FW16_KBD_ULEDS_STATE_H
+#define FW16_KBD_ULEDS_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FW16_STATE_MAGIC 0x36315746u // "FW16" little-endian
+#define FW16_STATE_VERSION 1
+#define FW16_STATE_MAX_CTX 4
+#define FW16_STATE_MAX_TARGETS 16
+
+enum fw16_state_health {
+    FW16_HEALTH_UNKNOWN = 0, // no transfer yet
+    FW16_HEALTH_OK,
+    FW16_HEALTH_DEGRADED,    // last 1-2 transfers failed
+    FW16_HEALTH_FAILING      // 3 or more consecutive failures
+};
+
+struct fw16_state_ctx {
+    char name[64];           // uleds name, e.g. framework::kbd_backlight
+    uint32_t active;
+    uint32_t level;          // level applied to the modules (0-3)
+    uint32_t want_level;     // level asked for before idle/display holds
+    uint32_t holds;          // bit 0: idle dim, bit 1: display off
+    uint32_t num_targets;
+    uint32_t reserved[3];
+};
+
+struct fw16_state_target {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t ctx;            // index into fw16_state.ctx
+    char hidraw[16];
+    uint32_t health;         // enum fw16_state_health
+    uint32_t fails;          // consecutive failed transfers
+    uint32_t rtt_us;         // last successful HID round trip
+    uint32_t reserved;
+    uint64_t ok_count;
+    uint64_t err_count;
+};
+
+struct fw16_state_counters {
+    uint64_t uleds_events;   // brightness events read from uleds
+    uint64_t hw_changes;     // level changes detected by polling
+    uint64_t uevents;        // kernel uevents received
+    uint64_t rescans;        // device rescans
+    uint64_t hid_xfers;      // HID request/reply transactions
+    uint64_t hid_errors;     // failed or timed out transactions
+    uint64_t sysfs_writes;   // LED brightness writes
+    uint64_t ui_syncs;       // desktop UI synchronizations
+    uint64_t hid_timeouts;   // transactions that got no matching reply
+    uint64_t uleds_coalesced; // uleds events that mapped to the current level
+    uint64_t hw_polls_skipped; // polls skipped for runtime-suspended modules
+};
+
+struct fw16_state {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;           // sizeof(struct fw16_state) of the writer
+    uint32_t seq;            // seqlock sequence, odd while writing
+    uint64_t updated_ms;     // CLOCK_MONOTONIC of the last update
+    uint32_t pid;
+    uint32_t num_ctx;
+    uint32_t num_targets;
+    uint32_t reserved;
+    struct fw16_state_ctx ctx[FW16_STATE_MAX_CTX];
+    struct fw16_state_target targets[FW16_STATE_MAX_TARGETS];
+    struct fw16_state_counters counters;
+};
+
+// Copy a consistent snapshot of `page` into `out`. Returns 0 on success, -1 if
+// the page is not a compatible status page or the writer kept it busy.
+static inline int fw16_state_snapshot(const struct fw16_state *page, struct fw16_state *out) {
+    if (page->magic != FW16_STATE_MAGIC || page->version != FW16_STATE_VERSION) return -1;
+    for (int tries = 0; tries < 1000; tries++) {
+        uint32_t s1 = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1) continue;
+        memcpy(out, page, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == s1) return 0;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// fw16-kbd-uleds-via.h
+//
+// The QMK VIA raw HID commands the Framework 16 input modules answer (gleaned
+// from Framework's qmk_hid), and a model of a module's lighting state that
+// answers them the way the firmware does. The daemon's mock transport and
+// fw16-kbd-emu both use the model, so tests against either see the same
+// device.
+//
+// Requests and replies are 32-byte reports without a report ID. A reply
+// echoes the request with values filled in; a command the module does not
+// handle comes back with byte 0 replaced by id_unhandled and the rest of the
+// request untouched.
+
+#ifndef FW16_KBD_ULEDS_VIA_H
+#define FW16_KBD_ULEDS_VIA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QMK_CMD_GET_PROTOCOL_VERSION 0x01
+#define QMK_CMD_SET_VALUE 0x07
+#define QMK_CMD_GET_VALUE 0x08
+#define QMK_CMD_CUSTOM_SAVE 0x09
+#define QMK_CH_BACKLIGHT 0x01
+#define QMK_CH_RGB_MATRIX 0x03
+#define QMK_ADDR_BRIGHTNESS 0x01
+#define QMK_ADDR_RGB_EFFECT 0x02
+#define QMK_ADDR_RGB_SPEED 0x03
+#define QMK_ADDR_RGB_COLOR 0x04 // 2 bytes: hue, saturation
+#define QMK_ID_UNHANDLED 0xFF
+#define VIA_PROTOCOL_VERSION 0x000C
+#define VIA_REPORT_LEN 32
+
+typedef struct {
+    int has_backlight;       // white backlight (keyboards, numpad)
+    int has_rgb;             // RGB matrix (macropad)
+    uint8_t backlight;
+    uint8_t rgb_brightness;
+    uint8_t rgb_effect;
+    uint8_t rgb_speed;
+    uint8_t rgb_hue;
+    uint8_t rgb_sat;
+    uint64_t saves;
+} via_module_t;
+
+// A module with product id `pid` as it comes up: the macropad has an RGB
+// matrix, every other module a white backlight.
+static void via_module_init(via_module_t *m, uint16_t pid, uint8_t brightness) {
+    *m = (via_module_t){ 0 };
+    m->has_rgb = (pid == 0x0013);
+    m->has_backlight = !m->has_rgb;
+    m->backlight = m->rgb_brightness = brightness;
+    m->rgb_effect = 1;
+    m->rgb_speed = 128;
+    m->rgb_sat = 255;
+}
+
+// Build the reply to one VIA request in place.
+static void via_handle(via_module_t *m, uint8_t *data) {
+    uint8_t cmd = data[0], channel = data[1], addr = data[2];
+    uint8_t *value = &data[3];
+
+    if (cmd == QMK_CMD_GET_PROTOCOL_VERSION) {
+        data[1] = VIA_PROTOCOL_VERSION >> 8;
+        data[2] = VIA_PROTOCOL_VERSION & 0xFF;
+        return;
+    }
+    if (cmd != QMK_CMD_SET_VALUE && cmd != QMK_CMD_GET_VALUE && cmd != QMK_CMD_CUSTOM_SAVE) {
+        data[0] = QMK_ID_UNHANDLED;
+        return;
+    }
+    if (channel == QMK_CH_BACKLIGHT && m->has_backlight) {
+        if (cmd == QMK_CMD_CUSTOM_SAVE) {
+            m->saves++;
+        } else if (addr != QMK_ADDR_BRIGHTNESS) {
+            data[0] = QMK_ID_UNHANDLED;
+        } else if (cmd == QMK_CMD_SET_VALUE) {
+            m->backlight = value[0];
+        } else {
+            value[0] = m->backlight;
+        }
+        return;
+    }
+    if (channel == QMK_CH_RGB_MATRIX && m->has_rgb) {
+        if (cmd == QMK_CMD_CUSTOM_SAVE) {
+            m->saves++;
+            return;
+        }
+        int set = cmd == QMK_CMD_SET_VALUE;
+        switch (addr) {
+        case QMK_ADDR_BRIGHTNESS:
+            if (set) m->rgb_brightness = value[0];
+            else value[0] = m->rgb_brightness;
+            break;
+        case QMK_ADDR_RGB_EFFECT:
+            if (set) m->rgb_effect = value[0];
+            else value[0] = m->rgb_effect;
+            break;
+        case QMK_ADDR_RGB_SPEED:
+            if (set) m->rgb_speed = value[0];
+            else value[0] = m->rgb_speed;
+            break;
+        case QMK_ADDR_RGB_COLOR:
+            if (set) {
+                m->rgb_hue = value[0];
+                m->rgb_sat = value[1];
+            } else {
+                value[0] = m->rgb_hue;
+                value[1] = m->rgb_sat;
+            }
+            break;
+        default:
+            data[0] = QMK_ID_UNHANDLED;
+        }
+        return;
+    }
+    data[0] = QMK_ID_UNHANDLED;
+}
+
+// Fn+Space: off -> low -> medium -> high -> off. Returns the new brightness.
+static uint8_t via_step(via_module_t *m) {
+    static const uint8_t steps[] = { 0, 85, 170, 255 };
+    uint8_t cur = m->has_backlight ? m->backlight : m->rgb_brightness;
+    size_t i = 0;
+    while (i < sizeof(steps) && steps[i] <= cur) i++;
+    uint8_t next = (i < sizeof(steps)) ? steps[i] : 0;
+    if (m->has_backlight) m->backlight = next;
+    if (m->has_rgb) m->rgb_brightness = next;
+    return next;
+}
+
+#endif
@@ -27,7 +27,8 @@
 //
 // Requires:
 //   - kernel module: uleds
-//   - libsystemd (for D-Bus synchronization)
+//   - libsystemd (for D-Bus synchronization), unless built with
+//     `make DBUS=builtin` (see fw16-kbd-uleds-sd.h)
 
 #define _GNU_SOURCE
 
@@ -35,50 +36,529 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <grp.h>
+#include <limits.h>
+#include <linux/input.h>
 #include <linux/netlink.h>
 #include <linux/uleds.h>
+#include <malloc.h>
 #include <poll.h>
-#include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <linux/hidraw.h>
-#include <systemd/sd-bus.h>
+#include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fw16-kbd-uleds-state.h"
+#include "fw16-kbd-uleds-via.h"
+
+#ifdef FW16_DBUS_BUILTIN
+#include "fw16-kbd-uleds-sd.h"
+#else
+#include <systemd/sd-bus.h>
+#include <systemd/sd-journal.h>
+#endif
+
+// USDT probes for bpftrace/SystemTap (`bpftrace -l 'usdt:/usr/bin/fw16-kbd-uleds:*'`).
+// A disabled probe is a single NOP. FW16_SDT=1 requires <sys/sdt.h>,
+// FW16_SDT=0 compiles the probes away; unset, they are built in when the
+// header is found (see SDT in the Makefile).
+#if defined(FW16_SDT) && FW16_SDT
+#include <sys/sdt.h>
+#elif !defined(FW16_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifdef STAP_PROBEV
+#define PROBE(name, ...) STAP_PROBEV(fw16_kbd_uleds, name, ##__VA_ARGS__)
+#else
+static inline void probe_nop(int unused, ...) { (void)unused; }
+#define PROBE(name, ...) do { if (0) probe_nop(0, ##__VA_ARGS__); } while (0)
+#endif
+
+/* -------------------- Clock and paths -------------------- */
+
+// Hermetic test mode. --root points the kernel interfaces at a generated tree
+// (<root>/sys, <root>/dev, <root>/run), and --virtual-clock replaces
+// CLOCK_MONOTONIC with a counter that only moves when the daemon would wait:
+// sleeps and poll() timeouts with nothing ready complete at once and advance
+// it instead, so discovery and polling run as fast as the CPU allows.
+static const char *g_sys_root = "/sys";
+static const char *g_dev_root = "/dev";
+static const char *g_run_root = "/run";
+
+static int g_clock_virtual = 0;
+static uint64_t g_clock_us = 0;
+
+static uint64_t now_us(void) {
+    if (g_clock_virtual) return g_clock_us;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static uint64_t now_ms(void) {
+    return now_us() / 1000ULL;
+}
+
+static void clock_sleep_us(uint64_t us) {
+    if (g_clock_virtual) g_clock_us += us;
+    else usleep((useconds_t)us);
+}
+
+// poll() that passes a timeout on the virtual clock instead of waiting it out.
+// With nothing ready and no timeout (-1), it blocks for real.
+static int clock_poll(struct pollfd *pfds, nfds_t n, int timeout) {
+    if (!g_clock_virtual || timeout == 0) return poll(pfds, n, timeout);
+    int r = poll(pfds, n, 0);
+    if (r != 0) return r;
+    if (timeout < 0) return poll(pfds, n, -1);
+    g_clock_us += (uint64_t)timeout * 1000ULL;
+    return 0;
+}
+
+// Start the virtual clock where the real one is, so absolute deadlines
+// computed before and after the switch stay comparable. It starts on a whole
+// millisecond, so timers in ms fire exactly when due.
+static void clock_set_virtual(void) {
+    g_clock_us = now_us() / 1000 * 1000;
+    g_clock_virtual = 1;
+}
 
-// QMK/VIA HID protocol constants (gleaned from Framework's qmk_hid)
-#define QMK_CMD_SET_VALUE 0x07
-#define QMK_CMD_GET_VALUE 0x08
-#define QMK_CH_BACKLIGHT 0x01
-#define QMK_CH_RGB_MATRIX 0x03
-#define QMK_ADDR_BRIGHTNESS 0x01
+static int paths_set_root(const char *root) {
+    static char sys[PATH_MAX], dev[PATH_MAX], run[PATH_MAX];
+    if (!*root || strlen(root) > PATH_MAX - 8) return -1;
+    snprintf(sys, sizeof(sys), "%s/sys", root);
+    snprintf(dev, sizeof(dev), "%s/dev", root);
+    snprintf(run, sizeof(run), "%s/run", root);
+    g_sys_root = sys;
+    g_dev_root = dev;
+    g_run_root = run;
+    return 0;
+}
 
 /* -------------------- Debug -------------------- */
 
+// Messages above this level are compiled out (`make DEBUG_MAX=1`)
+#ifndef FW16_DEBUG_MAX
+#define FW16_DEBUG_MAX 3
+#endif
+
 static int g_debug_level = 0;
+static int g_log_journal = 0; // stderr is the journal: log with structured fields
+
+// Optional structured fields for the journal. A NULL ctx, a 0:0 target and
+// negative level/latency are left out.
+typedef struct {
+    const char *ctx;
+    uint16_t vid;
+    uint16_t pid;
+    int level;
+    long long latency_us;
+} log_fields_t;
+
+#define LOG_FIELDS(ctx, vid, pid, level, latency_us) (&(log_fields_t){ (ctx), (vid), (pid), (level), (latency_us) })
+
+// Each call site may log LOG_RL_BURST messages per LOG_RL_INTERVAL_MS; the
+// rest are counted and reported once the window ends (by the main loop, so a
+// site that goes quiet still gets its note).
+#define LOG_RL_INTERVAL_MS 5000
+#define LOG_RL_BURST 20
+#define LOG_RL_PENDING 16
+
+typedef struct {
+    uint64_t window_start;
+    unsigned count;
+    unsigned suppressed;
+    int lvl;
+    int pending; // listed in g_log_pending
+} log_ratelimit_t;
+
+// Call sites with a suppression note still to write
+static log_ratelimit_t *g_log_pending[LOG_RL_PENDING];
+static size_t g_log_pending_len;
+
+static void log_msg(log_ratelimit_t *rl, int lvl, const log_fields_t *f, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define dbg_fields(lvl, fields, ...) do { \
+        if ((lvl) <= FW16_DEBUG_MAX && g_debug_level >= (lvl)) { \
+            static log_ratelimit_t rl_; \
+            log_msg(&rl_, (lvl), (fields), __VA_ARGS__); \
+        } \
+    } while (0)
+#define dbg(lvl, ...) dbg_fields(lvl, NULL, __VA_ARGS__)
+
+// Operation counters, also exported through the status page
+static struct fw16_state_counters g_counters;
+
+// Fixed-bucket latency histogram (upper bounds in microseconds, plus +Inf)
+#define HIST_BUCKETS 12
+static const uint32_t hist_bounds_us[HIST_BUCKETS] = {
+    250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000, 128000, 256000, 512000
+};
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_us;
+} hist_t;
+
+static void hist_observe(hist_t *h, uint64_t us) {
+    int i = 0;
+    while (i < HIST_BUCKETS && us > hist_bounds_us[i]) i++;
+    h->buckets[i]++;
+    h->count++;
+    h->sum_us += us;
+}
+
+// Flight recorder: the last FLIGHT_LEN significant events in a fixed ring,
+// recorded at any debug level and dumped on SIGUSR1 or a fatal signal (see
+// flight_dump()). Recording is a clock read and a 24-byte store.
+#define FLIGHT_LEN 1024
+
+enum {
+    FR_HID = 1,  // vid:pid, a = command, b = channel, v1 = rc, v2 = duration (us)
+    FR_ULEDS,    // a = context, v1 = raw value, v2 = level
+    FR_UEVENT,   // v1 = length
+    FR_LEVEL,    // a = context, b = origin, c = holds, v1 = applied level, v2 = wanted level
+    FR_RESCAN,   // v1 = targets, v2 = duration (us)
+    FR_RESUME,   // v1 = time suspended (ms)
+};
+
+typedef struct {
+    uint64_t t_us;
+    uint8_t type;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint16_t vid;
+    uint16_t pid;
+    int32_t v1;
+    int32_t v2;
+} flight_rec_t;
+
+static flight_rec_t g_flight[FLIGHT_LEN];
+static uint64_t g_flight_next = 0; // total records ever written
+static volatile sig_atomic_t g_flight_dump_req = 0;
+
+static void flight_rec(uint8_t type, uint16_t vid, uint16_t pid, uint8_t a, uint8_t b, uint8_t c, int32_t v1, int32_t v2) {
+    flight_rec_t *r = &g_flight[g_flight_next++ % FLIGHT_LEN];
+    r->t_us = now_us();
+    r->type = type;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+    r->vid = vid;
+    r->pid = pid;
+    r->v1 = v1;
+    r->v2 = v2;
+}
+
+// Per-change tracing: every brightness change gets an ID, and each pipeline
+// stage it passes (event read, decode, HID request/ack per target, sysfs
+// write, UI sync, notifications) is stamped relative to its start. The
+// change is written as one JSON line to stderr when it completes; stages that
+// only happen later (bus replies) follow as their own line with the same ID.
+#define TRACE_MAX_STAGES 48
+#define TRACE_RECENT 4
+
+typedef struct {
+    const char *stage;   // static string
+    uint16_t vid;        // 0:0 when not target specific
+    uint16_t pid;
+    uint8_t channel;
+    int8_t rc;
+    uint32_t at_us;      // offset from the start of the change
+} trace_stage_t;
+
+typedef struct {
+    int enabled;
+    int active;
+    uint64_t next_id;
+    uint64_t id;
+    uint64_t t0_us;
+    const char *origin;
+    const char *ctx;
+    size_t len;
+    unsigned dropped;
+    trace_stage_t stages[TRACE_MAX_STAGES];
+    struct { uint64_t id, t0_us; } recent[TRACE_RECENT]; // completed changes, for late stages
+    size_t recent_next;
+} trace_t;
+
+static trace_t g_trace;
+
+// Start a trace at `t0_us` unless one is already running (nested calls of
+// the apply path belong to the outer change). Returns 1 if the caller owns it.
+static int trace_begin(const char *origin, const char *ctx, uint64_t t0_us) {
+    if (!g_trace.enabled || g_trace.active) return 0;
+    g_trace.active = 1;
+    g_trace.id = ++g_trace.next_id;
+    g_trace.t0_us = t0_us;
+    g_trace.origin = origin;
+    g_trace.ctx = ctx;
+    g_trace.len = 0;
+    g_trace.dropped = 0;
+    return 1;
+}
+
+static void trace_mark(const char *stage, uint16_t vid, uint16_t pid, unsigned char channel, int rc) {
+    if (!g_trace.active) return;
+    if (g_trace.len >= TRACE_MAX_STAGES) {
+        g_trace.dropped++;
+        return;
+    }
+    trace_stage_t *st = &g_trace.stages[g_trace.len++];
+    st->stage = stage;
+    st->vid = vid;
+    st->pid = pid;
+    st->channel = channel;
+    st->rc = (int8_t)rc;
+    st->at_us = (uint32_t)(now_us() - g_trace.t0_us);
+}
 
-static void dbg(int lvl, const char *fmt, ...) {
-    if (g_debug_level < lvl) return;
+// Nothing changed after all (e.g. a hardware poll that read the same level)
+static void trace_discard(void) {
+    g_trace.active = 0;
+}
+
+static void trace_end(unsigned level) {
+    if (!g_trace.active) return;
+    g_trace.active = 0;
+    char buf[4096];
+    size_t len = 0;
+#define TRACE_APPEND(...) do { \
+        int n_ = snprintf(buf + len, sizeof(buf) - len, __VA_ARGS__); \
+        if (n_ > 0) len = (len + (size_t)n_ < sizeof(buf)) ? len + (size_t)n_ : sizeof(buf) - 1; \
+    } while (0)
+    TRACE_APPEND("{\"trace\":%llu,\"ctx\":\"%s\",\"origin\":\"%s\",\"level\":%u,\"total_us\":%llu,\"stages\":[",
+                 (unsigned long long)g_trace.id, g_trace.ctx, g_trace.origin, level,
+                 (unsigned long long)(now_us() - g_trace.t0_us));
+    for (size_t i = 0; i < g_trace.len; i++) {
+        const trace_stage_t *st = &g_trace.stages[i];
+        TRACE_APPEND("%s{\"stage\":\"%s\",\"t_us\":%u", i ? "," : "", st->stage, st->at_us);
+        if (st->vid || st->pid)
+            TRACE_APPEND(",\"target\":\"%04x:%04x\",\"channel\":%u,\"rc\":%d", st->vid, st->pid, st->channel, st->rc);
+        TRACE_APPEND("}");
+    }
+    TRACE_APPEND("],\"dropped\":%u}\n", g_trace.dropped);
+#undef TRACE_APPEND
+    fputs(buf, stderr);
+    fflush(stderr);
+    g_trace.recent[g_trace.recent_next].id = g_trace.id;
+    g_trace.recent[g_trace.recent_next].t0_us = g_trace.t0_us;
+    g_trace.recent_next = (g_trace.recent_next + 1) % TRACE_RECENT;
+}
+
+// ID of the running change, to hand to work that completes asynchronously
+static uint64_t trace_current(void) {
+    return g_trace.active ? g_trace.id : 0;
+}
+
+// Stamp a stage of change `id` that completed after the change itself did
+static void trace_late(uint64_t id, const char *stage, int rc) {
+    if (!id) return;
+    if (g_trace.active && g_trace.id == id) {
+        trace_mark(stage, 0, 0, 0, rc);
+        return;
+    }
+    for (size_t i = 0; i < TRACE_RECENT; i++) {
+        if (g_trace.recent[i].id != id) continue;
+        fprintf(stderr, "{\"trace\":%llu,\"stage\":\"%s\",\"t_us\":%llu,\"rc\":%d}\n",
+                (unsigned long long)id, stage, (unsigned long long)(now_us() - g_trace.recent[i].t0_us), rc);
+        fflush(stderr);
+        return;
+    }
+}
+
+// Use the native journal protocol when systemd connected stderr to it
+static void log_init(void) {
+    const char *js = getenv("JOURNAL_STREAM");
+    unsigned long long dev, ino;
+    struct stat st;
+    if (js && sscanf(js, "%llu:%llu", &dev, &ino) == 2 && fstat(STDERR_FILENO, &st) == 0 &&
+        (unsigned long long)st.st_dev == dev && (unsigned long long)st.st_ino == ino)
+        g_log_journal = 1;
+}
+
+static void log_write(int lvl, const log_fields_t *f, const char *msg, size_t len) {
+    if (!g_log_journal) {
+        fwrite(msg, 1, len, stderr);
+        fflush(stderr);
+        return;
+    }
+    while (len > 0 && msg[len - 1] == '\n') len--;
+    char m[1040], ctx[80], target[32], level[24], latency[40];
+    struct iovec iov[6];
+    int n = 0;
+    int ml = snprintf(m, sizeof(m), "MESSAGE=%.*s", (int)len, msg);
+    iov[n++] = (struct iovec){ m, (size_t)ml < sizeof(m) ? (size_t)ml : sizeof(m) - 1 };
+    iov[n++] = (struct iovec){ lvl <= 1 ? "PRIORITY=6" : "PRIORITY=7", 10 };
+    if (f && f->ctx) {
+        int l = snprintf(ctx, sizeof(ctx), "CONTEXT=%s", f->ctx);
+        iov[n++] = (struct iovec){ ctx, (size_t)l < sizeof(ctx) ? (size_t)l : sizeof(ctx) - 1 };
+    }
+    if (f && (f->vid || f->pid)) {
+        int l = snprintf(target, sizeof(target), "TARGET=%04x:%04x", f->vid, f->pid);
+        iov[n++] = (struct iovec){ target, (size_t)l };
+    }
+    if (f && f->level >= 0) {
+        int l = snprintf(level, sizeof(level), "LEVEL=%d", f->level);
+        iov[n++] = (struct iovec){ level, (size_t)l };
+    }
+    if (f && f->latency_us >= 0) {
+        int l = snprintf(latency, sizeof(latency), "LATENCY_US=%lld", f->latency_us);
+        iov[n++] = (struct iovec){ latency, (size_t)l };
+    }
+    (void)sd_journal_sendv(iov, n);
+}
+
+static void log_msg(log_ratelimit_t *rl, int lvl, const log_fields_t *f, const char *fmt, ...) {
+    uint64_t now = now_ms();
+    if (now - rl->window_start >= LOG_RL_INTERVAL_MS) {
+        if (rl->suppressed) {
+            char note[64];
+            int n = snprintf(note, sizeof(note), "(suppressed %u similar messages)\n", rl->suppressed);
+            log_write(lvl, NULL, note, (size_t)n);
+        }
+        rl->window_start = now;
+        rl->count = 0;
+        rl->suppressed = 0;
+    }
+    if (rl->count >= LOG_RL_BURST) {
+        rl->suppressed++;
+        rl->lvl = lvl;
+        // If the list is full the note still goes out with the site's next message
+        if (!rl->pending && g_log_pending_len < LOG_RL_PENDING) {
+            rl->pending = 1;
+            g_log_pending[g_log_pending_len++] = rl;
+        }
+        return;
+    }
+    rl->count++;
+
+    char msg[1024];
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    int n = vsnprintf(msg, sizeof(msg), fmt, ap);
     va_end(ap);
-    fflush(stderr);
+    if (n < 0) return;
+    log_write(lvl, f, msg, (size_t)n < sizeof(msg) ? (size_t)n : sizeof(msg) - 1);
 }
 
-static uint64_t now_ms(void) {
+// When the first pending suppression window ends (0 if none)
+static uint64_t log_deadline(void) {
+    uint64_t due = 0;
+    for (size_t i = 0; i < g_log_pending_len; i++) {
+        uint64_t d = g_log_pending[i]->window_start + LOG_RL_INTERVAL_MS;
+        if (!due || d < due) due = d;
+    }
+    return due;
+}
+
+// Write the notes of call sites whose window has ended (all of them if `force`)
+static void log_flush(uint64_t now, int force) {
+    size_t keep = 0;
+    for (size_t i = 0; i < g_log_pending_len; i++) {
+        log_ratelimit_t *rl = g_log_pending[i];
+        if (!force && now - rl->window_start < LOG_RL_INTERVAL_MS) {
+            g_log_pending[keep++] = rl;
+            continue;
+        }
+        if (rl->suppressed) {
+            char note[64];
+            int n = snprintf(note, sizeof(note), "(suppressed %u similar messages)\n", rl->suppressed);
+            log_write(rl->lvl, NULL, note, (size_t)n);
+            rl->suppressed = 0;
+        }
+        rl->pending = 0;
+    }
+    g_log_pending_len = keep;
+}
+
+// Main loop wakeups by cause. A timeout counts for the deadline that set it;
+// ready fds count once per kind. Rates are over the last complete window.
+typedef enum {
+    WAKE_HW_POLL = 0,
+    WAKE_SAVE,
+    WAKE_ALS_TIMER,
+    WAKE_IDLE_TIMER,
+    WAKE_QUIET_TIMER,
+    WAKE_METRICS,
+    WAKE_BUS_TIMER,
+    WAKE_HIDRAW_CLOSE,
+    WAKE_REPLAY,
+    WAKE_LOG,
+    WAKE_ULEDS,
+    WAKE_UEVENT,
+    WAKE_ALS,
+    WAKE_LID,
+    WAKE_BUS,
+    WAKE_CONTROL,
+    WAKE_BROKER,
+    WAKE_INPUT,
+    WAKE_SIGNAL,
+    WAKE_COUNT
+} wake_cause_t;
+
+static const char *wake_names[WAKE_COUNT] = {
+    "hw_poll", "save", "als_timer", "idle_timer", "quiet_timer", "metrics", "bus_timer",
+    "hidraw_close", "replay", "log", "uleds", "uevent", "als", "lid", "bus", "control", "broker", "input", "signal"
+};
+
+#define WAKE_WINDOW_MS 60000
+
+typedef struct {
+    uint64_t total;
+    uint64_t count[WAKE_COUNT];
+    uint64_t win_start;
+    uint64_t win_total;          // total at win_start
+    uint64_t win_count[WAKE_COUNT];
+    double rate;                 // wakeups/s over the last complete window
+    double cause_rate[WAKE_COUNT];
+} wake_stats_t;
+
+static wake_stats_t g_wake;
+
+static void wake_roll(uint64_t now) {
+    if (g_wake.win_start == 0) g_wake.win_start = now;
+    uint64_t dt = now - g_wake.win_start;
+    if (dt < WAKE_WINDOW_MS) return;
+    g_wake.rate = (double)(g_wake.total - g_wake.win_total) * 1000.0 / (double)dt;
+    for (int i = 0; i < WAKE_COUNT; i++) {
+        g_wake.cause_rate[i] = (double)(g_wake.count[i] - g_wake.win_count[i]) * 1000.0 / (double)dt;
+        g_wake.win_count[i] = g_wake.count[i];
+    }
+    g_wake.win_total = g_wake.total;
+    g_wake.win_start = now;
+}
+
+// Total time spent in suspend so far: CLOCK_BOOTTIME keeps counting while
+// suspended, CLOCK_MONOTONIC does not.
+static uint64_t suspended_ms(void) {
+    if (g_clock_virtual) return 0;
     struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    uint64_t boot = (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+    uint64_t mono = now_ms();
+    return (boot > mono) ? boot - mono : 0;
 }
 
 /* -------------------- Brightness -------------------- */
@@ -123,13 +603,22 @@ typedef struct {
     char hidraw[256];
 } target_t;
 
+#define HOLD_IDLE 0x1
+#define HOLD_DISPLAY 0x2
+
 typedef struct {
     int fd;
     char name[64];
     target_t targets[16];
     size_t targets_len;
     target_t master;
-    unsigned last_level;
+    unsigned last_level; // level currently applied to the modules
+    unsigned want_level; // level asked for by the user, hardware key or auto-brightness
+    unsigned holds;      // HOLD_* reasons the backlight is forced below want_level
+    unsigned hold_level; // cap while HOLD_IDLE is set
+    unsigned led_raw;    // value last written to the LED; its uleds echo is not a user choice
+    uint64_t save_due; // 0 = nothing pending
+    uint64_t last_save;
 } uled_ctx_t;
 
 static int target_eq(const target_t *a, const target_t *b) {
@@ -143,190 +632,1233 @@ static int target_in_list(const target_t *list, size_t len, const target_t *t) {
     return 0;
 }
 
+// Transfer health per VID:PID. Kept outside target_t because targets are
+// copied around (context master, hotplug lists).
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    unsigned fails;      // consecutive failed transfers
+    uint32_t rtt_us;     // last successful round trip
+    uint64_t ok_count;
+    uint64_t err_count;
+    hist_t rtt_hist;     // successful round trips
+} target_stats_t;
+
+static target_stats_t g_target_stats[32];
+static size_t g_target_stats_len = 0;
+
+static target_stats_t *target_stats(const target_t *t) {
+    for (size_t i = 0; i < g_target_stats_len; i++) {
+        if (g_target_stats[i].vid == t->vid && g_target_stats[i].pid == t->pid) return &g_target_stats[i];
+    }
+    if (g_target_stats_len >= sizeof(g_target_stats) / sizeof(g_target_stats[0])) return NULL;
+    target_stats_t *st = &g_target_stats[g_target_stats_len++];
+    memset(st, 0, sizeof(*st));
+    st->vid = t->vid;
+    st->pid = t->pid;
+    return st;
+}
+
+static enum fw16_state_health target_health_code(const target_stats_t *st) {
+    if (!st || (st->ok_count == 0 && st->err_count == 0)) return FW16_HEALTH_UNKNOWN;
+    if (st->fails == 0) return FW16_HEALTH_OK;
+    return (st->fails < 3) ? FW16_HEALTH_DEGRADED : FW16_HEALTH_FAILING;
+}
+
+static const char *target_health(const target_stats_t *st) {
+    static const char *names[] = { "unknown", "ok", "degraded", "failing" };
+    return names[target_health_code(st)];
+}
+
+static int get_type(uint16_t pid) {
+    if (pid == 0x0012 || pid == 0x0018 || pid == 0x0019) return 0; // Kbd
+    if (pid == 0x0014) return 1; // Numpad
+    if (pid == 0x0013) return 2; // Macropad
+    return 3; // Misc
+}
+
+static const char *type_names[] = {
+    "framework::kbd_backlight",
+    "framework::numpad_backlight",
+    "framework::macropad_backlight",
+    "framework::aux_backlight"
+};
 
 /* -------------------- qmk HIDRAW -------------------- */
 
-static int qmk_hidraw_xfer(const char *hidraw, unsigned char cmd, unsigned char channel, unsigned char addr, unsigned char val, unsigned char *resp) {
-    if (!hidraw || !*hidraw) return -1;
-    char path[512];
-    snprintf(path, sizeof(path), "/dev/%s", hidraw);
-    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+// hidraw fds are kept open between transfers (a slider drag is dozens of
+// them) and closed again after HIDRAW_IDLE_CLOSE_MS without use, so the
+// daemon does not hold the modules' interfaces open while nothing happens.
+#define HIDRAW_CACHE_LEN 16
+#define HIDRAW_IDLE_CLOSE_MS 5000
+
+typedef struct {
+    char name[32]; // hidrawN, "" = free slot
+    int fd;
+    uint64_t last_used;
+} hidraw_fd_t;
+
+static hidraw_fd_t g_hidraw_fds[HIDRAW_CACHE_LEN];
+
+static void hidraw_cache_close(hidraw_fd_t *h) {
+    if (!*h->name) return;
+    close(h->fd);
+    h->name[0] = '\0';
+}
+
+// Open (or reuse) the node, with any replies that queued up for other
+// hidraw users since the last transfer discarded.
+static int hidraw_get(const char *hidraw) {
+    if (!hidraw || !*hidraw || strlen(hidraw) >= sizeof(g_hidraw_fds[0].name)) return -1;
+    hidraw_fd_t *h = NULL, *free_slot = NULL, *oldest = NULL;
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) {
+        hidraw_fd_t *c = &g_hidraw_fds[i];
+        if (!*c->name) {
+            if (!free_slot) free_slot = c;
+        } else if (!strcmp(c->name, hidraw)) {
+            h = c;
+            break;
+        } else if (!oldest || c->last_used < oldest->last_used) {
+            oldest = c;
+        }
+    }
+    if (h) {
+        unsigned char stale[64];
+        while (read(h->fd, stale, sizeof(stale)) > 0) {}
+    } else {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", g_dev_root, hidraw);
+        int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) return -1;
+        h = free_slot;
+        if (!h) {
+            h = oldest;
+            hidraw_cache_close(h);
+        }
+        snprintf(h->name, sizeof(h->name), "%s", hidraw);
+        h->fd = fd;
+    }
+    h->last_used = now_ms();
+    return h->fd;
+}
+
+// Forget a node after an error (e.g. the device went away)
+static void hidraw_drop(int fd) {
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) {
+        if (*g_hidraw_fds[i].name && g_hidraw_fds[i].fd == fd) hidraw_cache_close(&g_hidraw_fds[i]);
+    }
+}
+
+static uint64_t hidraw_idle_deadline(void) {
+    uint64_t due = 0;
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) {
+        if (!*g_hidraw_fds[i].name) continue;
+        uint64_t d = g_hidraw_fds[i].last_used + HIDRAW_IDLE_CLOSE_MS;
+        if (!due || d < due) due = d;
+    }
+    return due;
+}
+
+static void hidraw_close_idle(uint64_t now) {
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) {
+        if (*g_hidraw_fds[i].name && now >= g_hidraw_fds[i].last_used + HIDRAW_IDLE_CLOSE_MS)
+            hidraw_cache_close(&g_hidraw_fds[i]);
+    }
+}
+
+// Runtime PM state of the USB device behind a hidraw node. Reading it does
+// not resume the device, unlike a HID transfer. The attribute is resolved once
+// per node and kept open (pread() re-reads sysfs attributes from offset 0), so
+// a poll tick costs one syscall here; the fds are dropped on rescan.
+typedef struct {
+    char name[32]; // hidrawN, "" = free slot
+    int fd;        // power/runtime_status, -1 if the node has none
+} hidraw_pm_fd_t;
+
+static hidraw_pm_fd_t g_hidraw_pm_fds[HIDRAW_CACHE_LEN];
+
+static int hidraw_pm_open(const char *hidraw) {
+    char link[PATH_MAX], dir[PATH_MAX];
+    snprintf(link, sizeof(link), "%s/class/hidraw/%s/device", g_sys_root, hidraw);
+    if (!realpath(link, dir)) return -1;
+    // hid device -> USB interface -> USB device (the one with idVendor)
+    for (int up = 0; up < 3; up++) {
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir) return -1;
+        *slash = '\0';
+        char attr[PATH_MAX + 32];
+        snprintf(attr, sizeof(attr), "%s/idVendor", dir);
+        if (access(attr, F_OK) != 0) continue;
+        snprintf(attr, sizeof(attr), "%s/power/runtime_status", dir);
+        return open(attr, O_RDONLY | O_CLOEXEC);
+    }
+    return -1;
+}
+
+static int hidraw_usb_suspended(const char *hidraw) {
+    if (!hidraw || !*hidraw || strlen(hidraw) >= sizeof(g_hidraw_pm_fds[0].name)) return 0;
+    hidraw_pm_fd_t *h = NULL;
+    for (int i = 0; i < HIDRAW_CACHE_LEN && !h; i++) {
+        if (!strcmp(g_hidraw_pm_fds[i].name, hidraw)) h = &g_hidraw_pm_fds[i];
+    }
+    for (int i = 0; i < HIDRAW_CACHE_LEN && !h; i++) {
+        if (*g_hidraw_pm_fds[i].name) continue;
+        h = &g_hidraw_pm_fds[i];
+        snprintf(h->name, sizeof(h->name), "%s", hidraw);
+        h->fd = hidraw_pm_open(hidraw);
+    }
+    if (!h || h->fd < 0) return 0;
+    char st[32];
+    ssize_t r = pread(h->fd, st, sizeof(st) - 1, 0);
+    return r > 0 && !strncmp(st, "suspended", 9);
+}
+
+static void hidraw_pm_close_all(void) {
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) {
+        if (!*g_hidraw_pm_fds[i].name) continue;
+        if (g_hidraw_pm_fds[i].fd >= 0) close(g_hidraw_pm_fds[i].fd);
+        g_hidraw_pm_fds[i].name[0] = '\0';
+    }
+}
+
+static void hidraw_close_all(void) {
+    for (int i = 0; i < HIDRAW_CACHE_LEN; i++) hidraw_cache_close(&g_hidraw_fds[i]);
+    hidraw_pm_close_all();
+}
+
+// Does `r` answer `req`? VIA echoes the command id (or replies id_unhandled);
+// the value commands also echo the channel and value id. An id_unhandled reply
+// echoes the rest of the request untouched, so it only answers `req` if those
+// bytes match; otherwise it is another hidraw user's unsupported request.
+static int qmk_reply_matches(const unsigned char *req, const unsigned char *r) {
+    if (r[0] == QMK_ID_UNHANDLED) return !memcmp(&r[1], &req[1], 31);
+    if (r[0] != req[0]) return 0;
+    if (req[0] < QMK_CMD_SET_VALUE || req[0] > QMK_CMD_CUSTOM_SAVE) return 1;
+    return r[1] == req[1] && r[2] == req[2];
+}
+
+// Read one report once poll() returned `revents` for `fd`. Returns 1 for a
+// full report, 0 to keep waiting (short read, EAGAIN, EINTR), and -1 if the
+// node is gone: an unplugged module reports POLLHUP/POLLERR at once and reads
+// fail with ENODEV, so waiting out the deadline would only spin. The fd is
+// dropped from the cache then. EOF (a plain file in a --root tree) also ends
+// the transfer.
+static int hidraw_read_report(int fd, short revents, unsigned char *r) {
+    if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+        hidraw_drop(fd);
+        return -1;
+    }
+    ssize_t n = read(fd, r, 32);
+    if (n == 32) return 1;
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR))) return 0;
+    hidraw_drop(fd);
+    return -1;
+}
+
+// Send one raw 32-byte report and wait up to 200ms for its reply. Replies are
+// broadcast to every open hidraw fd, so other users' traffic is skipped.
+static int hidraw_report_xfer(const char *hidraw, const unsigned char *req, unsigned char *resp) {
+    int fd = hidraw_get(hidraw);
     if (fd < 0) return -1;
 
     unsigned char buf[33];
-    memset(buf, 0, sizeof(buf));
-    buf[0] = 0x00;
-    buf[1] = cmd;
-    buf[2] = channel;
-    buf[3] = addr;
-    buf[4] = val;
-
+    buf[0] = 0x00; // report id
+    memcpy(&buf[1], req, 32);
     if (write(fd, buf, 33) != 33) {
-        close(fd);
+        hidraw_drop(fd);
         return -1;
     }
 
-    struct pollfd pfd = { .fd = fd, .events = POLLIN };
-    if (poll(&pfd, 1, 200) <= 0) {
-        close(fd);
-        return -1;
+    int rc = -1;
+    uint64_t deadline = now_ms() + 200;
+    for (;;) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (clock_poll(&pfd, 1, (int)(deadline - now)) <= 0) break;
+        int got = hidraw_read_report(fd, pfd.revents, resp);
+        if (got < 0) return -1;
+        if (got == 0) continue;
+        if (qmk_reply_matches(req, resp)) {
+            rc = 0;
+            break;
+        }
     }
+    if (rc < 0) g_counters.hid_timeouts++;
+    return rc;
+}
 
-    unsigned char r[32];
-    if (read(fd, r, 32) != 32) {
-        close(fd);
-        return -1;
+// Send several VIA requests on one open fd, then collect the replies in order.
+// Saves an open/close and a poll round trip per request when pushing multi-value state.
+typedef struct {
+    unsigned char cmd;
+    unsigned char channel;
+    unsigned char addr;
+    unsigned char val[2];
+    unsigned char val_len;
+    unsigned char resp[2];
+    int ok;
+} qmk_req_t;
+
+// The 32-byte report for `q`, zero-padded like every other request we send.
+static void qmk_req_report(const qmk_req_t *q, unsigned char *out) {
+    memset(out, 0, 32);
+    out[0] = q->cmd;
+    out[1] = q->channel;
+    out[2] = q->addr;
+    memcpy(&out[3], q->val, q->val_len);
+}
+
+static int qmk_hidraw_batch(const char *hidraw, qmk_req_t *reqs, size_t n) {
+    int fd = hidraw_get(hidraw);
+    if (fd < 0) return -1;
+
+    size_t sent = 0;
+    for (; sent < n; sent++) {
+        unsigned char buf[33];
+        buf[0] = 0x00; // report id
+        qmk_req_report(&reqs[sent], &buf[1]);
+        reqs[sent].ok = 0;
+        if (write(fd, buf, 33) != 33) break;
     }
-    close(fd);
 
+    // Replies come back in request order; anything that doesn't echo the pending
+    // request is another hidraw user's traffic and is skipped.
+    int acked = 0, gone = 0;
+    size_t next = 0;
+    uint64_t deadline = now_ms() + 200;
+    while (next < sent) {
+        uint64_t now = now_ms();
+        if (now >= deadline) break;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (clock_poll(&pfd, 1, (int)(deadline - now)) <= 0) break;
+
+        unsigned char r[32], req[32];
+        int got = hidraw_read_report(fd, pfd.revents, r);
+        if (got < 0) {
+            gone = 1;
+            break;
+        }
+        if (got == 0) continue;
+        qmk_req_report(&reqs[next], req);
+        if (!qmk_reply_matches(req, r)) continue;
+        if (r[0] == QMK_ID_UNHANDLED) {
+            next++;
+            continue;
+        }
+        memcpy(reqs[next].resp, &r[3], sizeof(reqs[next].resp));
+        reqs[next].ok = 1;
+        acked++;
+        next++;
+    }
+    if (sent < n && !gone) hidraw_drop(fd);
+    if (next < sent && !gone) g_counters.hid_timeouts++;
+    g_counters.hid_xfers += n;
+    g_counters.hid_errors += n - (size_t)acked;
+    return gone ? -1 : acked;
+}
+
+/* -------------------- Transport -------------------- */
+
+// Every operation with an effect outside the process on the brightness path
+// goes through g_transport: finding and talking to modules, the uleds LED and
+// its sysfs attributes, and the desktop UI sync. The default implementation
+// is hidraw/sysfs/D-Bus; `--transport mock` swaps in in-process module models
+// (see "Mock transport") so the scheduling and reconciliation logic can be run
+// and measured without the hardware.
+typedef struct {
+    const char *name;
+    // hidraw node of the VIA interface of vid:pid; 0 if found
+    int (*find)(uint16_t vid, uint16_t pid, char *out, size_t out_len);
+    // One 32-byte request and its matching reply; 0 on success
+    int (*xfer)(const char *hidraw, const unsigned char *req, unsigned char *resp);
+    // Several requests in flight at once; returns how many were acknowledged
+    int (*batch)(const char *hidraw, qmk_req_t *reqs, size_t n);
+    // Whether the module is runtime-suspended (and should not be polled)
+    int (*suspended)(const char *hidraw);
+    uint64_t (*idle_deadline)(void);
+    void (*close_idle)(uint64_t now);
+    void (*close_all)(void);
+    // Returns an fd that becomes readable with uleds brightness events
+    int (*led_create)(const char *name, unsigned max_brightness);
+    int (*led_write)(const char *name, unsigned val);
+    void (*ui_sync)(unsigned level);
+} transport_t;
+
+static const transport_t transport_hidraw;
+static const transport_t *g_transport = &transport_hidraw;
+
+static int qmk_xfer(const char *hidraw, unsigned char cmd, unsigned char channel, unsigned char addr, unsigned char val, unsigned char *resp) {
+    unsigned char req[32] = { cmd, channel, addr, val };
+    unsigned char r[32];
+    if (g_transport->xfer(hidraw, req, r) < 0) return -1;
     if (r[0] != cmd) return -1;
     if (resp) *resp = r[3];
     return 0;
 }
 
+static unsigned char pct_to_qmk_val(unsigned pct) {
+    return (unsigned char)((pct * 255 + 50) / 100);
+}
+
+// Round trips by command (set, get, save, other) and channel (backlight,
+// RGB matrix, other)
+static hist_t g_hist_xfer[4][3];
+static const char *xfer_cmd_names[] = { "set", "get", "save", "other" };
+static const char *xfer_channel_names[] = { "backlight", "rgb_matrix", "other" };
+
+// Per-target health/RTT accounting for a transfer started at `t0`.
+static void target_account(const target_t *t, unsigned char cmd, unsigned char channel, int rc, uint64_t t0) {
+    g_counters.hid_xfers++;
+    if (rc != 0) g_counters.hid_errors++;
+    uint64_t rtt = now_us() - t0;
+    if (rc == 0) {
+        int ci = (cmd >= QMK_CMD_SET_VALUE && cmd <= QMK_CMD_CUSTOM_SAVE) ? cmd - QMK_CMD_SET_VALUE : 3;
+        int chi = (channel == QMK_CH_BACKLIGHT) ? 0 : (channel == QMK_CH_RGB_MATRIX) ? 1 : 2;
+        hist_observe(&g_hist_xfer[ci][chi], rtt);
+    }
+    target_stats_t *st = target_stats(t);
+    if (st) {
+        if (rc == 0) {
+            st->rtt_us = (uint32_t)rtt;
+            hist_observe(&st->rtt_hist, rtt);
+            st->fails = 0;
+            st->ok_count++;
+        } else {
+            st->fails++;
+            st->err_count++;
+        }
+    }
+}
+
+// Probes: hid_xfer_entry(vid, pid, cmd, channel)
+//         hid_xfer_return(vid, pid, cmd, channel, rc, duration_us)
+static int qmk_target_xfer(const target_t *t, unsigned char cmd, unsigned char channel, unsigned char addr, unsigned char val, unsigned char *resp) {
+    uint64_t t0 = now_us();
+    PROBE(hid_xfer_entry, t->vid, t->pid, cmd, channel);
+    trace_mark("hid_request", t->vid, t->pid, channel, 0);
+    int rc = qmk_xfer(t->hidraw, cmd, channel, addr, val, resp);
+    trace_mark("hid_ack", t->vid, t->pid, channel, rc);
+    target_account(t, cmd, channel, rc, t0);
+    flight_rec(FR_HID, t->vid, t->pid, cmd, channel, 0, rc, (int32_t)(now_us() - t0));
+    PROBE(hid_xfer_return, t->vid, t->pid, cmd, channel, rc, now_us() - t0);
+    return rc;
+}
+
+// Raw 32-byte report to a target (VIA broker), with the same accounting
+static int target_report_xfer(const target_t *t, const unsigned char *req, unsigned char *resp) {
+    uint64_t t0 = now_us();
+    PROBE(hid_xfer_entry, t->vid, t->pid, req[0], req[1]);
+    int rc = g_transport->xfer(t->hidraw, req, resp);
+    target_account(t, req[0], req[1], rc, t0);
+    flight_rec(FR_HID, t->vid, t->pid, req[0], req[1], 0, rc, (int32_t)(now_us() - t0));
+    PROBE(hid_xfer_return, t->vid, t->pid, req[0], req[1], rc, now_us() - t0);
+    return rc;
+}
+
 static int qmk_set(const target_t *t, unsigned pct) {
-    unsigned char val = (unsigned char)((pct * 255 + 50) / 100);
+    unsigned char val = pct_to_qmk_val(pct);
     // Try both white backlight and RGB matrix
-    int r1 = qmk_hidraw_xfer(t->hidraw, QMK_CMD_SET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, val, NULL);
-    int r2 = qmk_hidraw_xfer(t->hidraw, QMK_CMD_SET_VALUE, QMK_CH_RGB_MATRIX, QMK_ADDR_BRIGHTNESS, val, NULL);
+    int r1 = qmk_target_xfer(t, QMK_CMD_SET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, val, NULL);
+    int r2 = qmk_target_xfer(t, QMK_CMD_SET_VALUE, QMK_CH_RGB_MATRIX, QMK_ADDR_BRIGHTNESS, val, NULL);
     return (r1 == 0 || r2 == 0) ? 0 : -1;
 }
 
+// Probes: apply_entry(level, targets), apply_return(level, failed, duration_us)
 static void qmk_apply_all(const target_t *targets, size_t len, unsigned level, const target_t *skip) {
     unsigned pct = level_to_qmk_pct(level);
-    dbg(2, "apply level=%u pct=%u to %zu targets\n", level, pct, len);
+    uint64_t t0 = now_us();
+    unsigned failed = 0;
+    PROBE(apply_entry, level, len);
     for (size_t i = 0; i < len; i++) {
         if (skip && target_eq(&targets[i], skip)) continue;
-        (void)qmk_set(&targets[i], pct);
+        if (qmk_set(&targets[i], pct) < 0) failed++;
     }
+    uint64_t dt = now_us() - t0;
+    PROBE(apply_return, level, failed, dt);
+    dbg_fields(2, LOG_FIELDS(NULL, 0, 0, (int)level, (long long)dt),
+               "apply level=%u pct=%u to %zu targets (%u failed) in %lluus\n", level, pct, len, failed, (unsigned long long)dt);
+}
+
+// Commit the current RAM values to EEPROM. Each save is a flash write on the
+// module, so callers debounce this (see save_schedule()).
+static int qmk_save(const target_t *t) {
+    int r1 = qmk_target_xfer(t, QMK_CMD_CUSTOM_SAVE, QMK_CH_BACKLIGHT, 0, 0, NULL);
+    int r2 = qmk_target_xfer(t, QMK_CMD_CUSTOM_SAVE, QMK_CH_RGB_MATRIX, 0, 0, NULL);
+    return (r1 == 0 || r2 == 0) ? 0 : -1;
 }
 
 static int qmk_get(const target_t *t) {
     unsigned char val = 0;
-    if (qmk_hidraw_xfer(t->hidraw, QMK_CMD_GET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, 0, &val) == 0) {
+    if (qmk_target_xfer(t, QMK_CMD_GET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, 0, &val) == 0) {
         return (int)((val * 100 + 127) / 255);
     }
-    if (qmk_hidraw_xfer(t->hidraw, QMK_CMD_GET_VALUE, QMK_CH_RGB_MATRIX, QMK_ADDR_BRIGHTNESS, 0, &val) == 0) {
+    if (qmk_target_xfer(t, QMK_CMD_GET_VALUE, QMK_CH_RGB_MATRIX, QMK_ADDR_BRIGHTNESS, 0, &val) == 0) {
         return (int)((val * 100 + 127) / 255);
     }
     return -1;
 }
 
+/* -------------------- RGB matrix state -------------------- */
 
-static void update_sysfs_brightness(const char *name, unsigned val) {
-    char path[256];
-    snprintf(path, sizeof(path), "/sys/class/leds/%s/brightness", name);
-    for (int i = 0; i < 10; i++) {
-        int fd = open(path, O_WRONLY);
-        if (fd >= 0) {
-            char buf[16];
-            int n = snprintf(buf, sizeof(buf), "%u\n", val);
-            ssize_t nw = write(fd, buf, n);
-            (void)nw;
-            close(fd);
+// Effect, speed and color of RGB matrix modules, cached per VID:PID so the state
+// survives the target being dropped and re-added on hotplug. Brightness is not
+// cached here; it always follows the context level.
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    int valid;
+    unsigned char effect;
+    unsigned char speed;
+    unsigned char hue;
+    unsigned char sat;
+} rgb_state_t;
 
-            // Trigger uevent so Powerdevil/UPower notice the change
-            snprintf(path, sizeof(path), "/sys/class/leds/%s/uevent", name);
-            fd = open(path, O_WRONLY);
-            if (fd >= 0) {
-                ssize_t uw = write(fd, "change\n", 7);
-                (void)uw;
-                close(fd);
-            }
-            return;
-        }
-        if (errno != ENOENT) break;
-        usleep(10000); // Wait 10ms for sysfs to catch up
+// Requested values from --rgb; -1 keeps whatever the module reports.
+typedef struct {
+    int effect;
+    int speed;
+    int hue;
+    int sat;
+} rgb_override_t;
+
+static rgb_state_t g_rgb_cache[16];
+static size_t g_rgb_cache_len = 0;
+
+static int target_has_rgb(const target_t *t) {
+    return get_type(t->pid) == 2;
+}
+
+static rgb_state_t *rgb_cache_slot(const target_t *t) {
+    for (size_t i = 0; i < g_rgb_cache_len; i++) {
+        if (g_rgb_cache[i].vid == t->vid && g_rgb_cache[i].pid == t->pid) return &g_rgb_cache[i];
     }
+    if (g_rgb_cache_len >= sizeof(g_rgb_cache) / sizeof(g_rgb_cache[0])) return NULL;
+    rgb_state_t *st = &g_rgb_cache[g_rgb_cache_len++];
+    memset(st, 0, sizeof(*st));
+    st->vid = t->vid;
+    st->pid = t->pid;
+    return st;
 }
 
-static void sync_ui(unsigned level) {
-    // Synchronize UI via UPower (system bus) and KDE PowerDevil (session bus).
-    dbg(1, "syncing UI to level %u (sd-bus)\n", level);
-
-    // 1. System Bus (UPower)
-    if (fork() == 0) {
-        sd_bus *bus = NULL;
-        int r = sd_bus_open_system(&bus);
-        if (r >= 0) {
-            sd_bus_message *m = NULL;
-            r = sd_bus_call_method(bus, "org.freedesktop.UPower", "/org/freedesktop/UPower",
-                                   "org.freedesktop.UPower", "EnumerateKbdBacklights", NULL, &m, "");
-            if (r >= 0) {
-                char **paths;
-                if (sd_bus_message_read_strv(m, &paths) >= 0 && paths) {
-                    for (char **p = paths; *p; p++) {
-                        if (g_debug_level >= 3) dbg(3, "  UPower sync: %s\n", *p);
-                        sd_bus_call_method(bus, "org.freedesktop.UPower", *p,
-                                           "org.freedesktop.UPower.KbdBacklight", "SetBrightness", NULL, NULL, "i", (int32_t)level);
-                    }
-                }
-                sd_bus_message_unref(m);
-            }
-            sd_bus_unref(bus);
-        }
-        exit(0);
-    }
-
-    // 2. Session Buses (PowerDevil)
-    DIR *d = opendir("/run/user");
-    if (d) {
-        struct dirent *de;
-        int found_users = 0;
-        while ((de = readdir(d))) {
-            if (de->d_name[0] == '.') continue;
-            uid_t uid = (uid_t)atoi(de->d_name);
-            if (uid == 0) continue;
-            found_users++;
-
-            char socket_path[512];
-            snprintf(socket_path, sizeof(socket_path), "/run/user/%u/bus", uid);
-            struct stat st;
-            if (stat(socket_path, &st) != 0 || !S_ISSOCK(st.st_mode)) continue;
-
-            if (fork() == 0) {
-                struct passwd *pw = getpwuid(uid);
-                if (pw && setresuid(uid, uid, uid) == 0) {
-                    setenv("HOME", pw->pw_dir, 1);
-                    setenv("USER", pw->pw_name, 1);
-                    char address[528];
-                    snprintf(address, sizeof(address), "unix:path=%s", socket_path);
-                    setenv("DBUS_SESSION_BUS_ADDRESS", address, 1);
-
-                    sd_bus *sbus = NULL;
-                    int r = sd_bus_open_user(&sbus);
-                    if (r >= 0) {
-                        if (g_debug_level >= 3) dbg(3, "  PowerDevil sync for user %u (%s)\n", uid, pw->pw_name);
-                        sd_bus_error error = SD_BUS_ERROR_NULL;
-                        r = sd_bus_call_method(sbus, "org.kde.org_kde_powerdevil",
-                                               "/org/kde/Solid/PowerManagement/Actions/KeyboardBrightnessControl",
-                                               "org.kde.Solid.PowerManagement.Actions.KeyboardBrightnessControl",
-                                               "setKeyboardBrightness", &error, NULL, "i", (int32_t)level);
-                        if (r < 0 && g_debug_level >= 3)
-                            dbg(3, "    PowerDevil call failed for user %u: %s\n", uid, error.message);
-                        sd_bus_error_free(&error);
-                        sd_bus_flush(sbus);
-                        sd_bus_unref(sbus);
-                    } else if (g_debug_level >= 3) {
-                        dbg(3, "    sd_bus_open_user failed for user %u: %s\n", uid, strerror(-r));
-                    }
-                }
-                exit(0);
-            }
+static int qmk_rgb_read(const target_t *t, rgb_state_t *st) {
+    qmk_req_t reqs[3] = {
+        { .cmd = QMK_CMD_GET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_EFFECT },
+        { .cmd = QMK_CMD_GET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_SPEED },
+        { .cmd = QMK_CMD_GET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_COLOR },
+    };
+    if (g_transport->batch(t->hidraw, reqs, 3) != 3) return -1;
+    st->effect = reqs[0].resp[0];
+    st->speed = reqs[1].resp[0];
+    st->hue = reqs[2].resp[0];
+    st->sat = reqs[2].resp[1];
+    st->valid = 1;
+    return 0;
+}
+
+// Push effect, speed, color and the brightness for `level` in one batch.
+static int qmk_rgb_restore(const target_t *t, const rgb_state_t *st, unsigned level) {
+    qmk_req_t reqs[4] = {
+        { .cmd = QMK_CMD_SET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_EFFECT,
+          .val = { st->effect }, .val_len = 1 },
+        { .cmd = QMK_CMD_SET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_SPEED,
+          .val = { st->speed }, .val_len = 1 },
+        { .cmd = QMK_CMD_SET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_RGB_COLOR,
+          .val = { st->hue, st->sat }, .val_len = 2 },
+        { .cmd = QMK_CMD_SET_VALUE, .channel = QMK_CH_RGB_MATRIX, .addr = QMK_ADDR_BRIGHTNESS,
+          .val = { pct_to_qmk_val(level_to_qmk_pct(level)) }, .val_len = 1 },
+    };
+    int acked = g_transport->batch(t->hidraw, reqs, 4);
+    dbg_fields(2, LOG_FIELDS(NULL, t->vid, t->pid, (int)level, -1), "rgb restore %04x:%04x: effect=%u speed=%u hue=%u sat=%u level=%u (%d/4 acked)\n",
+        t->vid, t->pid, st->effect, st->speed, st->hue, st->sat, level, acked);
+    return (acked == 4) ? 0 : -1;
+}
+
+static int rgb_apply_override(rgb_state_t *st, const rgb_override_t *ov) {
+    int changed = 0;
+    if (ov->effect >= 0 && st->effect != (unsigned char)ov->effect) { st->effect = (unsigned char)ov->effect; changed = 1; }
+    if (ov->speed >= 0 && st->speed != (unsigned char)ov->speed) { st->speed = (unsigned char)ov->speed; changed = 1; }
+    if (ov->hue >= 0 && st->hue != (unsigned char)ov->hue) { st->hue = (unsigned char)ov->hue; changed = 1; }
+    if (ov->sat >= 0 && st->sat != (unsigned char)ov->sat) { st->sat = (unsigned char)ov->sat; changed = 1; }
+    return changed;
+}
+
+// Bring an RGB target in line with the cache. The first time a module is seen its
+// state is read from the device and `ov` applied; afterwards (hotplug, resume) the
+// cached state is pushed back as-is, without re-reading. Returns 0 if the full state including brightness
+// was pushed, 1 if the state was only read, -1 on failure.
+static int rgb_attach(const target_t *t, const rgb_override_t *ov, unsigned level) {
+    rgb_state_t *st = rgb_cache_slot(t);
+    if (!st) return -1;
+
+    if (!st->valid) {
+        if (qmk_rgb_read(t, st) < 0) {
+            dbg(1, "rgb: failed to read state from %04x:%04x\n", t->vid, t->pid);
+            return -1;
+        }
+        dbg(1, "rgb state %04x:%04x: effect=%u speed=%u hue=%u sat=%u\n",
+            t->vid, t->pid, st->effect, st->speed, st->hue, st->sat);
+        if (!rgb_apply_override(st, ov)) return 1;
+        return qmk_rgb_restore(t, st, level);
+    }
+
+    return qmk_rgb_restore(t, st, level);
+}
+
+// Runtime change (control socket): update the cache and push it.
+static int rgb_set(const target_t *t, const rgb_override_t *ov, unsigned level) {
+    rgb_state_t *st = rgb_cache_slot(t);
+    if (!st) return -1;
+    if (!st->valid && qmk_rgb_read(t, st) < 0) return -1;
+    (void)rgb_apply_override(st, ov);
+    return qmk_rgb_restore(t, st, level);
+}
+
+// Parse "effect=N,speed=N,hue=N,sat=N" (any subset, decimal 0-255).
+static int parse_rgb_spec(const char *spec, rgb_override_t *ov) {
+    char *dup = strdup(spec);
+    if (!dup) return -1;
+    int rc = 0;
+    char *saveptr;
+    char *tok = strtok_r(dup, ",", &saveptr);
+    while (tok) {
+        char *eq = strchr(tok, '=');
+        long v = eq ? strtol(eq + 1, NULL, 10) : -1;
+        if (!eq || v < 0 || v > 255) {
+            rc = -1;
+        } else {
+            *eq = '\0';
+            if (!strcmp(tok, "effect")) ov->effect = (int)v;
+            else if (!strcmp(tok, "speed")) ov->speed = (int)v;
+            else if (!strcmp(tok, "hue")) ov->hue = (int)v;
+            else if (!strcmp(tok, "sat")) ov->sat = (int)v;
+            else rc = -1;
+        }
+        tok = strtok_r(NULL, ",", &saveptr);
+    }
+    free(dup);
+    return rc;
+}
+
+/* -------------------- Event subscriptions -------------------- */
+
+// Control socket clients that sent "subscribe" get every state change pushed
+// as its own message. Each subscriber has a small ring; when a slow client lets
+// it fill up the oldest events are dropped (and counted), so the daemon never
+// blocks on a client.
+
+typedef enum {
+    ORIGIN_STARTUP = 0,
+    ORIGIN_UI,
+    ORIGIN_HW_KEY,
+    ORIGIN_HOTPLUG,
+    ORIGIN_RESUME,
+    ORIGIN_IDLE,
+    ORIGIN_AMBIENT,
+    ORIGIN_DISPLAY,
+    ORIGIN_CONTROL,
+    ORIGIN_DBUS
+} origin_t;
+
+static const char *origin_names[] = {
+    "startup", "ui", "hw_key", "hotplug", "resume", "idle", "ambient", "display", "control", "dbus"
+};
+#define ORIGIN_COUNT (sizeof(origin_names) / sizeof(origin_names[0]))
+
+// Time from a level decision until every module in the context acknowledged it
+static hist_t g_hist_apply[ORIGIN_COUNT];
+
+#define SUB_MAX 8
+#define SUB_QUEUE_LEN 32
+#define SUB_EVENT_MAX 128
+
+typedef struct {
+    int active;
+    int fd;
+    char q[SUB_QUEUE_LEN][SUB_EVENT_MAX];
+    unsigned short qlen[SUB_QUEUE_LEN];
+    unsigned head;
+    unsigned count;
+    unsigned dropped;
+} sub_t;
+
+static sub_t g_subs[SUB_MAX];
+
+static void sub_reset(int slot, int fd) {
+    g_subs[slot].active = 1;
+    g_subs[slot].fd = fd;
+    g_subs[slot].head = 0;
+    g_subs[slot].count = 0;
+    g_subs[slot].dropped = 0;
+}
+
+// Send as much of the queue as the socket takes without blocking.
+// Returns -1 if the client is gone.
+static int sub_flush(sub_t *sb) {
+    while (sb->dropped || sb->count) {
+        char tmp[SUB_EVENT_MAX];
+        const char *msg;
+        size_t len;
+        if (sb->dropped) {
+            int n = snprintf(tmp, sizeof(tmp), "dropped %u\n", sb->dropped);
+            msg = tmp;
+            len = (size_t)n;
+        } else {
+            msg = sb->q[sb->head];
+            len = sb->qlen[sb->head];
+        }
+        if (send(sb->fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (sb->dropped) {
+            sb->dropped = 0;
+        } else {
+            sb->head = (sb->head + 1) % SUB_QUEUE_LEN;
+            sb->count--;
+        }
+    }
+    return 0;
+}
+
+static void events_publish(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void events_publish(const char *fmt, ...) {
+    char msg[SUB_EVENT_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    size_t len = ((size_t)n < sizeof(msg)) ? (size_t)n : sizeof(msg) - 1;
+
+    for (int i = 0; i < SUB_MAX; i++) {
+        sub_t *sb = &g_subs[i];
+        if (!sb->active) continue;
+        if (sb->count == SUB_QUEUE_LEN) {
+            sb->head = (sb->head + 1) % SUB_QUEUE_LEN;
+            sb->count--;
+            sb->dropped++;
+        }
+        unsigned tail = (sb->head + sb->count) % SUB_QUEUE_LEN;
+        memcpy(sb->q[tail], msg, len);
+        sb->qlen[tail] = (unsigned short)len;
+        sb->count++;
+        (void)sub_flush(sb); // errors surface as POLLHUP/POLLERR in the main loop
+    }
+}
+
+static void bus_service_emit(const uled_ctx_t *c, origin_t origin);
+
+// A context's applied level changed: tell subscribers and D-Bus clients.
+static void notify_level(const uled_ctx_t *c, origin_t origin) {
+    // The context index is the module type of its master (0 in unified mode)
+    flight_rec(FR_LEVEL, 0, 0, (uint8_t)get_type(c->master.pid), (uint8_t)origin, (uint8_t)c->holds,
+               (int32_t)c->last_level, (int32_t)c->want_level);
+    events_publish("level %s %u %s\n", c->name, c->last_level, origin_names[origin]);
+    bus_service_emit(c, origin);
+}
+
+static int sub_pending(int slot) {
+    return g_subs[slot].active && (g_subs[slot].count || g_subs[slot].dropped);
+}
+
+// The LED's brightness and uevent attributes stay open once found, so a level
+// change costs two pwrite()s; a failed write drops them for the next attempt.
+typedef struct {
+    char name[64]; // LED name, "" = free slot
+    int bri_fd;
+    int uev_fd;
+} led_fds_t;
+
+static led_fds_t g_led_fds[4];
+
+static led_fds_t *led_fds_get(const char *name) {
+    led_fds_t *slot = NULL;
+    for (size_t i = 0; i < sizeof(g_led_fds) / sizeof(g_led_fds[0]); i++) {
+        if (!strcmp(g_led_fds[i].name, name)) return &g_led_fds[i];
+        if (!slot && !*g_led_fds[i].name) slot = &g_led_fds[i];
+    }
+    if (!slot || strlen(name) >= sizeof(slot->name)) return NULL;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/class/leds/%s/brightness", g_sys_root, name);
+    int fd = -1;
+    for (int i = 0; i < 10; i++) {
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        if (fd >= 0 || errno != ENOENT) break;
+        clock_sleep_us(10000); // Wait 10ms for sysfs to catch up
+    }
+    if (fd < 0) return NULL;
+    snprintf(path, sizeof(path), "%s/class/leds/%s/uevent", g_sys_root, name);
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->bri_fd = fd;
+    slot->uev_fd = open(path, O_WRONLY | O_CLOEXEC);
+    return slot;
+}
+
+static void led_fds_drop(led_fds_t *l) {
+    close(l->bri_fd);
+    if (l->uev_fd >= 0) close(l->uev_fd);
+    l->name[0] = '\0';
+}
+
+static int sysfs_led_write(const char *name, unsigned val) {
+    led_fds_t *l = led_fds_get(name);
+    if (!l) return -1;
+    char buf[16];
+    int n = snprintf(buf, sizeof(buf), "%u\n", val);
+    if (pwrite(l->bri_fd, buf, n, 0) != n) {
+        led_fds_drop(l);
+        return -1;
+    }
+    // Trigger uevent so Powerdevil/UPower notice the change
+    if (l->uev_fd >= 0) {
+        ssize_t uw = pwrite(l->uev_fd, "change\n", 7, 0);
+        (void)uw;
+    }
+    return 0;
+}
+
+// Probe: sysfs_write(name, value, rc)
+static void update_sysfs_brightness(const char *name, unsigned val) {
+    int rc = g_transport->led_write(name, val);
+    if (rc == 0) g_counters.sysfs_writes++;
+    PROBE(sysfs_write, name, val, rc);
+}
+
+// Desktop UI sync goes over connections that stay open for the daemon's
+// lifetime: one to the system bus (UPower, shared with the D-Bus service) and
+// one per logged-in user's session bus (PowerDevil). Calls are sent without
+// waiting for replies, so a sync never blocks on a desktop component, and
+// nothing is forked or looked up in the user database per change.
+
+static sd_bus *g_system_bus = NULL;
+
+static sd_bus *system_bus_get(void) {
+    if (!g_system_bus) {
+        int r = sd_bus_open_system(&g_system_bus);
+        if (r < 0) {
+            dbg(3, "  UI sync: failed to connect to the system bus: %s\n", strerror(-r));
+            g_system_bus = NULL;
+        }
+    }
+    return g_system_bus;
+}
+
+// UPower's keyboard backlight objects, enumerated once and re-enumerated
+// whenever a SetBrightness call fails.
+#define UPOWER_MAX_PATHS 4
+
+static struct {
+    char paths[UPOWER_MAX_PATHS][128];
+    int npaths;
+    int enumerating;
+    int32_t level; // level to apply once enumeration completes
+} g_upower;
+
+static int upower_set_done(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)err;
+    int failed = sd_bus_message_is_method_error(m, NULL);
+    if (failed) {
+        dbg(3, "  UPower sync failed: %s\n", sd_bus_message_get_error(m)->message);
+        g_upower.npaths = 0;
+    }
+    // userdata: the trace ID of the change that made the call
+    trace_late((uint64_t)(uintptr_t)userdata, "bus_reply", failed ? -1 : 0);
+    return 0;
+}
+
+static void upower_set(int32_t level) {
+    for (int i = 0; i < g_upower.npaths; i++) {
+        dbg(3, "  UPower sync: %s\n", g_upower.paths[i]);
+        int r = sd_bus_call_method_async(g_system_bus, NULL, "org.freedesktop.UPower", g_upower.paths[i],
+                                         "org.freedesktop.UPower.KbdBacklight", "SetBrightness",
+                                         upower_set_done, (void *)(uintptr_t)trace_current(), "i", level);
+        if (r < 0) {
+            g_upower.npaths = 0;
+            return;
+        }
+    }
+}
+
+static int upower_enumerated(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)userdata;
+    (void)err;
+    g_upower.enumerating = 0;
+    g_upower.npaths = 0;
+    if (sd_bus_message_is_method_error(m, NULL)) {
+        dbg(3, "  UPower sync: EnumerateKbdBacklights failed: %s\n", sd_bus_message_get_error(m)->message);
+        return 0;
+    }
+    if (sd_bus_message_enter_container(m, 'a', "o") < 0) return 0;
+    const char *path;
+    while (g_upower.npaths < UPOWER_MAX_PATHS && sd_bus_message_read(m, "o", &path) > 0)
+        snprintf(g_upower.paths[g_upower.npaths++], sizeof(g_upower.paths[0]), "%s", path);
+    upower_set(g_upower.level);
+    return 0;
+}
+
+static void upower_sync(unsigned level) {
+    if (!system_bus_get()) return;
+    g_upower.level = (int32_t)level;
+    if (g_upower.npaths) {
+        upower_set(g_upower.level);
+    } else if (!g_upower.enumerating) {
+        // UPower may only pick up the LED some time after it was created, so
+        // an empty list is asked for again on the next sync
+        int r = sd_bus_call_method_async(g_system_bus, NULL, "org.freedesktop.UPower", "/org/freedesktop/UPower",
+                                         "org.freedesktop.UPower", "EnumerateKbdBacklights",
+                                         upower_enumerated, NULL, "");
+        if (r >= 0) g_upower.enumerating = 1;
+    }
+}
+
+// Session buses only admit their owner, so each connection is made with the
+// effective uid switched to the user; /run/user is rescanned for new sessions
+// at most every USER_BUS_SCAN_MS, with getdents64() into a stack buffer.
+// Connecting only opens the socket and queues the authentication; the main
+// loop polls the connections and the authentication completes from there.
+#define USER_BUS_MAX 8
+#define USER_BUS_SCAN_MS 10000
+
+typedef struct {
+    uid_t uid;
+    sd_bus *bus; // NULL = free slot
+} user_bus_t;
+
+static user_bus_t g_user_buses[USER_BUS_MAX];
+static uint64_t g_user_bus_scanned;
+
+static sd_bus *user_bus_connect(uid_t uid) {
+    char addr[PATH_MAX + 16];
+    snprintf(addr, sizeof(addr), "unix:path=%s/user/%u/bus", g_run_root, (unsigned)uid);
+    sd_bus *bus = NULL;
+    int r = sd_bus_new(&bus);
+    if (r < 0) return NULL;
+    r = sd_bus_set_address(bus, addr);
+    if (r >= 0) r = sd_bus_set_bus_client(bus, 1);
+    if (r >= 0) {
+        // The server takes our credentials from connect(), and sd_bus_start()
+        // does not wait for its answer, so the uid is switched back at once
+        uid_t euid = geteuid();
+        if (euid != uid && seteuid(uid) < 0) {
+            r = -errno;
+        } else {
+            r = sd_bus_start(bus);
+            if (euid != uid && seteuid(euid) < 0) {
+                fprintf(stderr, "fatal: cannot restore effective uid: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+    }
+    if (r < 0) {
+        dbg(3, "    session bus connection failed for user %u: %s\n", (unsigned)uid, strerror(-r));
+        sd_bus_unref(bus);
+        return NULL;
+    }
+    dbg(3, "  PowerDevil sync: connected to session bus of user %u\n", (unsigned)uid);
+    return bus;
+}
+
+static void user_bus_drop(user_bus_t *u) {
+    u->bus = sd_bus_close_unref(u->bus);
+}
+
+// Send what is queued and consume what the bus sent us (nothing is expected
+// back but the authentication and Hello replies); drops the bus on error.
+static void user_bus_pump(user_bus_t *u) {
+    int r;
+    while ((r = sd_bus_process(u->bus, NULL)) > 0) {}
+    if (r < 0) {
+        dbg(3, "    session bus of user %u lost: %s\n", (unsigned)u->uid, strerror(-r));
+        user_bus_drop(u);
+    }
+}
+
+// poll() entries for the session bus slots (free ones get fd -1); returns the
+// timeout in ms or -1.
+static int user_bus_poll_setup(struct pollfd *pfds) {
+    int timeout = -1;
+    uint64_t now = now_us();
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        user_bus_t *u = &g_user_buses[i];
+        pfds[i] = (struct pollfd){ .fd = -1 };
+        if (!u->bus) continue;
+        pfds[i].fd = sd_bus_get_fd(u->bus);
+        pfds[i].events = (short)sd_bus_get_events(u->bus);
+        uint64_t until = 0;
+        if (sd_bus_get_timeout(u->bus, &until) < 0 || until == UINT64_MAX) continue;
+        int t = (until <= now) ? 0 : (int)((until - now + 999) / 1000);
+        if (timeout < 0 || t < timeout) timeout = t;
+    }
+    return timeout;
+}
+
+static int user_bus_any(void) {
+    for (int i = 0; i < USER_BUS_MAX; i++) if (g_user_buses[i].bus) return 1;
+    return 0;
+}
+
+// Process the connections poll() reported, or all of them when a timeout is due
+static void user_bus_process(const struct pollfd *pfds, int timed_out) {
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        if (g_user_buses[i].bus && (pfds[i].revents || timed_out)) user_bus_pump(&g_user_buses[i]);
+    }
+}
+
+static int user_bus_find(uid_t uid) {
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        if (g_user_buses[i].bus && g_user_buses[i].uid == uid) return 1;
+    }
+    return 0;
+}
+
+static void user_bus_add(const char *name) {
+    char *end;
+    unsigned long v = strtoul(name, &end, 10);
+    if (*end || end == name || v == 0 || v > UINT32_MAX) return;
+    uid_t uid = (uid_t)v;
+    if (user_bus_find(uid)) return;
+
+    char sock[PATH_MAX];
+    snprintf(sock, sizeof(sock), "%s/user/%u/bus", g_run_root, (unsigned)uid);
+    struct stat st;
+    if (stat(sock, &st) != 0 || !S_ISSOCK(st.st_mode)) return;
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        if (g_user_buses[i].bus) continue;
+        g_user_buses[i].bus = user_bus_connect(uid);
+        g_user_buses[i].uid = uid;
+        return;
+    }
+    dbg(3, "  PowerDevil sync: too many sessions, skipping user %u\n", (unsigned)uid);
+}
+
+static void user_bus_scan(uint64_t now) {
+    if (g_user_bus_scanned && now < g_user_bus_scanned + USER_BUS_SCAN_MS) return;
+    g_user_bus_scanned = now;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/user", g_run_root);
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        dbg(3, "  PowerDevil sync: failed to open %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    char buf[2048] __attribute__((aligned(8)));
+    ssize_t n;
+    while ((n = getdents64(dfd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            if (de->d_name[0] != '.') user_bus_add(de->d_name);
+        }
+    }
+    close(dfd);
+}
+
+static void powerdevil_sync(unsigned level) {
+    user_bus_scan(now_ms());
+    int users = 0;
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        user_bus_t *u = &g_user_buses[i];
+        if (!u->bus) continue;
+        users++;
+        dbg(3, "  PowerDevil sync for user %u\n", (unsigned)u->uid);
+        sd_bus_message *m = NULL;
+        int r = sd_bus_message_new_method_call(u->bus, &m, "org.kde.org_kde_powerdevil",
+                                               "/org/kde/Solid/PowerManagement/Actions/KeyboardBrightnessControl",
+                                               "org.kde.Solid.PowerManagement.Actions.KeyboardBrightnessControl",
+                                               "setKeyboardBrightness");
+        if (r >= 0) r = sd_bus_message_append(m, "i", (int32_t)level);
+        if (r >= 0) r = sd_bus_message_set_expect_reply(m, 0);
+        if (r >= 0) r = sd_bus_send(u->bus, m, NULL);
+        sd_bus_message_unref(m);
+        if (r < 0) {
+            dbg(3, "    PowerDevil sync failed for user %u: %s\n", (unsigned)u->uid, strerror(-r));
+            user_bus_drop(u);
+            continue;
         }
-        if (found_users == 0 && g_debug_level >= 3) {
-            dbg(3, "  PowerDevil sync: no users found in /run/user\n");
+        user_bus_pump(u);
+    }
+    if (users == 0) dbg(3, "  PowerDevil sync: no user sessions found\n");
+}
+
+// Synchronize UI via UPower (system bus) and KDE PowerDevil (session bus).
+static void dbus_ui_sync(unsigned level) {
+    upower_sync(level);
+    powerdevil_sync(level);
+}
+
+// Probe: ui_sync(level)
+static void sync_ui(unsigned level) {
+    dbg(1, "syncing UI to level %u\n", level);
+    g_counters.ui_syncs++;
+    PROBE(ui_sync, level);
+    g_transport->ui_sync(level);
+}
+
+static void sync_ui_close(void) {
+    for (int i = 0; i < USER_BUS_MAX; i++) {
+        if (g_user_buses[i].bus) user_bus_drop(&g_user_buses[i]);
+    }
+    if (g_system_bus) g_system_bus = sd_bus_flush_close_unref(g_system_bus);
+}
+
+// Drive a context to `level` from the daemon side: the modules (except `skip`,
+// which already has it), the uleds/sysfs value and the desktop UI.
+static void ctx_set_level(uled_ctx_t *c, unsigned level, unsigned max_brightness, const target_t *skip, origin_t origin) {
+    uint64_t t0 = now_us();
+    int traced = trace_begin(origin_names[origin], c->name, t0);
+    qmk_apply_all(c->targets, c->targets_len, level, skip);
+    hist_observe(&g_hist_apply[origin], now_us() - t0);
+    c->last_level = level;
+    c->led_raw = (level * max_brightness) / 3;
+    update_sysfs_brightness(c->name, c->led_raw);
+    trace_mark("sysfs", 0, 0, 0, 0);
+    sync_ui(level);
+    trace_mark("ui_sync", 0, 0, 0, 0);
+    notify_level(c, origin);
+    trace_mark("notify", 0, 0, 0, 0);
+    if (traced) trace_end(level);
+}
+
+static unsigned ctx_effective_level(const uled_ctx_t *c) {
+    if (c->holds & HOLD_DISPLAY) return 0;
+    if ((c->holds & HOLD_IDLE) && c->want_level > c->hold_level) return c->hold_level;
+    return c->want_level;
+}
+
+static void ctx_update(uled_ctx_t *c, unsigned max_brightness, origin_t origin) {
+    unsigned level = ctx_effective_level(c);
+    if (level != c->last_level) ctx_set_level(c, level, max_brightness, NULL, origin);
+}
+
+static void ctx_request_level(uled_ctx_t *c, unsigned level, unsigned max_brightness, origin_t origin) {
+    c->want_level = level;
+    ctx_update(c, max_brightness, origin);
+}
+
+static void ctx_hold(uled_ctx_t *c, unsigned hold, int on, unsigned max_brightness, origin_t origin) {
+    if (on) c->holds |= hold;
+    else c->holds &= ~hold;
+    ctx_update(c, max_brightness, origin);
+}
+
+/* -------------------- Configuration -------------------- */
+
+typedef enum {
+    FW_MODE_UNIFIED = 0,
+    FW_MODE_SEPARATE
+} fw_mode_t;
+
+typedef struct {
+    fw_mode_t mode;
+    uint16_t vids[8];
+    size_t num_vids;
+    target_t manual_targets[16];
+    size_t num_manual_targets;
+    unsigned max_brightness;
+    unsigned poll_ms;
+    rgb_override_t rgb_ov;
+    unsigned save_delay_ms;
+    unsigned save_interval_ms;
+} config_t;
+
+static fw_mode_t parse_mode(const char *s) {
+    if (!s) return FW_MODE_UNIFIED;
+    if (!strcmp(s, "separate")) return FW_MODE_SEPARATE;
+    if (!strcmp(s, "unified")) return FW_MODE_UNIFIED;
+    return FW_MODE_UNIFIED;
+}
+
+// Comma-separated VIDs and/or VID:PID pairs (hex); replaces any previous list.
+static void parse_vid_list(const char *s, config_t *cfg) {
+    cfg->num_vids = 0;
+    cfg->num_manual_targets = 0;
+    char *dup = strdup(s);
+    if (!dup) return;
+    char *saveptr;
+    char *tok = strtok_r(dup, ",", &saveptr);
+    while (tok && (cfg->num_vids < 8 || cfg->num_manual_targets < 16)) {
+        if (strchr(tok, ':')) {
+            uint16_t v = (uint16_t)strtoul(tok, NULL, 16);
+            uint16_t p = (uint16_t)strtoul(strchr(tok, ':') + 1, NULL, 16);
+            if (cfg->num_manual_targets < 16) cfg->manual_targets[cfg->num_manual_targets++] = (target_t){v, p, ""};
+        } else if (cfg->num_vids < 8) {
+            cfg->vids[cfg->num_vids++] = (uint16_t)strtoul(tok, NULL, 16);
         }
-        closedir(d);
-    } else if (g_debug_level >= 3) {
-        dbg(3, "  PowerDevil sync: failed to opendir /run/user: %s\n", strerror(errno));
+        tok = strtok_r(NULL, ",", &saveptr);
+    }
+    free(dup);
+}
+
+/* -------------------- EEPROM persistence -------------------- */
+
+// Every change pushes the deadline out by the quiet period, so dragging a slider
+// only results in one save once it settles.
+static void save_schedule(uled_ctx_t *c, uint64_t now, unsigned delay_ms) {
+    if (delay_ms == 0) return;
+    c->save_due = now + delay_ms;
+}
+
+// When the pending save may actually run, honoring the minimum interval between saves.
+static uint64_t save_deadline(const uled_ctx_t *c, unsigned interval_ms) {
+    if (c->save_due == 0) return 0;
+    uint64_t earliest = c->last_save ? c->last_save + interval_ms : 0;
+    return (c->save_due > earliest) ? c->save_due : earliest;
+}
+
+static void save_run(uled_ctx_t *c, uint64_t now) {
+    dbg_fields(1, LOG_FIELDS(c->name, 0, 0, (int)c->last_level, -1), "saving level %u to EEPROM [%s] (%zu targets)\n", c->last_level, c->name, c->targets_len);
+    for (size_t i = 0; i < c->targets_len; i++) {
+        if (qmk_save(&c->targets[i]) < 0)
+            dbg_fields(1, LOG_FIELDS(c->name, c->targets[i].vid, c->targets[i].pid, -1, -1), "  save failed on %04x:%04x\n", c->targets[i].vid, c->targets[i].pid);
     }
+    c->save_due = 0;
+    c->last_save = now;
 }
 
 /* -------------------- HID auto-detect via sysfs -------------------- */
 
+// Does the report descriptor declare the QMK raw HID usage page
+// (Usage Page 0xFF60, encoded as 06 60 FF)?
+static int rdesc_has_raw_page(const unsigned char *d, size_t len) {
+    for (size_t i = 0; i + 2 < len; i++) {
+        if (d[i] == 0x06 && d[i+1] == 0x60 && d[i+2] == 0xFF) return 1;
+    }
+    return 0;
+}
+
+// The descriptor is read from sysfs, which neither opens nor wakes the device
+// and also works in a --root tree; the hidraw ioctl is the fallback.
+static int hidraw_has_raw_page(const char *hidraw) {
+    char path[PATH_MAX];
+    unsigned char desc[HID_MAX_DESCRIPTOR_SIZE];
+    snprintf(path, sizeof(path), "%s/class/hidraw/%s/device/report_descriptor", g_sys_root, hidraw);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, desc, sizeof(desc));
+        close(fd);
+        if (n >= 0) return rdesc_has_raw_page(desc, (size_t)n);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", g_dev_root, hidraw);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    int found = 0;
+    int desc_size = 0;
+    if (ioctl(fd, HIDIOCGRDESCSIZE, &desc_size) >= 0) {
+        struct hidraw_report_descriptor rpt;
+        rpt.size = (uint32_t)desc_size;
+        if (ioctl(fd, HIDIOCGRDESC, &rpt) >= 0 && rpt.size <= sizeof(rpt.value))
+            found = rdesc_has_raw_page(rpt.value, rpt.size);
+    }
+    close(fd);
+    return found;
+}
+
 static int find_raw_hidraw(uint16_t vid, uint16_t pid, char *out, size_t out_len) {
-    DIR *d = opendir("/sys/class/hidraw");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/class/hidraw", g_sys_root);
+    DIR *d = opendir(path);
     if (!d) return -1;
 
     struct dirent *ent;
@@ -334,8 +1866,7 @@ static int find_raw_hidraw(uint16_t vid, uint16_t pid, char *out, size_t out_len
     while ((ent = readdir(d))) {
         if (ent->d_name[0] == '.') continue;
 
-        char path[512];
-        snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", ent->d_name);
+        snprintf(path, sizeof(path), "%s/class/hidraw/%s/device/uevent", g_sys_root, ent->d_name);
         FILE *f = fopen(path, "r");
         if (!f) continue;
 
@@ -350,109 +1881,2494 @@ static int find_raw_hidraw(uint16_t vid, uint16_t pid, char *out, size_t out_len
         }
         fclose(f);
 
-        if (match) {
-            // Check report descriptor for 0xFF60
-            snprintf(path, sizeof(path), "/dev/%s", ent->d_name);
-            int fd = open(path, O_RDONLY | O_CLOEXEC);
-            if (fd >= 0) {
-                int desc_size = 0;
-                if (ioctl(fd, HIDIOCGRDESCSIZE, &desc_size) >= 0) {
-                    struct hidraw_report_descriptor rpt;
-                    rpt.size = desc_size;
-                    if (ioctl(fd, HIDIOCGRDESC, &rpt) >= 0) {
-                        for (uint32_t i = 0; i < (uint32_t)rpt.size - 2; i++) {
-                            if (rpt.value[i] == 0x06 && rpt.value[i+1] == 0x60 && rpt.value[i+2] == 0xFF) {
-                                snprintf(out, out_len, "%s", ent->d_name);
-                                found = 1;
-                                break;
-                            }
-                        }
+        if (match && hidraw_has_raw_page(ent->d_name)) {
+            snprintf(out, out_len, "%s", ent->d_name);
+            found = 1;
+            break;
+        }
+    }
+    closedir(d);
+    return found ? 0 : -1;
+}
+
+static void autodetect_targets(const uint16_t *vids, size_t num_vids, target_t *out, size_t *len, size_t cap) {
+    const uint16_t pids[] = { 0x0012, 0x0018, 0x0019, 0x0014, 0x0013 };
+
+    for (size_t v = 0; v < num_vids; v++) {
+        for (size_t i = 0; i < sizeof(pids)/sizeof(pids[0]); i++) {
+            char hidraw[64] = "";
+            if (g_transport->find(vids[v], pids[i], hidraw, sizeof(hidraw)) == 0) {
+                if (*len < cap) {
+                    target_t t = { .vid = vids[v], .pid = pids[i] };
+                    snprintf(t.hidraw, sizeof(t.hidraw), "%s", hidraw);
+                    if (!target_in_list(out, *len, &t)) {
+                        out[*len] = t;
+                        (*len)++;
                     }
                 }
-                close(fd);
             }
         }
-        if (found) break;
+    }
+}
+
+/* -------------------- Idle auto-dim -------------------- */
+
+// Keyboard/pointer evdev nodes are only read lazily: while the backlight is on
+// they stay out of the poll set and queue events in the kernel. When the idle
+// deadline passes, the queued events are drained and their (monotonic)
+// timestamps tell when the last input happened, so typing never wakes the
+// daemon. Only once dimmed are the nodes polled, to restore on the next input.
+
+#define IDLE_MAX_INPUTS 16
+
+typedef struct {
+    unsigned timeout_ms; // 0 = disabled
+    unsigned level;
+    int fds[IDLE_MAX_INPUTS];
+    size_t fds_len;
+    int dimmed;
+    uint64_t deadline;
+    uint64_t last_input; // newest input event time seen by idle_drain()
+} idle_t;
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NLONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static int test_bit(const unsigned long *bits, unsigned bit) {
+    return (bits[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1UL;
+}
+
+// Keyboards, keypads, touchpads and mice count as user activity.
+static int input_is_user_device(int fd) {
+    unsigned long keys[NLONGS(KEY_CNT)];
+    memset(keys, 0, sizeof(keys));
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0) return 0;
+    return test_bit(keys, KEY_A) || test_bit(keys, KEY_KP0) ||
+           test_bit(keys, BTN_TOUCH) || test_bit(keys, BTN_LEFT);
+}
+
+static void idle_close_inputs(idle_t *id) {
+    for (size_t i = 0; i < id->fds_len; i++) close(id->fds[i]);
+    id->fds_len = 0;
+}
+
+static void idle_open_inputs(idle_t *id) {
+    idle_close_inputs(id);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/input", g_dev_root);
+    DIR *d = opendir(path);
+    if (!d) return;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) && id->fds_len < IDLE_MAX_INPUTS) {
+        if (strncmp(ent->d_name, "event", 5) != 0) continue;
+        snprintf(path, sizeof(path), "%s/input/%s", g_dev_root, ent->d_name);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        int clk = CLOCK_MONOTONIC;
+        if (!input_is_user_device(fd) || ioctl(fd, EVIOCSCLOCKID, &clk) < 0) {
+            close(fd);
+            continue;
+        }
+        dbg(2, "idle: watching %s\n", path);
+        id->fds[id->fds_len++] = fd;
     }
     closedir(d);
-    return found ? 0 : -1;
+    dbg(1, "idle: watching %zu input devices\n", id->fds_len);
+}
+
+// Read everything queued on the input nodes; returns the newest event time
+// (ms) seen so far, or 0. The nodes are shared with the zero-wakeup mode, so
+// the time is kept in the struct rather than lost with the events.
+static uint64_t idle_drain(idle_t *id) {
+    uint64_t newest = id->last_input;
+    for (size_t i = 0; i < id->fds_len; i++) {
+        struct input_event ev[64];
+        ssize_t r;
+        while ((r = read(id->fds[i], ev, sizeof(ev))) > 0) {
+            const struct input_event *last = &ev[(size_t)r / sizeof(ev[0]) - 1];
+            uint64_t t = (uint64_t)last->input_event_sec * 1000ULL + (uint64_t)last->input_event_usec / 1000ULL;
+            if (t > newest) newest = t;
+        }
+    }
+    id->last_input = newest;
+    return newest;
+}
+
+// Called when the idle deadline passes. Returns 1 if the contexts should be dimmed now.
+static int idle_expired(idle_t *id, uint64_t now) {
+    uint64_t last_input = idle_drain(id);
+    if (last_input && last_input + id->timeout_ms > now) {
+        id->deadline = last_input + id->timeout_ms;
+        return 0;
+    }
+    return 1;
+}
+
+static void idle_dim(idle_t *id, uled_ctx_t *ctxs, unsigned max_brightness) {
+    dbg(1, "idle: no input for %us, dimming to level %u\n", id->timeout_ms / 1000, id->level);
+    for (int i = 0; i < 4; i++) {
+        if (ctxs[i].fd < 0) continue;
+        ctxs[i].hold_level = id->level;
+        ctx_hold(&ctxs[i], HOLD_IDLE, 1, max_brightness, ORIGIN_IDLE);
+    }
+    id->dimmed = 1;
+}
+
+static void idle_wake(idle_t *id, uled_ctx_t *ctxs, unsigned max_brightness, uint64_t now) {
+    (void)idle_drain(id);
+    dbg(1, "idle: input detected, restoring\n");
+    for (int i = 0; i < 4; i++) {
+        if (ctxs[i].fd >= 0) ctx_hold(&ctxs[i], HOLD_IDLE, 0, max_brightness, ORIGIN_IDLE);
+    }
+    id->dimmed = 0;
+    id->deadline = now + id->timeout_ms;
+}
+
+/* -------------------- Zero-wakeup mode -------------------- */
+
+// With --zero-wakeup, the hardware poll stops once no input has been seen for
+// QUIET_AFTER_MS, and the daemon then sleeps on its fds only: uleds, uevents,
+// sockets and the input nodes (shared with idle_t). The next input resumes
+// polling right away, so a backlight key pressed along with other activity
+// is still picked up. Fn+Space itself is handled in the module firmware and
+// sends no HID report (keyboard or raw), so a change made with nothing else
+// typed is only seen at the next input.
+
+#define QUIET_AFTER_MS 30000
+#define QUIET_TIMER_SLACK_NS 50000000UL // 50ms, applied to all of the daemon's timers
+
+typedef struct {
+    int enabled;
+    int active;       // polling stopped, waiting for input
+    uint64_t deadline;
+} quiet_t;
+
+// Called when the quiet deadline passes. Returns 1 if polling should stop now.
+static int quiet_expired(quiet_t *q, idle_t *id, uint64_t now) {
+    uint64_t last_input = idle_drain(id);
+    if (last_input && last_input + QUIET_AFTER_MS > now) {
+        q->deadline = last_input + QUIET_AFTER_MS;
+        return 0;
+    }
+    dbg(1, "quiet: no input for %us, stopping hardware polling\n", QUIET_AFTER_MS / 1000);
+    q->active = 1;
+    return 1;
+}
+
+static void quiet_wake(quiet_t *q, idle_t *id, uint64_t now) {
+    (void)idle_drain(id);
+    dbg(1, "quiet: input detected, resuming hardware polling\n");
+    q->active = 0;
+    q->deadline = now + QUIET_AFTER_MS;
+}
+
+/* -------------------- Ambient light auto-brightness -------------------- */
+
+// Reads the ALS through the IIO buffer character device, so samples are pushed
+// by the sensor's trigger instead of polling sysfs. Readings are low-pass
+// filtered, mapped to a level with hysteresis around each threshold, and level
+// changes are spaced at least ALS_MIN_INTERVAL_MS apart.
+
+#define ALS_MIN_INTERVAL_MS 2000
+#define ALS_HYSTERESIS 0.2
+
+typedef struct {
+    int enabled;
+    int fd;
+    char dir[PATH_MAX]; // /sys/bus/iio/devices/iio:deviceN
+    double thresholds[3]; // lux, ascending: below [0] -> level 3 ... above [2] -> level 0
+    // sample layout from scan_elements/in_illuminance_type
+    int be;
+    int is_signed;
+    unsigned bits;
+    unsigned storage;
+    unsigned shift;
+    double scale;
+    double offset;
+    double filtered;    // < 0 until the first sample
+    unsigned level;     // last level decided from ambient light
+    int pending;        // a new level is waiting for the rate limit
+    uint64_t last_apply;
+} als_t;
+
+static int sysfs_read_str(const char *path, char *buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = read(fd, buf, len - 1);
+    close(fd);
+    if (r < 0) return -1;
+    buf[r] = '\0';
+    char *nl = strchr(buf, '\n');
+    if (nl) *nl = '\0';
+    return 0;
+}
+
+static int sysfs_write_str(const char *path, const char *val) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t w = write(fd, val, strlen(val));
+    close(fd);
+    return (w == (ssize_t)strlen(val)) ? 0 : -1;
+}
+
+static int als_attr(const als_t *a, const char *attr, char *buf, size_t len) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", a->dir, attr);
+    return sysfs_read_str(path, buf, len);
+}
+
+static int als_set(const als_t *a, const char *attr, const char *val) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/%s", a->dir, attr);
+    return sysfs_write_str(path, val);
+}
+
+static int als_find(als_t *a) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bus/iio/devices", g_sys_root);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    struct dirent *ent;
+    int found = 0;
+    while (!found && (ent = readdir(d))) {
+        if (strncmp(ent->d_name, "iio:device", 10) != 0) continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/bus/iio/devices/%s/scan_elements/in_illuminance_en", g_sys_root, ent->d_name);
+        if (stat(path, &st) != 0) continue;
+        snprintf(a->dir, sizeof(a->dir), "%s/bus/iio/devices/%s", g_sys_root, ent->d_name);
+        found = 1;
+    }
+    closedir(d);
+    return found ? 0 : -1;
+}
+
+// Enable only the illuminance channel so every scan is a single sample.
+static int als_setup_scan(als_t *a) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/scan_elements", a->dir);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        size_t n = strlen(ent->d_name);
+        if (n < 4 || strcmp(ent->d_name + n - 3, "_en") != 0) continue;
+        char attr[300];
+        snprintf(attr, sizeof(attr), "scan_elements/%s", ent->d_name);
+        (void)als_set(a, attr, strcmp(ent->d_name, "in_illuminance_en") ? "0" : "1");
+    }
+    closedir(d);
+
+    char type[64];
+    char endian[3] = "", sign = 0;
+    if (als_attr(a, "scan_elements/in_illuminance_type", type, sizeof(type)) < 0) return -1;
+    if (sscanf(type, "%2[bl]e:%c%u/%u>>%u", endian, &sign, &a->bits, &a->storage, &a->shift) != 5) return -1;
+    if (a->storage != 8 && a->storage != 16 && a->storage != 32 && a->storage != 64) return -1;
+    if (a->bits == 0 || a->bits > a->storage) return -1;
+    a->be = (endian[0] == 'b');
+    a->is_signed = (sign == 's');
+
+    char val[64];
+    a->scale = 1.0;
+    a->offset = 0.0;
+    if (als_attr(a, "in_illuminance_scale", val, sizeof(val)) == 0) a->scale = strtod(val, NULL);
+    if (als_attr(a, "in_illuminance_offset", val, sizeof(val)) == 0) a->offset = strtod(val, NULL);
+    return 0;
+}
+
+static void als_close(als_t *a) {
+    if (a->fd < 0) return;
+    close(a->fd);
+    a->fd = -1;
+    (void)als_set(a, "buffer/enable", "0");
+}
+
+static int als_open(als_t *a) {
+    a->fd = -1;
+    a->filtered = -1.0;
+    if (als_find(a) < 0) {
+        dbg(1, "als: no IIO illuminance sensor found\n");
+        return -1;
+    }
+    (void)als_set(a, "buffer/enable", "0");
+    if (als_setup_scan(a) < 0) {
+        dbg(1, "als: unsupported scan layout on %s\n", a->dir);
+        return -1;
+    }
+
+    // The sensor's own trigger is normally attached by the driver; fall back to
+    // the first trigger that names this device.
+    char trig[64];
+    if (als_attr(a, "trigger/current_trigger", trig, sizeof(trig)) == 0 && trig[0] == '\0') {
+        const char *dev = strrchr(a->dir, '/') + 1 + 10; // N of iio:deviceN
+        char want[64];
+        snprintf(want, sizeof(want), "als-dev%s", dev);
+        (void)als_set(a, "trigger/current_trigger", want);
+    }
+
+    // Ask for ~1 Hz; the rate limit below bounds level changes regardless.
+    (void)als_set(a, "in_illuminance_sampling_frequency", "1");
+    (void)als_set(a, "sampling_frequency", "1");
+    (void)als_set(a, "buffer/length", "16");
+    (void)als_set(a, "buffer/watermark", "1");
+    if (als_set(a, "buffer/enable", "1") < 0) {
+        dbg(1, "als: failed to enable buffer on %s: %s\n", a->dir, strerror(errno));
+        return -1;
+    }
+
+    char dev[PATH_MAX];
+    snprintf(dev, sizeof(dev), "%s/%s", g_dev_root, strrchr(a->dir, '/') + 1);
+    a->fd = open(dev, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (a->fd < 0) {
+        // EBUSY: another consumer (e.g. iio-sensor-proxy) owns the buffer
+        dbg(1, "als: failed to open %s: %s\n", dev, strerror(errno));
+        (void)als_set(a, "buffer/enable", "0");
+        return -1;
+    }
+    dbg(1, "als: using %s (%s, scale %g)\n", dev, a->be ? "be" : "le", a->scale);
+    return 0;
+}
+
+static double als_decode(const als_t *a, const unsigned char *p) {
+    uint64_t raw = 0;
+    unsigned nbytes = a->storage / 8;
+    for (unsigned i = 0; i < nbytes; i++) {
+        unsigned b = a->be ? i : nbytes - 1 - i;
+        raw = (raw << 8) | p[b];
+    }
+    raw >>= a->shift;
+    if (a->bits < 64) raw &= (1ULL << a->bits) - 1;
+    int64_t v = (int64_t)raw;
+    if (a->is_signed && a->bits < 64 && (raw >> (a->bits - 1)) & 1) v -= (int64_t)(1ULL << a->bits);
+    return ((double)v + a->offset) * a->scale;
+}
+
+static unsigned als_level_for(const als_t *a, double lux, unsigned cur) {
+    unsigned lvl = cur;
+    while (lvl > 0 && lux > a->thresholds[3 - lvl] * (1.0 + ALS_HYSTERESIS)) lvl--;
+    while (lvl < 3 && lux < a->thresholds[2 - lvl] * (1.0 - ALS_HYSTERESIS)) lvl++;
+    return lvl;
+}
+
+// Drain queued samples and update the filtered value. Returns 1 if the decided level changed.
+static int als_read(als_t *a) {
+    unsigned char buf[64 * 8];
+    size_t ssz = a->storage / 8;
+    ssize_t r;
+    int changed = 0;
+    while ((r = read(a->fd, buf, sizeof(buf))) > 0) {
+        for (size_t off = 0; off + ssz <= (size_t)r; off += ssz) {
+            double lux = als_decode(a, buf + off);
+            if (lux < 0) lux = 0;
+            a->filtered = (a->filtered < 0) ? lux : a->filtered * 0.75 + lux * 0.25;
+        }
+    }
+    if (a->filtered < 0) return 0;
+    unsigned lvl = als_level_for(a, a->filtered, a->level);
+    if (lvl != a->level) {
+        dbg(2, "als: %.1f lux -> level %u\n", a->filtered, lvl);
+        a->level = lvl;
+        a->pending = 1;
+        changed = 1;
+    }
+    return changed;
+}
+
+static uint64_t als_deadline(const als_t *a) {
+    if (!a->pending) return 0;
+    return a->last_apply ? a->last_apply + ALS_MIN_INTERVAL_MS : 1;
+}
+
+static int parse_als_thresholds(const char *s, als_t *a) {
+    double t[3];
+    if (sscanf(s, "%lf,%lf,%lf", &t[0], &t[1], &t[2]) != 3) return -1;
+    if (!(t[0] >= 0 && t[0] < t[1] && t[1] < t[2])) return -1;
+    memcpy(a->thresholds, t, sizeof(t));
+    return 0;
+}
+
+/* -------------------- Follow display backlight -------------------- */
+
+// Keyboard level tracks the panel backlight. Changes arrive as `backlight`
+// uevents on the hotplug netlink socket and as SW_LID events, so nothing is
+// polled. Display off (zero brightness, bl_power, lid closed) holds the
+// keyboard off; the previous level comes back with the display. DPMS is not
+// followed: the kernel sends no uevent when a connector is switched off.
+
+typedef struct {
+    int enabled;
+    char dir[PATH_MAX]; // /sys/class/backlight/<panel>
+    unsigned max;
+    int lid_fd;
+    int lid_closed;
+    int panel_off;
+    int off;        // currently holding the keyboard off
+    int last_bri;   // -1 = unknown
+} display_t;
+
+static int read_uint_attr(const char *dir, const char *attr, unsigned *out) {
+    char path[PATH_MAX + 64], buf[32];
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    if (sysfs_read_str(path, buf, sizeof(buf)) < 0) return -1;
+    *out = (unsigned)strtoul(buf, NULL, 10);
+    return 0;
+}
+
+static void display_open_lid(display_t *d) {
+    d->lid_fd = -1;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/input", g_dev_root);
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) && d->lid_fd < 0) {
+        if (strncmp(ent->d_name, "event", 5) != 0) continue;
+        snprintf(path, sizeof(path), "%s/input/%s", g_dev_root, ent->d_name);
+        int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) continue;
+        unsigned long sw[NLONGS(SW_CNT)];
+        memset(sw, 0, sizeof(sw));
+        if (ioctl(fd, EVIOCGBIT(EV_SW, sizeof(sw)), sw) >= 0 && test_bit(sw, SW_LID)) {
+            unsigned long state[NLONGS(SW_CNT)];
+            memset(state, 0, sizeof(state));
+            if (ioctl(fd, EVIOCGSW(sizeof(state)), state) >= 0) d->lid_closed = test_bit(state, SW_LID);
+            d->lid_fd = fd;
+            dbg(1, "display: lid switch %s (%s)\n", path, d->lid_closed ? "closed" : "open");
+        } else {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+static int display_open(display_t *d) {
+    d->last_bri = -1;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/class/backlight", g_sys_root);
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    struct dirent *ent;
+    int found = 0;
+    while (!found && (ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        snprintf(d->dir, sizeof(d->dir), "%s/class/backlight/%s", g_sys_root, ent->d_name);
+        found = (read_uint_attr(d->dir, "max_brightness", &d->max) == 0 && d->max > 0);
+    }
+    closedir(dir);
+    if (!found) {
+        dbg(1, "display: no panel backlight found\n");
+        return -1;
+    }
+    dbg(1, "display: following %s (max %u)\n", d->dir, d->max);
+    display_open_lid(d);
+    return 0;
+}
+
+static void display_close(display_t *d) {
+    if (d->lid_fd >= 0) close(d->lid_fd);
+    d->lid_fd = -1;
+}
+
+static void display_read_lid(display_t *d) {
+    struct input_event ev[16];
+    ssize_t r;
+    while ((r = read(d->lid_fd, ev, sizeof(ev))) > 0) {
+        for (size_t i = 0; i < (size_t)r / sizeof(ev[0]); i++) {
+            if (ev[i].type == EV_SW && ev[i].code == SW_LID) d->lid_closed = ev[i].value != 0;
+        }
+    }
+}
+
+// Re-evaluate the panel and push the result to the contexts.
+static void display_update(display_t *d, uled_ctx_t *ctxs, unsigned max_brightness) {
+    unsigned bri = 0, bl_power = 0;
+    if (read_uint_attr(d->dir, "brightness", &bri) < 0) return;
+    (void)read_uint_attr(d->dir, "bl_power", &bl_power);
+    d->panel_off = (bri == 0 || bl_power != 0);
+
+    int off = d->lid_closed || d->panel_off;
+    if (off != d->off) {
+        dbg(1, "display: %s (lid=%s brightness=%u bl_power=%u)\n", off ? "off" : "on",
+            d->lid_closed ? "closed" : "open", bri, bl_power);
+        d->off = off;
+        for (int i = 0; i < 4; i++) {
+            if (ctxs[i].fd >= 0) ctx_hold(&ctxs[i], HOLD_DISPLAY, off, max_brightness, ORIGIN_DISPLAY);
+        }
+    }
+
+    if (!off && (int)bri != d->last_bri) {
+        unsigned level = (bri * 3 + d->max - 1) / d->max;
+        if (level > 3) level = 3;
+        dbg(2, "display: brightness %u/%u -> level %u\n", bri, d->max, level);
+        for (int i = 0; i < 4; i++) {
+            if (ctxs[i].fd >= 0) ctx_request_level(&ctxs[i], level, max_brightness, ORIGIN_DISPLAY);
+        }
+    }
+    d->last_bri = (int)bri;
+}
+
+/* -------------------- uleds LED creation -------------------- */
+
+static int create_uleds_led(const char *name, unsigned max_brightness) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/uleds", g_dev_root);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct uleds_user_dev u;
+    memset(&u, 0, sizeof(u));
+    snprintf(u.name, sizeof(u.name), "%s", name);
+    u.max_brightness = max_brightness;
+
+    if (write(fd, &u, sizeof(u)) != (ssize_t)sizeof(u)) {
+        perror("write uleds");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* -------------------- Transports -------------------- */
+
+static const transport_t transport_hidraw = {
+    .name = "hidraw",
+    .find = find_raw_hidraw,
+    .xfer = hidraw_report_xfer,
+    .batch = qmk_hidraw_batch,
+    .suspended = hidraw_usb_suspended,
+    .idle_deadline = hidraw_idle_deadline,
+    .close_idle = hidraw_close_idle,
+    .close_all = hidraw_close_all,
+    .led_create = create_uleds_led,
+    .led_write = sysfs_led_write,
+    .ui_sync = dbus_ui_sync,
+};
+
+// `--transport mock[:PID,...][@LATENCY_US]`: in-process modules (default one
+// ANSI keyboard) that answer VIA requests from the same module model as
+// fw16-kbd-emu (fw16-kbd-uleds-via.h), each transfer taking LATENCY_US. LED
+// writes and UI syncs only count. Only a replay or a test script writes to the
+// uleds fd (a socket), so otherwise changes come in through the control socket
+// or D-Bus. Every operation is logged at debug level 2 and kept in an ordered
+// op log (the last MOCK_LOG_LEN), which is printed with the totals on exit at
+// debug level 1; no root or hardware needed.
+#define MOCK_MAX_MODULES 8
+#define MOCK_LOG_LEN 256
+#define MOCK_BRIGHTNESS 170 // module brightness at startup
+
+typedef enum {
+    MOCK_OP_FIND = 0,
+    MOCK_OP_XFER,
+    MOCK_OP_LED_WRITE,
+    MOCK_OP_UI_SYNC,
+    MOCK_OP_COUNT
+} mock_op_t;
+
+static const char *const mock_op_names[MOCK_OP_COUNT] = { "find", "xfer", "led_write", "ui_sync" };
+
+typedef struct {
+    uint16_t pid;
+    via_module_t via;
+} mock_module_t;
+
+typedef struct {
+    uint64_t t_us;
+    mock_op_t op;
+    char target[32];         // mockN, or the LED name
+    unsigned char req[4];    // xfer: start of the request
+    unsigned char resp[4];   // xfer: start of the reply
+    int val;                 // find: pid (-1 if not found); led_write, ui_sync: value
+} mock_log_t;
+
+// Scripted inputs for deterministic tests, at `at_ms` after the script
+// starts: a slider write of `value` to LED `index`, a Fn+Space press on
+// module `index`, user activity on an input node (for --idle-timeout), a
+// call into the test (e.g. to act as a control socket client from inside the
+// loop), or the end of the run.
+typedef enum {
+    MOCK_EV_SLIDER = 0,
+    MOCK_EV_KEY,
+    MOCK_EV_INPUT,
+    MOCK_EV_CALL,
+    MOCK_EV_END
+} mock_ev_type_t;
+
+typedef struct {
+    uint64_t at_ms;
+    mock_ev_type_t type;
+    unsigned index;
+    unsigned value;
+    void (*call)(unsigned value); // MOCK_EV_CALL
+} mock_event_t;
+
+static struct {
+    mock_module_t mods[MOCK_MAX_MODULES];
+    size_t len;
+    unsigned latency_us;
+    int led_wfds[4]; // write ends, kept so the LED sockets never see EOF
+    int input_wfd;   // MOCK_EV_INPUT goes here, -1 until mock_input_attach()
+    char led_names[4][64];
+    size_t leds;
+    uint64_t ops[MOCK_OP_COUNT];
+    uint64_t busy_us;
+    mock_log_t log[MOCK_LOG_LEN];
+    uint64_t log_next;       // entries ever logged; the last MOCK_LOG_LEN are kept
+    const mock_event_t *script;
+    size_t script_len;
+    size_t script_next;
+    uint64_t script_t0_us;   // 0 until the main loop first runs it
+} g_mock;
+
+static mock_module_t *mock_module(const char *hidraw) {
+    if (strncmp(hidraw, "mock", 4) != 0) return NULL;
+    unsigned long i = strtoul(hidraw + 4, NULL, 10);
+    return (i < g_mock.len) ? &g_mock.mods[i] : NULL;
+}
+
+static void mock_delay(void) {
+    if (!g_mock.latency_us) return;
+    clock_sleep_us(g_mock.latency_us);
+    g_mock.busy_us += g_mock.latency_us;
+}
+
+static void mock_log(mock_op_t op, const char *target, const unsigned char *req, const unsigned char *resp, int val) {
+    g_mock.ops[op]++;
+    mock_log_t *e = &g_mock.log[g_mock.log_next++ % MOCK_LOG_LEN];
+    memset(e, 0, sizeof(*e));
+    e->t_us = now_us();
+    e->op = op;
+    snprintf(e->target, sizeof(e->target), "%s", target);
+    if (req) memcpy(e->req, req, sizeof(e->req));
+    if (resp) memcpy(e->resp, resp, sizeof(e->resp));
+    e->val = val;
+}
+
+static int mock_find(uint16_t vid, uint16_t pid, char *out, size_t out_len) {
+    (void)vid;
+    for (size_t i = 0; i < g_mock.len; i++) {
+        if (g_mock.mods[i].pid != pid) continue;
+        snprintf(out, out_len, "mock%zu", i);
+        mock_log(MOCK_OP_FIND, out, NULL, NULL, pid);
+        return 0;
+    }
+    mock_log(MOCK_OP_FIND, "-", NULL, NULL, -1);
+    return -1;
+}
+
+static int mock_xfer(const char *hidraw, const unsigned char *req, unsigned char *resp) {
+    mock_module_t *m = mock_module(hidraw);
+    if (!m) {
+        mock_log(MOCK_OP_XFER, hidraw, req, NULL, -1);
+        return -1;
+    }
+    mock_delay();
+    memcpy(resp, req, 32);
+    via_handle(&m->via, resp);
+    mock_log(MOCK_OP_XFER, hidraw, req, resp, 0);
+    dbg(2, "mock: %s %02x %02x %02x %02x -> %02x %02x\n", hidraw, req[0], req[1], req[2], req[3], resp[0], resp[3]);
+    return 0;
+}
+
+// All requests are in flight together, so the latency is paid once
+static int mock_batch(const char *hidraw, qmk_req_t *reqs, size_t n) {
+    mock_module_t *m = mock_module(hidraw);
+    if (!m) return -1;
+    mock_delay();
+    int acked = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char req[32], r[32];
+        qmk_req_report(&reqs[i], req);
+        memcpy(r, req, sizeof(r));
+        via_handle(&m->via, r);
+        mock_log(MOCK_OP_XFER, hidraw, req, r, 0);
+        reqs[i].ok = (r[0] != QMK_ID_UNHANDLED);
+        if (reqs[i].ok) {
+            memcpy(reqs[i].resp, &r[3], sizeof(reqs[i].resp));
+            acked++;
+        }
+    }
+    g_counters.hid_xfers += n;
+    g_counters.hid_errors += n - (size_t)acked;
+    return acked;
+}
+
+static int mock_suspended(const char *hidraw) {
+    (void)hidraw;
+    return 0;
+}
+
+static uint64_t mock_idle_deadline(void) {
+    return 0;
+}
+
+static void mock_close_idle(uint64_t now) {
+    (void)now;
+}
+
+static void mock_close_all(void) {
+}
+
+// A packet socket rather than a pipe, so each event written by a replay is
+// read on its own like from /dev/uleds
+static int mock_led_create(const char *name, unsigned max_brightness) {
+    int sv[2];
+    if (g_mock.leds == sizeof(g_mock.led_wfds) / sizeof(g_mock.led_wfds[0]) ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    snprintf(g_mock.led_names[g_mock.leds], sizeof(g_mock.led_names[0]), "%s", name);
+    g_mock.led_wfds[g_mock.leds++] = sv[1];
+    dbg(2, "mock: created LED %s (max %u)\n", name, max_brightness);
+    return sv[0];
+}
+
+static int mock_led_wfd(const char *name) {
+    for (size_t i = 0; i < g_mock.leds; i++) {
+        if (!strcmp(g_mock.led_names[i], name)) return g_mock.led_wfds[i];
+    }
+    return -1;
+}
+
+// An input node for the idle timeout: a pipe among the idle fds that
+// MOCK_EV_INPUT writes key events to. Attached again whenever the daemon
+// reopens its input nodes, which closes the read end.
+static void mock_input_attach(idle_t *id) {
+    int p[2];
+    if (g_mock.input_wfd >= 0) close(g_mock.input_wfd);
+    g_mock.input_wfd = -1;
+    if (id->fds_len == IDLE_MAX_INPUTS || pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) return;
+    id->fds[id->fds_len++] = p[0];
+    g_mock.input_wfd = p[1];
+}
+
+static int mock_led_write(const char *name, unsigned val) {
+    mock_log(MOCK_OP_LED_WRITE, name, NULL, NULL, (int)val);
+    dbg(2, "mock: LED %s = %u\n", name, val);
+    return 0;
+}
+
+static void mock_ui_sync(unsigned level) {
+    mock_log(MOCK_OP_UI_SYNC, "ui", NULL, NULL, (int)level);
+    dbg(2, "mock: UI sync to level %u\n", level);
+}
+
+static const transport_t transport_mock = {
+    .name = "mock",
+    .find = mock_find,
+    .xfer = mock_xfer,
+    .batch = mock_batch,
+    .suspended = mock_suspended,
+    .idle_deadline = mock_idle_deadline,
+    .close_idle = mock_close_idle,
+    .close_all = mock_close_all,
+    .led_create = mock_led_create,
+    .led_write = mock_led_write,
+    .ui_sync = mock_ui_sync,
+};
+
+// "hidraw" or "mock[:PID,...][@LATENCY_US]"
+static int transport_select(const char *spec) {
+    if (!strcmp(spec, "hidraw")) {
+        g_transport = &transport_hidraw;
+        return 0;
+    }
+    if (strncmp(spec, "mock", 4) != 0 || (spec[4] && spec[4] != ':' && spec[4] != '@')) return -1;
+    const char *p = spec + 4;
+    g_mock.len = 0;
+    if (*p == ':') {
+        p++;
+        while (*p && *p != '@' && g_mock.len < MOCK_MAX_MODULES) {
+            char *end;
+            unsigned long pid = strtoul(p, &end, 16);
+            if (end == p) return -1;
+            g_mock.mods[g_mock.len++] = (mock_module_t){ .pid = (uint16_t)pid };
+            p = (*end == ',') ? end + 1 : end;
+        }
+    }
+    if (*p == '@') g_mock.latency_us = (unsigned)strtoul(p + 1, NULL, 10);
+    if (g_mock.len == 0) g_mock.mods[g_mock.len++] = (mock_module_t){ .pid = 0x0012 };
+    g_mock.input_wfd = -1;
+    for (size_t i = 0; i < g_mock.len; i++)
+        via_module_init(&g_mock.mods[i].via, g_mock.mods[i].pid, MOCK_BRIGHTNESS);
+    g_transport = &transport_mock;
+    return 0;
+}
+
+// With the mock, SIGINT and SIGTERM end the main loop normally so the totals
+// below get printed; the daemon otherwise just dies on them.
+static volatile sig_atomic_t g_mock_stop = 0;
+
+static void mock_on_stop(int sig) {
+    (void)sig;
+    g_mock_stop = 1;
+}
+
+static void mock_install_stop_handlers(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = mock_on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// When the next scripted input is due (0 if none)
+static uint64_t mock_script_deadline(void) {
+    if (!g_mock.script || g_mock.script_next == g_mock.script_len) return 0;
+    return (g_mock.script_t0_us + g_mock.script[g_mock.script_next].at_ms * 1000 + 999) / 1000;
+}
+
+// Deliver the scripted inputs that are due. Returns 1 when the script ends the run.
+static int mock_script_pump(void) {
+    uint64_t now = now_us();
+    if (!g_mock.script_t0_us) g_mock.script_t0_us = now;
+    while (g_mock.script_next < g_mock.script_len) {
+        const mock_event_t *ev = &g_mock.script[g_mock.script_next];
+        if (g_mock.script_t0_us + ev->at_ms * 1000 > now) break;
+        g_mock.script_next++;
+        switch (ev->type) {
+        case MOCK_EV_SLIDER:
+            if (ev->index < g_mock.leds) {
+                uint32_t v = ev->value;
+                (void)send(g_mock.led_wfds[ev->index], &v, sizeof(v), MSG_DONTWAIT);
+            }
+            break;
+        case MOCK_EV_KEY:
+            if (ev->index < g_mock.len) (void)via_step(&g_mock.mods[ev->index].via);
+            break;
+        case MOCK_EV_INPUT:
+            if (g_mock.input_wfd >= 0) {
+                struct input_event ie = { .type = EV_KEY, .code = KEY_A, .value = 1 };
+                ie.input_event_sec = now / 1000000ULL;
+                ie.input_event_usec = now % 1000000ULL;
+                ssize_t w = write(g_mock.input_wfd, &ie, sizeof(ie));
+                (void)w;
+            }
+            break;
+        case MOCK_EV_CALL:
+            ev->call(ev->value);
+            break;
+        case MOCK_EV_END:
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mock_report(void) {
+    fprintf(stderr, "mock transport:");
+    for (int i = 0; i < MOCK_OP_COUNT; i++) fprintf(stderr, " %s=%llu", mock_op_names[i], (unsigned long long)g_mock.ops[i]);
+    fprintf(stderr, " busy_us=%llu\n", (unsigned long long)g_mock.busy_us);
+    if (g_debug_level < 1) return;
+    uint64_t first = g_mock.log_next > MOCK_LOG_LEN ? g_mock.log_next - MOCK_LOG_LEN : 0;
+    for (uint64_t i = first; i < g_mock.log_next; i++) {
+        const mock_log_t *e = &g_mock.log[i % MOCK_LOG_LEN];
+        fprintf(stderr, "  %llu.%06llu %-9s %-24s", (unsigned long long)(e->t_us / 1000000ULL),
+                (unsigned long long)(e->t_us % 1000000ULL), mock_op_names[e->op], e->target);
+        if (e->op == MOCK_OP_XFER)
+            fprintf(stderr, " %02x %02x %02x %02x -> %02x %02x %02x %02x\n", e->req[0], e->req[1], e->req[2], e->req[3],
+                    e->resp[0], e->resp[1], e->resp[2], e->resp[3]);
+        else if (e->op == MOCK_OP_FIND && e->val >= 0)
+            fprintf(stderr, " %04x\n", (unsigned)e->val);
+        else
+            fprintf(stderr, " %d\n", e->val);
+    }
+}
+
+/* -------------------- uevent hotplug -------------------- */
+
+static int open_uevent_sock(void) {
+    int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (s < 0) return -1;
+
+    struct sockaddr_nl snl;
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_pid = (uint32_t)getpid();
+    snl.nl_groups = 1; // receive broadcast uevents
+
+    if (bind(s, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    // Increase buffer to avoid drops under churn
+    int rcvbuf = 1024 * 1024;
+    (void)setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    return s;
+}
+
+// Quick filter: check if uevent message appears relevant to hid subsystem or contains "HID_ID="
+// (Message is NUL-separated strings, e.g. "add@/devices/... \0 ACTION=add \0 SUBSYSTEM=hid \0 ...")
+static int uevent_maybe_relevant(const char *buf, ssize_t len) {
+    if (len <= 0) return 0;
+    // Do a cheap substring scan; buffer is NUL-separated but still searchable.
+    if (memmem(buf, (size_t)len, "SUBSYSTEM=hid", 13)) return 1;
+    if (memmem(buf, (size_t)len, "SUBSYSTEM=hidraw", 16)) return 1;
+    if (memmem(buf, (size_t)len, "HID_ID=", 7)) return 1;
+    return 0;
+}
+
+// Re-discover targets and update the contexts. Newly seen targets are brought
+// to the context level (or get their cached RGB state back).
+// Probes: rescan_entry(), rescan_return(targets, duration_us)
+static void rescan_targets(uled_ctx_t *ctxs, const config_t *cfg, uint64_t now) {
+    g_counters.rescans++;
+    // hidraw nodes may have gone away or been renumbered
+    g_transport->close_all();
+    uint64_t t0 = now_us();
+    size_t total = 0;
+    PROBE(rescan_entry);
+    target_t new_all[32];
+    size_t new_len = 0;
+
+    target_t disc[16];
+    size_t disc_len = 0;
+    autodetect_targets(cfg->vids, cfg->num_vids, disc, &disc_len, 16);
+
+    for (size_t i = 0; i < cfg->num_manual_targets && new_len < 32; i++) {
+        target_t t = cfg->manual_targets[i];
+        (void)g_transport->find(t.vid, t.pid, t.hidraw, sizeof(t.hidraw));
+        if (!target_in_list(new_all, new_len, &t))
+            new_all[new_len++] = t;
+    }
+    for (size_t i = 0; i < disc_len && new_len < 32; i++) {
+        if (!target_in_list(new_all, new_len, &disc[i]))
+            new_all[new_len++] = disc[i];
+    }
+
+    // Simplified hotplug sync: just update targets in existing contexts
+    for (int i = 0; i < 4; i++) {
+        int added = 0;
+        size_t old_targets_len = ctxs[i].targets_len;
+        target_t old_targets[16];
+        memcpy(old_targets, ctxs[i].targets, sizeof(target_t) * old_targets_len);
+        ctxs[i].targets_len = 0;
+
+        for (size_t j = 0; j < new_len; j++) {
+            int type = (cfg->mode == FW_MODE_SEPARATE) ? get_type(new_all[j].pid) : 0;
+            if (type == i && ctxs[i].targets_len < 16) {
+                target_t t = new_all[j];
+                if (!target_in_list(old_targets, old_targets_len, &t)) {
+                    dbg_fields(1, LOG_FIELDS(ctxs[i].name, t.vid, t.pid, -1, -1), "hotplug [%s]: new device %04x:%04x (%s)\n", ctxs[i].name, t.vid, t.pid, t.hidraw);
+                    events_publish("target add %04x:%04x %s %s\n", t.vid, t.pid, ctxs[i].name, *t.hidraw ? t.hidraw : "-");
+                    uint64_t t1 = now_us();
+                    int traced = trace_begin(origin_names[ORIGIN_HOTPLUG], ctxs[i].name, t1);
+                    if (!target_has_rgb(&t) || rgb_attach(&t, &cfg->rgb_ov, ctxs[i].last_level) != 0)
+                        qmk_set(&t, level_to_qmk_pct(ctxs[i].last_level));
+                    hist_observe(&g_hist_apply[ORIGIN_HOTPLUG], now_us() - t1);
+                    if (traced) trace_end(ctxs[i].last_level);
+                    save_schedule(&ctxs[i], now, cfg->save_delay_ms);
+                    added = 1;
+                }
+                // The hidraw node may have been renumbered on re-enumeration
+                if (target_eq(&t, &ctxs[i].master)) ctxs[i].master = t;
+                ctxs[i].targets[ctxs[i].targets_len++] = t;
+            }
+        }
+
+        for (size_t j = 0; j < old_targets_len; j++) {
+            if (!target_in_list(ctxs[i].targets, ctxs[i].targets_len, &old_targets[j])) {
+                dbg_fields(1, LOG_FIELDS(ctxs[i].name, old_targets[j].vid, old_targets[j].pid, -1, -1), "hotplug [%s]: device removed %04x:%04x\n", ctxs[i].name, old_targets[j].vid, old_targets[j].pid);
+                events_publish("target remove %04x:%04x %s\n", old_targets[j].vid, old_targets[j].pid, ctxs[i].name);
+            }
+        }
+        // The context level is unchanged, but more modules now show it
+        if (added) notify_level(&ctxs[i], ORIGIN_HOTPLUG);
+        total += ctxs[i].targets_len;
+    }
+    flight_rec(FR_RESCAN, 0, 0, 0, 0, 0, (int32_t)total, (int32_t)(now_us() - t0));
+    PROBE(rescan_return, total, now_us() - t0);
+}
+
+/* -------------------- Control socket -------------------- */
+
+// SOCK_SEQPACKET socket served from the main loop. One datagram carries one or
+// more commands separated by newlines or ';'; the reply is one datagram where
+// each command contributes zero or more data lines followed by "ok" or
+// "err <reason>":
+//
+//   get [<ctx>|<vid:pid>]      level per context, or read one target
+//   set <ctx>|all <level>      set a context (same as the desktop slider)
+//   set <vid:pid> <level>      set a single target only
+//   rgb <vid:pid>|all <spec>   change RGB matrix state (see --rgb)
+//   list                       targets with health and last RTT
+//   wakeups                    main loop wakeups by cause, with rates per second
+//   rescan                     re-run device discovery
+//   subscribe                  push events on this connection from now on:
+//                                level <ctx> <level> <origin>
+//                                target add <vid:pid> <ctx> <hidraw>
+//                                target remove <vid:pid> <ctx>
+//                                dropped <n>   (events lost to a full queue)
+//
+// <ctx> is a uleds name (framework::kbd_backlight) or its short form (kbd).
+
+#define CTL_DEFAULT_PATH "/run/fw16-kbd-uleds/control"
+#define CTL_MAX_CLIENTS SUB_MAX // one subscription slot per client
+#define CTL_MSG_MAX 4096
+
+typedef struct {
+    int listen_fd;
+    int clients[CTL_MAX_CLIENTS];
+    char path[108];
+} ctl_t;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} ctl_out_t;
+
+static void ctl_printf(ctl_out_t *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void ctl_printf(ctl_out_t *o, const char *fmt, ...) {
+    if (o->len >= o->cap) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->len = (o->len + (size_t)n < o->cap) ? o->len + (size_t)n : o->cap - 1;
+}
+
+// Create the parent directory of a runtime file when running outside the
+// unit's RuntimeDirectory.
+static void mkdir_parent(const char *path) {
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        (void)mkdir(dir, 0755);
+    }
+}
+
+// Listening SOCK_SEQPACKET socket at `path` with permissions `mode`, owned by
+// group `gid` unless it is (gid_t)-1.
+static int seqpacket_listen(const char *path, mode_t mode, gid_t gid) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    mkdir_parent(path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    (void)unlink(path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || chmod(path, mode) < 0 ||
+        (gid != (gid_t)-1 && chown(path, (uid_t)-1, gid) < 0) || listen(fd, 8) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// Permissions for a socket from --*-group and --*-mode: owned by `group` (a
+// name or id) and mode 0660 if given, else root only; `mode` (octal) wins.
+// Prints the error and returns -1 on an invalid value.
+static int sock_perm_parse(const char *group, const char *mode, const char *what, mode_t *perm, gid_t *gid) {
+    *gid = (gid_t)-1;
+    *perm = 0600;
+    if (group) {
+        struct group *gr = getgrnam(group);
+        char *end;
+        unsigned long id = strtoul(group, &end, 10);
+        if (gr) *gid = gr->gr_gid;
+        else if (*group && !*end) *gid = (gid_t)id;
+        else {
+            fprintf(stderr, "error: unknown group '%s'\n", group);
+            return -1;
+        }
+        *perm = 0660;
+    }
+    if (mode) {
+        char *end;
+        unsigned long m = strtoul(mode, &end, 8);
+        if (!*mode || *end || m > 0777) {
+            fprintf(stderr, "error: invalid %s socket mode '%s'\n", what, mode);
+            return -1;
+        }
+        *perm = (mode_t)m;
+    }
+    return 0;
+}
+
+// Accept pending connections into the free slots of `clients`.
+static void seqpacket_accept(int listen_fd, int *clients, int max, const char *what) {
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int slot = -1;
+        for (int i = 0; i < max && slot < 0; i++) if (clients[i] < 0) slot = i;
+        if (slot < 0) {
+            dbg(1, "%s: too many clients\n", what);
+            close(fd);
+            continue;
+        }
+        clients[slot] = fd;
+    }
+}
+
+static int ctl_open(ctl_t *c, const char *path, mode_t mode, gid_t gid) {
+    c->listen_fd = -1;
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) c->clients[i] = -1;
+    if (!path || !*path || !strcmp(path, "none")) return 0;
+    if (strlen(path) >= sizeof(c->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(c->path, sizeof(c->path), "%s", path);
+
+    c->listen_fd = seqpacket_listen(path, mode, gid);
+    if (c->listen_fd < 0) return -1;
+    dbg(1, "control: listening on %s\n", path);
+    return 0;
+}
+
+static void ctl_drop_client(ctl_t *c, int slot) {
+    if (c->clients[slot] < 0) return;
+    close(c->clients[slot]);
+    c->clients[slot] = -1;
+    g_subs[slot].active = 0;
+}
+
+static void ctl_close(ctl_t *c) {
+    for (int i = 0; i < CTL_MAX_CLIENTS; i++) ctl_drop_client(c, i);
+    if (c->listen_fd >= 0) {
+        close(c->listen_fd);
+        (void)unlink(c->path);
+    }
+    c->listen_fd = -1;
+}
+
+static void ctl_accept(ctl_t *c) {
+    seqpacket_accept(c->listen_fd, c->clients, CTL_MAX_CLIENTS, "control");
+}
+
+static uled_ctx_t *ctl_find_ctx(uled_ctx_t *ctxs, const char *name) {
+    for (int i = 0; i < 4; i++) {
+        if (ctxs[i].fd < 0) continue;
+        if (!strcmp(ctxs[i].name, name)) return &ctxs[i];
+        // short form: "kbd" for framework::kbd_backlight
+        const char *p = strstr(ctxs[i].name, "::");
+        size_t n = strlen(name);
+        if (p && !strncmp(p + 2, name, n) && !strcmp(p + 2 + n, "_backlight")) return &ctxs[i];
+    }
+    return NULL;
+}
+
+static target_t *ctl_find_target(uled_ctx_t *ctxs, const char *spec, uled_ctx_t **owner) {
+    const char *colon = strchr(spec, ':');
+    if (!colon || colon[1] == ':') return NULL;
+    target_t want = { .vid = (uint16_t)strtoul(spec, NULL, 16), .pid = (uint16_t)strtoul(colon + 1, NULL, 16) };
+    for (int i = 0; i < 4; i++) {
+        for (size_t j = 0; j < ctxs[i].targets_len; j++) {
+            if (target_eq(&ctxs[i].targets[j], &want)) {
+                if (owner) *owner = &ctxs[i];
+                return &ctxs[i].targets[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Same semantics as a level chosen with the desktop slider.
+static void ctx_user_set(uled_ctx_t *c, unsigned level, const config_t *cfg, uint64_t now, origin_t origin) {
+    c->want_level = level;
+    c->holds &= ~HOLD_IDLE;
+    ctx_update(c, cfg->max_brightness, origin);
+    save_schedule(c, now, cfg->save_delay_ms);
+}
+
+static void ctl_exec(char *line, ctl_out_t *o, int slot, int fd, uled_ctx_t *ctxs, const config_t *cfg, uint64_t now) {
+    char *saveptr;
+    char *cmd = strtok_r(line, " \t", &saveptr);
+    if (!cmd) return;
+    char *arg1 = strtok_r(NULL, " \t", &saveptr);
+    char *arg2 = strtok_r(NULL, " \t", &saveptr);
+
+    if (!strcmp(cmd, "get")) {
+        if (!arg1) {
+            for (int i = 0; i < 4; i++) {
+                if (ctxs[i].fd >= 0) ctl_printf(o, "%s %u\n", ctxs[i].name, ctxs[i].last_level);
+            }
+        } else {
+            uled_ctx_t *c = ctl_find_ctx(ctxs, arg1);
+            target_t *t = c ? NULL : ctl_find_target(ctxs, arg1, NULL);
+            if (c) {
+                ctl_printf(o, "%s %u\n", c->name, c->last_level);
+            } else if (t) {
+                int pct = qmk_get(t);
+                if (pct < 0) {
+                    ctl_printf(o, "err transfer failed\n");
+                    return;
+                }
+                ctl_printf(o, "%04x:%04x %u\n", t->vid, t->pid, pct_to_level((unsigned)pct));
+            } else {
+                ctl_printf(o, "err unknown context or target\n");
+                return;
+            }
+        }
+    } else if (!strcmp(cmd, "set")) {
+        char *end = NULL;
+        unsigned long level = arg2 ? strtoul(arg2, &end, 10) : 0;
+        if (!arg1 || !arg2 || *end || level > 3) {
+            ctl_printf(o, "err usage: set <ctx|all|vid:pid> <0-3>\n");
+            return;
+        }
+        if (!strcmp(arg1, "all")) {
+            for (int i = 0; i < 4; i++) if (ctxs[i].fd >= 0) ctx_user_set(&ctxs[i], (unsigned)level, cfg, now, ORIGIN_CONTROL);
+        } else {
+            uled_ctx_t *c = ctl_find_ctx(ctxs, arg1);
+            target_t *t = c ? NULL : ctl_find_target(ctxs, arg1, NULL);
+            if (c) {
+                ctx_user_set(c, (unsigned)level, cfg, now, ORIGIN_CONTROL);
+            } else if (t) {
+                if (qmk_set(t, level_to_qmk_pct((unsigned)level)) < 0) {
+                    ctl_printf(o, "err transfer failed\n");
+                    return;
+                }
+            } else {
+                ctl_printf(o, "err unknown context or target\n");
+                return;
+            }
+        }
+    } else if (!strcmp(cmd, "rgb")) {
+        rgb_override_t ov = { -1, -1, -1, -1 };
+        if (!arg1 || !arg2 || parse_rgb_spec(arg2, &ov) < 0) {
+            ctl_printf(o, "err usage: rgb <vid:pid|all> effect=N,speed=N,hue=N,sat=N\n");
+            return;
+        }
+        int applied = 0, failed = 0;
+        for (int i = 0; i < 4; i++) {
+            for (size_t j = 0; j < ctxs[i].targets_len; j++) {
+                target_t *t = &ctxs[i].targets[j];
+                if (!target_has_rgb(t)) continue;
+                if (strcmp(arg1, "all") != 0 && ctl_find_target(ctxs, arg1, NULL) != t) continue;
+                applied++;
+                if (rgb_set(t, &ov, ctxs[i].last_level) < 0) failed++;
+            }
+        }
+        if (applied == 0 || failed) {
+            ctl_printf(o, "err %s\n", applied ? "transfer failed" : "no matching RGB target");
+            return;
+        }
+    } else if (!strcmp(cmd, "list")) {
+        for (int i = 0; i < 4; i++) {
+            for (size_t j = 0; j < ctxs[i].targets_len; j++) {
+                const target_t *t = &ctxs[i].targets[j];
+                const target_stats_t *st = target_stats(t);
+                ctl_printf(o, "%04x:%04x %s %s %s %u\n", t->vid, t->pid, ctxs[i].name,
+                           *t->hidraw ? t->hidraw : "-", target_health(st), st ? st->rtt_us : 0);
+            }
+        }
+    } else if (!strcmp(cmd, "wakeups")) {
+        ctl_printf(o, "total %llu %.3f/s\n", (unsigned long long)g_wake.total, g_wake.rate);
+        for (int i = 0; i < WAKE_COUNT; i++) {
+            if (g_wake.count[i])
+                ctl_printf(o, "%s %llu %.3f/s\n", wake_names[i], (unsigned long long)g_wake.count[i], g_wake.cause_rate[i]);
+        }
+    } else if (!strcmp(cmd, "rescan")) {
+        rescan_targets(ctxs, cfg, now);
+    } else if (!strcmp(cmd, "subscribe")) {
+        if (!g_subs[slot].active) sub_reset(slot, fd);
+    } else {
+        ctl_printf(o, "err unknown command '%s'\n", cmd);
+        return;
+    }
+    ctl_printf(o, "ok\n");
+}
+
+static void ctl_handle(ctl_t *c, int slot, short revents, uled_ctx_t *ctxs, const config_t *cfg, uint64_t now) {
+    if ((revents & POLLOUT) && g_subs[slot].active) {
+        if (sub_flush(&g_subs[slot]) < 0) {
+            ctl_drop_client(c, slot);
+            return;
+        }
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) return;
+
+    char msg[CTL_MSG_MAX + 1];
+    ssize_t r = recv(c->clients[slot], msg, CTL_MSG_MAX, 0);
+    if (r <= 0) {
+        if (r < 0 && errno == EAGAIN) return;
+        ctl_drop_client(c, slot);
+        return;
+    }
+    msg[r] = '\0';
+
+    char reply[CTL_MSG_MAX];
+    ctl_out_t o = { reply, 0, sizeof(reply) };
+    char *saveptr;
+    for (char *line = strtok_r(msg, "\n;", &saveptr); line; line = strtok_r(NULL, "\n;", &saveptr)) {
+        ctl_exec(line, &o, slot, c->clients[slot], ctxs, cfg, now);
+    }
+    if (send(c->clients[slot], reply, o.len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno != EAGAIN)
+        ctl_drop_client(c, slot);
+}
+
+// `--ctl`: send one request to a running daemon and print the reply.
+static int ctl_client(const char *path, const char *request) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 1;
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        fprintf(stderr, "connect %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    char reply[CTL_MSG_MAX + 1];
+    ssize_t r = -1;
+    if (send(fd, request, strlen(request), 0) >= 0) r = recv(fd, reply, CTL_MSG_MAX, 0);
+    close(fd);
+    if (r < 0) {
+        perror("control request");
+        return 1;
+    }
+    reply[r] = '\0';
+    fputs(reply, stdout);
+    return strstr(reply, "err ") ? 1 : 0;
+}
+
+/* -------------------- VIA broker -------------------- */
+
+// Optional socket through which other raw-HID clients (the VIA app, qmk_hid,
+// scripts) reach the modules instead of opening the hidraw node themselves.
+// hidraw delivers every reply to every open fd, so two programs talking to
+// the same module read each other's replies and time out. Requests sent
+// through the broker run inline in the main loop, serialized with the
+// daemon's own transfers, and each reply goes back to the connection that
+// asked for it. A transfer can take up to 200 ms, and the VIA app sends
+// hundreds of requests to read a keymap, so only one request is served per
+// loop iteration (round-robin over the clients); slider events, polls and
+// D-Bus calls get their turn in between.
+//
+// A request is one datagram: the target VID and PID as little-endian uint16,
+// followed by the 32-byte report. The reply is the 32-byte report the module
+// answered with, or an empty datagram if the target is unknown or did not
+// answer.
+
+#define BROKER_MAX_CLIENTS 4
+#define BROKER_REQ_LEN (4 + 32)
+
+typedef struct {
+    int listen_fd;
+    int clients[BROKER_MAX_CLIENTS];
+    int next;                // client to serve first in the next iteration
+    char path[108];
+} broker_t;
+
+// Root-only by default; `mode` and `gid` open it up to e.g. a "plugdev" group
+// so the VIA app and qmk_hid don't have to run as root.
+static int broker_open(broker_t *b, const char *path, mode_t mode, gid_t gid) {
+    b->listen_fd = -1;
+    for (int i = 0; i < BROKER_MAX_CLIENTS; i++) b->clients[i] = -1;
+    b->next = 0;
+    if (!path || !*path || !strcmp(path, "none")) return 0;
+    if (strlen(path) >= sizeof(b->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(b->path, sizeof(b->path), "%s", path);
+
+    b->listen_fd = seqpacket_listen(path, mode, gid);
+    if (b->listen_fd < 0) return -1;
+    dbg(1, "broker: listening on %s\n", path);
+    return 0;
+}
+
+static void broker_drop_client(broker_t *b, int slot) {
+    if (b->clients[slot] < 0) return;
+    close(b->clients[slot]);
+    b->clients[slot] = -1;
+}
+
+static void broker_close(broker_t *b) {
+    for (int i = 0; i < BROKER_MAX_CLIENTS; i++) broker_drop_client(b, i);
+    if (b->listen_fd >= 0) {
+        close(b->listen_fd);
+        (void)unlink(b->path);
+    }
+    b->listen_fd = -1;
+}
+
+static void broker_handle(broker_t *b, int slot, uled_ctx_t *ctxs) {
+    unsigned char req[BROKER_REQ_LEN + 1];
+    ssize_t r = recv(b->clients[slot], req, sizeof(req), 0);
+    if (r <= 0) {
+        if (r < 0 && errno == EAGAIN) return;
+        broker_drop_client(b, slot);
+        return;
+    }
+
+    unsigned char resp[32];
+    size_t resp_len = 0;
+    if (r == BROKER_REQ_LEN) {
+        target_t want = { .vid = (uint16_t)(req[0] | req[1] << 8), .pid = (uint16_t)(req[2] | req[3] << 8) };
+        const target_t *t = NULL;
+        for (int i = 0; i < 4 && !t; i++) {
+            for (size_t j = 0; j < ctxs[i].targets_len && !t; j++) {
+                if (target_eq(&ctxs[i].targets[j], &want)) t = &ctxs[i].targets[j];
+            }
+        }
+        if (t && target_report_xfer(t, &req[4], resp) == 0) resp_len = sizeof(resp);
+        dbg(2, "broker: %04x:%04x cmd=0x%02x -> %s\n", want.vid, want.pid, req[4],
+            !t ? "unknown target" : resp_len ? "ok" : "no reply");
+    }
+    if (send(b->clients[slot], resp, resp_len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno != EAGAIN)
+        broker_drop_client(b, slot);
+}
+
+/* -------------------- Record and replay -------------------- */
+
+// `--record FILE` writes every input the daemon acts on to a compact binary
+// trace: uleds events, uevents, D-Bus SetBrightness calls, and the answers of
+// the transport (lookups, HID replies with their round trip times, runtime PM
+// state). `--replay FILE` runs the daemon against such a trace instead of the
+// hardware: the inputs are fed back at their recorded times through the same
+// fds and handlers, and each transport call gets the answer the device gave
+// last before that moment. Polls therefore don't have to line up with the
+// recording. With --virtual-clock a replay is deterministic and runs as fast
+// as the CPU allows, so a trace doubles as a performance regression workload.
+//
+// File layout: "FW16TRC1", then per record an rr_hdr_t and its payload
+// (multi-byte fields in host byte order). Gaps longer than the 32-bit delta
+// (71 minutes) are shortened to it.
+#define RR_MAGIC "FW16TRC2"
+#define RR_TAIL_MS 2000 // keep running after the last record for saves etc.
+
+typedef enum {
+    RR_ULEDS = 1,  // arg: context index; payload: bytes read from uleds
+    RR_UEVENT,     // payload: the netlink message
+    RR_BUS_SET,    // arg: level; payload: context name
+    RR_FIND,       // vid[2] pid[2] rc name_len name
+    RR_XFER,       // rtt_us[4] rc req[32] resp[32] name_len name
+    RR_BATCH,      // arg: n; rtt_us[4] acked name_len name, n * (cmd channel addr ok resp[2])
+    RR_SUSPENDED,  // arg: result; payload: hidraw name
+} rr_type_t;
+
+// Single transfers keep the whole report both ways: besides the daemon's
+// own set/get/save they carry whatever a VIA broker client sent.
+#define RR_XFER_BYTES VIA_REPORT_LEN
+#define RR_XFER_NAME (5 + 2 * RR_XFER_BYTES) // offset of name_len
+
+typedef struct {
+    uint32_t dt_us; // since the previous record
+    uint8_t type;
+    uint8_t arg;
+    uint16_t len;
+} rr_hdr_t;
+
+typedef struct {
+    unsigned char d[512];
+    size_t len;
+} rr_buf_t;
+
+static void rr_put(rr_buf_t *b, const void *p, size_t n) {
+    if (b->len + n > sizeof(b->d)) n = sizeof(b->d) - b->len;
+    memcpy(&b->d[b->len], p, n);
+    b->len += n;
+}
+
+static void rr_put8(rr_buf_t *b, int v) {
+    unsigned char c = (unsigned char)v;
+    rr_put(b, &c, 1);
+}
+
+static void rr_put_name(rr_buf_t *b, const char *s) {
+    size_t n = strnlen(s, 255);
+    rr_put8(b, (int)n);
+    rr_put(b, s, n);
+}
+
+static int rr_name_eq(const unsigned char *p, size_t n, const char *s) {
+    return strlen(s) == n && memcmp(p, s, n) == 0;
+}
+
+// ---- Recording
+
+static struct {
+    FILE *f;
+    const transport_t *inner; // the transport being recorded
+    uint64_t last_us;
+    uint64_t records;
+    uint64_t bytes;
+    int dirty;
+} g_rec;
+
+static void rec_write_at(uint64_t at_us, uint8_t type, uint8_t arg, const void *data, size_t len) {
+    if (!g_rec.f) return;
+    if (len > UINT16_MAX) len = UINT16_MAX;
+    uint64_t dt = (at_us > g_rec.last_us) ? at_us - g_rec.last_us : 0;
+    g_rec.last_us = at_us;
+    rr_hdr_t h = { .dt_us = (dt > UINT32_MAX) ? UINT32_MAX : (uint32_t)dt, .type = type, .arg = arg, .len = (uint16_t)len };
+    if (fwrite(&h, sizeof(h), 1, g_rec.f) != 1 || (len && fwrite(data, len, 1, g_rec.f) != 1)) {
+        fprintf(stderr, "record: write failed, recording stopped: %s\n", strerror(errno));
+        fclose(g_rec.f);
+        g_rec.f = NULL;
+        return;
+    }
+    g_rec.records++;
+    g_rec.bytes += sizeof(h) + len;
+    g_rec.dirty = 1;
+}
+
+static void rec_input(uint8_t type, uint8_t arg, const void *data, size_t len) {
+    if (g_rec.f) rec_write_at(now_us(), type, arg, data, len);
+}
+
+static void rec_bus_set(const char *ctx, unsigned level) {
+    if (g_rec.f) rec_input(RR_BUS_SET, (uint8_t)level, ctx, strlen(ctx));
+}
+
+// Once per main loop iteration, so a crash loses at most the current one
+static void rec_flush(void) {
+    if (!g_rec.f || !g_rec.dirty) return;
+    fflush(g_rec.f);
+    g_rec.dirty = 0;
+}
+
+// Transfers are stamped with their start time, which is what replay matches.
+static int rec_find(uint16_t vid, uint16_t pid, char *out, size_t out_len) {
+    uint64_t t0 = now_us();
+    int rc = g_rec.inner->find(vid, pid, out, out_len);
+    rr_buf_t b = { .len = 0 };
+    rr_put(&b, &vid, 2);
+    rr_put(&b, &pid, 2);
+    rr_put8(&b, rc);
+    rr_put_name(&b, rc == 0 ? out : "");
+    rec_write_at(t0, RR_FIND, 0, b.d, b.len);
+    return rc;
+}
+
+static int rec_xfer(const char *hidraw, const unsigned char *req, unsigned char *resp) {
+    uint64_t t0 = now_us();
+    int rc = g_rec.inner->xfer(hidraw, req, resp);
+    uint32_t rtt = (uint32_t)(now_us() - t0);
+    rr_buf_t b = { .len = 0 };
+    rr_put(&b, &rtt, 4);
+    rr_put8(&b, rc);
+    rr_put(&b, req, RR_XFER_BYTES);
+    if (rc == 0) rr_put(&b, resp, RR_XFER_BYTES);
+    else rr_put(&b, (const unsigned char[RR_XFER_BYTES]){ 0 }, RR_XFER_BYTES);
+    rr_put_name(&b, hidraw);
+    rec_write_at(t0, RR_XFER, 0, b.d, b.len);
+    return rc;
+}
+
+static int rec_batch(const char *hidraw, qmk_req_t *reqs, size_t n) {
+    uint64_t t0 = now_us();
+    int acked = g_rec.inner->batch(hidraw, reqs, n);
+    uint32_t rtt = (uint32_t)(now_us() - t0);
+    if (n > 64) n = 64;
+    rr_buf_t b = { .len = 0 };
+    rr_put(&b, &rtt, 4);
+    rr_put8(&b, acked);
+    rr_put_name(&b, hidraw);
+    for (size_t i = 0; i < n; i++) {
+        const qmk_req_t *q = &reqs[i];
+        unsigned char e[6] = { q->cmd, q->channel, q->addr, (unsigned char)q->ok, q->resp[0], q->resp[1] };
+        rr_put(&b, e, sizeof(e));
+    }
+    rec_write_at(t0, RR_BATCH, (uint8_t)n, b.d, b.len);
+    return acked;
+}
+
+static int rec_suspended(const char *hidraw) {
+    uint64_t t0 = now_us();
+    int r = g_rec.inner->suspended(hidraw);
+    rec_write_at(t0, RR_SUSPENDED, (uint8_t)(r != 0), hidraw, strlen(hidraw));
+    return r;
+}
+
+static uint64_t rec_idle_deadline(void) { return g_rec.inner->idle_deadline(); }
+static void rec_close_idle(uint64_t now) { g_rec.inner->close_idle(now); }
+static void rec_close_all(void) { g_rec.inner->close_all(); }
+static int rec_led_create(const char *name, unsigned max_brightness) { return g_rec.inner->led_create(name, max_brightness); }
+static int rec_led_write(const char *name, unsigned val) { return g_rec.inner->led_write(name, val); }
+static void rec_ui_sync(unsigned level) { g_rec.inner->ui_sync(level); }
+
+static const transport_t transport_rec = {
+    .name = "record",
+    .find = rec_find,
+    .xfer = rec_xfer,
+    .batch = rec_batch,
+    .suspended = rec_suspended,
+    .idle_deadline = rec_idle_deadline,
+    .close_idle = rec_close_idle,
+    .close_all = rec_close_all,
+    .led_create = rec_led_create,
+    .led_write = rec_led_write,
+    .ui_sync = rec_ui_sync,
+};
+
+// Start recording on top of the selected transport
+static int rec_open(const char *path) {
+    g_rec.f = fopen(path, "we");
+    if (!g_rec.f) return -1;
+    if (fwrite(RR_MAGIC, 8, 1, g_rec.f) != 1) {
+        fclose(g_rec.f);
+        g_rec.f = NULL;
+        return -1;
+    }
+    g_rec.last_us = now_us();
+    g_rec.inner = g_transport;
+    g_transport = &transport_rec;
+    return 0;
+}
+
+static void rec_close(void) {
+    if (!g_rec.f) return;
+    fclose(g_rec.f);
+    g_rec.f = NULL;
+    dbg(1, "record: %llu records, %llu bytes\n", (unsigned long long)g_rec.records, (unsigned long long)(g_rec.bytes + 8));
+}
+
+// ---- Replay
+
+typedef struct {
+    uint64_t t_us; // since the start of the recording
+    uint8_t type;
+    uint8_t arg;
+    uint16_t len;
+    const unsigned char *data;
+} rr_rec_t;
+
+static struct {
+    unsigned char *buf;
+    rr_rec_t *recs;
+    size_t len;
+    size_t next_input; // next input record to deliver
+    size_t ans_pos;    // first record after the current replay time
+    uint64_t t0_us;    // replay start on the daemon clock
+    int uev_wfd;
+    uint64_t inputs;
+    uint64_t answers;
+    uint64_t misses;   // transport calls the trace had no answer for
+    uint64_t real_start_us;
+} g_replay = { .uev_wfd = -1 };
+
+static uint64_t real_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+// Payload checks, so the replay code below can index without bounds tests
+static int rr_valid(const rr_rec_t *r) {
+    const unsigned char *p = r->data;
+    size_t n = r->len;
+    switch (r->type) {
+    case RR_ULEDS: return r->arg < 4;
+    case RR_UEVENT: case RR_BUS_SET: case RR_SUSPENDED: return 1;
+    case RR_FIND: return n >= 6 && n == 6u + p[5];
+    case RR_XFER: return n > RR_XFER_NAME && n == RR_XFER_NAME + 1u + p[RR_XFER_NAME];
+    case RR_BATCH: return n >= 6 && n == 6u + p[5] + 6u * r->arg;
+    default: return 0;
+    }
+}
+
+// Index a trace held in `buf`, which the replay then owns (and frees on error)
+static int replay_parse(unsigned char *buf, size_t size) {
+    if (!buf || size < 8 || memcmp(buf, RR_MAGIC, 8) != 0) {
+        free(buf);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t off = 8; off + sizeof(rr_hdr_t) <= size; n++) {
+        rr_hdr_t h;
+        memcpy(&h, buf + off, sizeof(h));
+        off += sizeof(h) + h.len;
+    }
+    rr_rec_t *recs = calloc(n ? n : 1, sizeof(*recs));
+    if (!recs) {
+        free(buf);
+        return -1;
+    }
+    uint64_t t = 0;
+    size_t off = 8, len = 0;
+    while (off + sizeof(rr_hdr_t) <= size) {
+        rr_hdr_t h;
+        memcpy(&h, buf + off, sizeof(h));
+        off += sizeof(h);
+        if (off + h.len > size) break; // cut short, e.g. by a crash
+        t += h.dt_us;
+        rr_rec_t r = { .t_us = t, .type = h.type, .arg = h.arg, .len = h.len, .data = buf + off };
+        off += h.len;
+        if (!rr_valid(&r)) {
+            free(recs);
+            free(buf);
+            errno = EINVAL;
+            return -1;
+        }
+        recs[len++] = r;
+    }
+    g_replay.buf = buf;
+    g_replay.recs = recs;
+    g_replay.len = len;
+    return 0;
+}
+
+static void replay_free(void) {
+    free(g_replay.recs);
+    free(g_replay.buf);
+    g_replay.recs = NULL;
+    g_replay.buf = NULL;
+    g_replay.len = 0;
+}
+
+static int replay_open(const char *path) {
+    FILE *f = fopen(path, "re");
+    if (!f) return -1;
+    size_t cap = 1 << 16, size = 0;
+    unsigned char *buf = NULL;
+    for (;;) {
+        unsigned char *nb = realloc(buf, cap);
+        if (!nb) break;
+        buf = nb;
+        size += fread(buf + size, 1, cap - size, f);
+        if (size < cap) break;
+        cap *= 2;
+    }
+    fclose(f);
+    return replay_parse(buf, size);
+}
+
+static uint64_t replay_now(void) {
+    return now_us() - g_replay.t0_us;
+}
+
+static int rr_is_input(uint8_t type) {
+    return type == RR_ULEDS || type == RR_UEVENT || type == RR_BUS_SET;
+}
+
+typedef struct {
+    uint16_t vid, pid;
+    const char *hidraw;
+    const unsigned char *req; // a report (RR_XFER) or cmd, channel, addr (RR_BATCH)
+    size_t n;
+} rr_key_t;
+
+// The daemon's own set/get/save requests match on command, channel and
+// address, so a set answers with the device state whatever value it wrote.
+// Anything else (broker traffic) has to match the whole request.
+static size_t rr_xfer_key_len(const unsigned char *req) {
+    return (req[0] >= QMK_CMD_SET_VALUE && req[0] <= QMK_CMD_CUSTOM_SAVE) ? 3 : RR_XFER_BYTES;
+}
+
+static int rr_matches(const rr_rec_t *r, uint8_t type, const rr_key_t *k) {
+    if (r->type != type) return 0;
+    const unsigned char *p = r->data;
+    switch (type) {
+    case RR_FIND: {
+        uint16_t vid, pid;
+        memcpy(&vid, p, 2);
+        memcpy(&pid, p + 2, 2);
+        return vid == k->vid && pid == k->pid;
+    }
+    case RR_XFER:
+        return rr_name_eq(p + RR_XFER_NAME + 1, p[RR_XFER_NAME], k->hidraw) &&
+               memcmp(p + 5, k->req, rr_xfer_key_len(k->req)) == 0;
+    case RR_BATCH:
+        return r->arg == k->n && rr_name_eq(p + 6, p[5], k->hidraw) &&
+               (k->n == 0 || memcmp(p + 6 + p[5], k->req, 3) == 0);
+    case RR_SUSPENDED:
+        return rr_name_eq(p, r->len, k->hidraw);
+    default:
+        return 0;
+    }
+}
+
+// The answer to a transport call now: the last matching record at or before
+// the current replay time (the device state then), else the first after it.
+static const rr_rec_t *replay_answer(uint8_t type, const rr_key_t *k) {
+    uint64_t t = replay_now();
+    while (g_replay.ans_pos < g_replay.len && g_replay.recs[g_replay.ans_pos].t_us <= t) g_replay.ans_pos++;
+    for (size_t i = g_replay.ans_pos; i-- > 0;) {
+        if (rr_matches(&g_replay.recs[i], type, k)) {
+            g_replay.answers++;
+            return &g_replay.recs[i];
+        }
+    }
+    for (size_t i = g_replay.ans_pos; i < g_replay.len; i++) {
+        if (rr_matches(&g_replay.recs[i], type, k)) {
+            g_replay.answers++;
+            return &g_replay.recs[i];
+        }
+    }
+    g_replay.misses++;
+    return NULL;
+}
+
+static int replay_find(uint16_t vid, uint16_t pid, char *out, size_t out_len) {
+    const rr_rec_t *r = replay_answer(RR_FIND, &(rr_key_t){ .vid = vid, .pid = pid });
+    if (!r || (int8_t)r->data[4] != 0) return -1;
+    snprintf(out, out_len, "%.*s", (int)r->data[5], (const char *)r->data + 6);
+    return 0;
+}
+
+static int replay_xfer(const char *hidraw, const unsigned char *req, unsigned char *resp) {
+    const rr_rec_t *r = replay_answer(RR_XFER, &(rr_key_t){ .hidraw = hidraw, .req = req });
+    if (!r) return -1;
+    uint32_t rtt;
+    memcpy(&rtt, r->data, 4);
+    clock_sleep_us(rtt);
+    memcpy(resp, r->data + 5 + RR_XFER_BYTES, RR_XFER_BYTES);
+    dbg(2, "replay: %s %02x %02x %02x %02x -> %02x %02x (%uus)\n", hidraw, req[0], req[1], req[2], req[3], resp[0], resp[3], rtt);
+    return (int8_t)r->data[4];
+}
+
+static int replay_batch(const char *hidraw, qmk_req_t *reqs, size_t n) {
+    unsigned char first[3] = { 0 };
+    if (n) {
+        first[0] = reqs[0].cmd;
+        first[1] = reqs[0].channel;
+        first[2] = reqs[0].addr;
+    }
+    for (size_t i = 0; i < n; i++) reqs[i].ok = 0;
+    const rr_rec_t *r = replay_answer(RR_BATCH, &(rr_key_t){ .hidraw = hidraw, .req = first, .n = n });
+    if (!r) return -1;
+    uint32_t rtt;
+    memcpy(&rtt, r->data, 4);
+    clock_sleep_us(rtt);
+    const unsigned char *e = r->data + 6 + r->data[5];
+    for (size_t i = 0; i < n; i++, e += 6) {
+        if (e[0] != reqs[i].cmd || e[1] != reqs[i].channel || e[2] != reqs[i].addr) continue;
+        reqs[i].ok = e[3];
+        memcpy(reqs[i].resp, &e[4], sizeof(reqs[i].resp));
+    }
+    int acked = (int8_t)r->data[4];
+    g_counters.hid_xfers += n;
+    if (acked >= 0) g_counters.hid_errors += n - (size_t)acked;
+    return acked;
+}
+
+static int replay_suspended(const char *hidraw) {
+    const rr_rec_t *r = replay_answer(RR_SUSPENDED, &(rr_key_t){ .hidraw = hidraw });
+    return r ? r->arg : 0;
+}
+
+// LEDs and the UI sync are only counted, as with the mock
+static const transport_t transport_replay = {
+    .name = "replay",
+    .find = replay_find,
+    .xfer = replay_xfer,
+    .batch = replay_batch,
+    .suspended = replay_suspended,
+    .idle_deadline = mock_idle_deadline,
+    .close_idle = mock_close_idle,
+    .close_all = mock_close_all,
+    .led_create = mock_led_create,
+    .led_write = mock_led_write,
+    .ui_sync = mock_ui_sync,
+};
+
+// Replayed uevents arrive on this instead of the netlink socket
+static int replay_uevent_fd(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    g_replay.uev_wfd = sv[1];
+    return sv[0];
+}
+
+static void replay_start(void) {
+    g_transport = &transport_replay;
+    g_replay.t0_us = now_us();
+    g_replay.real_start_us = real_now_us();
+}
+
+static uint64_t replay_end_us(void) {
+    return (g_replay.len ? g_replay.recs[g_replay.len - 1].t_us : 0) + RR_TAIL_MS * 1000ULL;
+}
+
+// Daemon clock (ms) of the next input, or of the end of the replay
+static uint64_t replay_deadline(void) {
+    size_t i = g_replay.next_input;
+    while (i < g_replay.len && !rr_is_input(g_replay.recs[i].type)) i++;
+    uint64_t t = (i < g_replay.len) ? g_replay.recs[i].t_us : replay_end_us();
+    return (g_replay.t0_us + t + 999) / 1000;
+}
+
+// Deliver the inputs that are due. Returns 1 once the trace is played out.
+static int replay_pump(uled_ctx_t *ctxs, const config_t *cfg) {
+    uint64_t t = replay_now();
+    for (; g_replay.next_input < g_replay.len; g_replay.next_input++) {
+        const rr_rec_t *r = &g_replay.recs[g_replay.next_input];
+        if (!rr_is_input(r->type)) continue;
+        if (r->t_us > t) break;
+        g_replay.inputs++;
+        if (r->type == RR_ULEDS) {
+            int wfd = (ctxs[r->arg].fd >= 0) ? mock_led_wfd(ctxs[r->arg].name) : -1;
+            if (wfd < 0 || write(wfd, r->data, r->len) != (ssize_t)r->len) g_replay.misses++;
+        } else if (r->type == RR_UEVENT) {
+            if (g_replay.uev_wfd < 0 || send(g_replay.uev_wfd, r->data, r->len, 0) != (ssize_t)r->len) g_replay.misses++;
+        } else {
+            int found = 0;
+            for (int i = 0; i < 4 && !found; i++) {
+                if (ctxs[i].fd < 0 || !rr_name_eq(r->data, r->len, ctxs[i].name)) continue;
+                dbg(2, "replay [%s]: SetBrightness -> level %u\n", ctxs[i].name, r->arg);
+                ctx_user_set(&ctxs[i], r->arg > 3 ? 3 : r->arg, cfg, now_ms(), ORIGIN_DBUS);
+                found = 1;
+            }
+            if (!found) g_replay.misses++;
+        }
+    }
+    return g_replay.next_input == g_replay.len && t >= replay_end_us();
+}
+
+static void replay_report(void) {
+    uint64_t real = real_now_us() - g_replay.real_start_us;
+    fprintf(stderr, "replay: %zu records, %llu inputs, %llu answers, %llu misses, %.3fs trace time in %.3fs\n",
+            g_replay.len, (unsigned long long)g_replay.inputs, (unsigned long long)g_replay.answers,
+            (unsigned long long)g_replay.misses, (double)replay_now() / 1e6, (double)real / 1e6);
+}
+
+/* -------------------- D-Bus KbdBacklight service -------------------- */
+
+// Optionally exports every context as an org.freedesktop.UPower.KbdBacklight
+// compatible object on a persistent system bus connection, driven from the
+// main loop. Clients get a direct path to the modules and immediate
+// BrightnessChanged signals instead of going through UPower and sysfs.
+
+#define BUS_SERVICE_NAME "io.github.paco3346.Fw16KbdUleds"
+#define BUS_SERVICE_PATH "/io/github/paco3346/Fw16KbdUleds"
+#define BUS_KBD_IFACE "org.freedesktop.UPower.KbdBacklight"
+
+typedef struct {
+    uled_ctx_t *ctx;
+    const config_t *cfg;
+    char path[128];
+} bus_obj_t;
+
+static int g_bus_service = 0;
+static bus_obj_t g_bus_objs[4];
+
+static int32_t bus_brightness(const bus_obj_t *o) {
+    return (int32_t)((o->ctx->last_level * o->cfg->max_brightness) / 3);
+}
+
+static int bus_get_brightness(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)err;
+    return sd_bus_reply_method_return(m, "i", bus_brightness(userdata));
+}
+
+static int bus_get_max_brightness(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)err;
+    const bus_obj_t *o = userdata;
+    return sd_bus_reply_method_return(m, "i", (int32_t)o->cfg->max_brightness);
+}
+
+static int bus_set_brightness(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    bus_obj_t *o = userdata;
+    int32_t v;
+    int r = sd_bus_message_read(m, "i", &v);
+    if (r < 0) return r;
+    if (v < 0 || (unsigned)v > o->cfg->max_brightness)
+        return sd_bus_error_set_const(err, "org.freedesktop.DBus.Error.InvalidArgs", "Brightness out of range");
+    unsigned level = pct_to_level(((unsigned)v * 100) / o->cfg->max_brightness);
+    dbg_fields(2, LOG_FIELDS(o->ctx->name, 0, 0, (int)level, -1), "dbus [%s]: SetBrightness(%d) -> level %u\n", o->ctx->name, v, level);
+    rec_bus_set(o->ctx->name, level);
+    ctx_user_set(o->ctx, level, o->cfg, now_ms(), ORIGIN_DBUS);
+    return sd_bus_reply_method_return(m, "");
+}
+
+static const sd_bus_vtable bus_kbd_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("GetBrightness", "", "i", bus_get_brightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetMaxBrightness", "", "i", bus_get_max_brightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("SetBrightness", "i", "", bus_set_brightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("BrightnessChanged", "i", 0),
+    SD_BUS_SIGNAL("BrightnessChangedWithSource", "is", 0),
+    SD_BUS_VTABLE_END
+};
+
+static int bus_service_open(uled_ctx_t *ctxs, const config_t *cfg) {
+    sd_bus *bus = system_bus_get();
+    if (!bus) return -ENOTCONN;
+    int r;
+
+    for (int i = 0; i < 4; i++) {
+        if (ctxs[i].fd < 0) continue;
+        bus_obj_t *o = &g_bus_objs[i];
+        o->ctx = &ctxs[i];
+        o->cfg = cfg;
+        // framework::kbd_backlight -> .../kbd
+        const char *p = strstr(ctxs[i].name, "::");
+        p = p ? p + 2 : ctxs[i].name;
+        size_t n = strcspn(p, "_");
+        snprintf(o->path, sizeof(o->path), "%s/%.*s", BUS_SERVICE_PATH, (int)n, p);
+        r = sd_bus_add_object_vtable(bus, NULL, o->path, BUS_KBD_IFACE, bus_kbd_vtable, o);
+        if (r < 0) return r;
+        dbg(1, "dbus: exporting %s as %s\n", ctxs[i].name, o->path);
+    }
+
+    r = sd_bus_request_name(bus, BUS_SERVICE_NAME, 0);
+    if (r < 0) return r;
+    g_bus_service = 1;
+    return 0;
+}
+
+static void bus_service_emit(const uled_ctx_t *c, origin_t origin) {
+    if (!g_bus_service || !g_system_bus) return;
+    if (origin == ORIGIN_HOTPLUG) return; // same level, only on more modules
+    for (int i = 0; i < 4; i++) {
+        const bus_obj_t *o = &g_bus_objs[i];
+        if (o->ctx != c) continue;
+        int32_t v = bus_brightness(o);
+        // UPower convention: "internal" for hardware hotkeys, "external" otherwise
+        const char *source = (origin == ORIGIN_HW_KEY) ? "internal" : "external";
+        (void)sd_bus_emit_signal(g_system_bus, o->path, BUS_KBD_IFACE, "BrightnessChanged", "i", v);
+        (void)sd_bus_emit_signal(g_system_bus, o->path, BUS_KBD_IFACE, "BrightnessChangedWithSource", "is", v, source);
+    }
+}
+
+// poll() parameters for the system bus connection (D-Bus service requests and
+// UI sync replies); returns the timeout in ms or -1.
+static int bus_poll_setup(struct pollfd *pfd) {
+    pfd->fd = sd_bus_get_fd(g_system_bus);
+    pfd->events = (short)sd_bus_get_events(g_system_bus);
+    pfd->revents = 0;
+    uint64_t until = 0;
+    if (sd_bus_get_timeout(g_system_bus, &until) < 0 || until == UINT64_MAX) return -1;
+    uint64_t now = now_us();
+    return (until <= now) ? 0 : (int)((until - now + 999) / 1000);
+}
+
+static void bus_process(void) {
+    int r;
+    while ((r = sd_bus_process(g_system_bus, NULL)) > 0) {}
+    if (r < 0) {
+        // UI sync reconnects on demand; the service's objects are gone
+        dbg(1, "dbus: system bus connection lost (%s)%s\n", strerror(-r), g_bus_service ? "; service disabled" : "");
+        g_system_bus = sd_bus_flush_close_unref(g_system_bus);
+        g_bus_service = 0;
+        g_upower.npaths = 0;
+        g_upower.enumerating = 0;
+    }
+}
+
+/* -------------------- Status page -------------------- */
+
+// Fixed-layout snapshot of the daemon state (see fw16-kbd-uleds-state.h) in a
+// shared mapping, so monitoring agents can read it without syscalls.
+
+#define STATE_DEFAULT_PATH "/run/fw16-kbd-uleds/state"
+
+static struct fw16_state *g_state = NULL;
+
+static int state_open(const char *path) {
+    if (!path || !*path || !strcmp(path, "none")) return 0;
+    // Replace rather than reuse, so readers of a previous instance keep a consistent (stale) page
+    mkdir_parent(path);
+    (void)unlink(path);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct fw16_state)) == 0)
+        p = mmap(NULL, sizeof(struct fw16_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        errno = err; // for the caller's message
+        return -1;
+    }
+    g_state = p;
+    g_state->version = FW16_STATE_VERSION;
+    g_state->size = sizeof(struct fw16_state);
+    g_state->pid = (uint32_t)getpid();
+    // magic last: a reader never sees a valid magic with an uninitialized header
+    __atomic_store_n(&g_state->magic, FW16_STATE_MAGIC, __ATOMIC_RELEASE);
+    dbg(1, "status page: %s\n", path);
+    return 0;
+}
+
+static void state_publish(const uled_ctx_t *ctxs) {
+    struct fw16_state *st = g_state;
+    if (!st) return;
+    uint32_t seq = st->seq;
+    __atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    st->updated_ms = now_ms();
+    st->num_ctx = 0;
+    st->num_targets = 0;
+    for (int i = 0; i < FW16_STATE_MAX_CTX; i++) {
+        struct fw16_state_ctx *sc = &st->ctx[i];
+        const uled_ctx_t *c = &ctxs[i];
+        memset(sc, 0, sizeof(*sc));
+        snprintf(sc->name, sizeof(sc->name), "%s", c->name);
+        sc->active = c->fd >= 0;
+        sc->level = c->last_level;
+        sc->want_level = c->want_level;
+        sc->holds = c->holds;
+        sc->num_targets = (uint32_t)c->targets_len;
+        if (sc->active) st->num_ctx = (uint32_t)i + 1;
+
+        for (size_t j = 0; j < c->targets_len && st->num_targets < FW16_STATE_MAX_TARGETS; j++) {
+            const target_t *t = &c->targets[j];
+            const target_stats_t *ts = target_stats(t);
+            struct fw16_state_target *stt = &st->targets[st->num_targets++];
+            memset(stt, 0, sizeof(*stt));
+            stt->vid = t->vid;
+            stt->pid = t->pid;
+            stt->ctx = (uint32_t)i;
+            snprintf(stt->hidraw, sizeof(stt->hidraw), "%.*s", (int)sizeof(stt->hidraw) - 1, t->hidraw);
+            stt->health = target_health_code(ts);
+            if (ts) {
+                stt->fails = ts->fails;
+                stt->rtt_us = ts->rtt_us;
+                stt->ok_count = ts->ok_count;
+                stt->err_count = ts->err_count;
+            }
+        }
+    }
+    st->counters = g_counters;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELAXED);
+}
+
+static void state_close(const char *path) {
+    if (!g_state) return;
+    munmap(g_state, sizeof(struct fw16_state));
+    g_state = NULL;
+    (void)unlink(path);
+}
+
+/* -------------------- Metrics -------------------- */
+
+// Prometheus text exposition written to a file, e.g. in the node_exporter
+// textfile collector directory. The file is replaced atomically, at most
+// every METRICS_INTERVAL_MS and only after something changed, so an idle
+// daemon does not wake up for it.
+
+#define METRICS_INTERVAL_MS 10000
+
+typedef struct {
+    char path[256];
+    int enabled;
+    uint64_t last_write;
+    struct fw16_state_counters written; // counters as of the last write
+} metrics_t;
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t off;
+} metrics_counters[] = {
+    { "uleds_events", "Brightness events read from uleds", offsetof(struct fw16_state_counters, uleds_events) },
+    { "uleds_coalesced", "uleds events that mapped to the current level", offsetof(struct fw16_state_counters, uleds_coalesced) },
+    { "hw_changes", "Level changes detected by polling the modules", offsetof(struct fw16_state_counters, hw_changes) },
+    { "hw_polls_skipped", "Polls skipped because the module was runtime suspended", offsetof(struct fw16_state_counters, hw_polls_skipped) },
+    { "uevents", "Kernel uevents received", offsetof(struct fw16_state_counters, uevents) },
+    { "rescans", "Device rescans", offsetof(struct fw16_state_counters, rescans) },
+    { "hid_transactions", "HID request/reply transactions", offsetof(struct fw16_state_counters, hid_xfers) },
+    { "hid_errors", "Failed HID transactions", offsetof(struct fw16_state_counters, hid_errors) },
+    { "hid_timeouts", "HID transactions without a matching reply", offsetof(struct fw16_state_counters, hid_timeouts) },
+    { "sysfs_writes", "LED brightness writes", offsetof(struct fw16_state_counters, sysfs_writes) },
+    { "ui_syncs", "Desktop UI synchronizations", offsetof(struct fw16_state_counters, ui_syncs) },
+};
+
+static int metrics_open(metrics_t *m, const char *path) {
+    memset(m, 0, sizeof(*m));
+    if (!path || !*path || !strcmp(path, "none")) return 0;
+    if (strlen(path) + 5 > sizeof(m->path)) return -1; // room for ".tmp"
+    snprintf(m->path, sizeof(m->path), "%s", path);
+    m->enabled = 1;
+    // Force the first write
+    m->written.uevents = ~0ULL;
+    return 0;
+}
+
+static void metrics_hist(FILE *f, const char *name, const char *labels, const hist_t *h) {
+    const char *sep = *labels ? "," : "";
+    unsigned long long cum = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        cum += h->buckets[i];
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, hist_bounds_us[i] / 1e6, cum);
+    }
+    cum += h->buckets[HIST_BUCKETS];
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, cum);
+    fprintf(f, "%s_sum{%s} %.6f\n", name, labels, h->sum_us / 1e6);
+    fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)h->count);
+}
+
+static uint64_t metrics_deadline(const metrics_t *m) {
+    if (!m->enabled || !memcmp(&m->written, &g_counters, sizeof(g_counters))) return 0;
+    uint64_t due = m->last_write + METRICS_INTERVAL_MS;
+    return due ? due : 1;
+}
+
+static void metrics_write(metrics_t *m, const uled_ctx_t *ctxs, uint64_t now) {
+    char tmp[sizeof(m->path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    m->last_write = now;
+    m->written = g_counters;
+    FILE *f = fopen(tmp, "we");
+    if (!f) {
+        dbg(1, "metrics: cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(metrics_counters) / sizeof(metrics_counters[0]); i++) {
+        uint64_t v;
+        memcpy(&v, (const char *)&g_counters + metrics_counters[i].off, sizeof(v));
+        fprintf(f, "# HELP fw16_kbd_uleds_%s_total %s.\n", metrics_counters[i].name, metrics_counters[i].help);
+        fprintf(f, "# TYPE fw16_kbd_uleds_%s_total counter\n", metrics_counters[i].name);
+        fprintf(f, "fw16_kbd_uleds_%s_total %llu\n", metrics_counters[i].name, (unsigned long long)v);
+    }
+
+    fprintf(f, "# HELP fw16_kbd_uleds_wakeups_total Main loop wakeups by cause.\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_wakeups_total counter\n");
+    for (int i = 0; i < WAKE_COUNT; i++) {
+        if (g_wake.count[i])
+            fprintf(f, "fw16_kbd_uleds_wakeups_total{cause=\"%s\"} %llu\n", wake_names[i], (unsigned long long)g_wake.count[i]);
+    }
+
+    fprintf(f, "# HELP fw16_kbd_uleds_level Level applied to the modules (0-3).\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_level gauge\n");
+    for (int i = 0; i < 4; i++) {
+        if (ctxs[i].fd >= 0) fprintf(f, "fw16_kbd_uleds_level{context=\"%s\"} %u\n", ctxs[i].name, ctxs[i].last_level);
+    }
+
+    char labels[96];
+    fprintf(f, "# HELP fw16_kbd_uleds_apply_seconds Time from a level decision until all modules acknowledged it.\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_apply_seconds histogram\n");
+    for (size_t i = 0; i < ORIGIN_COUNT; i++) {
+        if (g_hist_apply[i].count == 0) continue;
+        snprintf(labels, sizeof(labels), "origin=\"%s\"", origin_names[i]);
+        metrics_hist(f, "fw16_kbd_uleds_apply_seconds", labels, &g_hist_apply[i]);
+    }
+
+    fprintf(f, "# HELP fw16_kbd_uleds_hid_seconds Successful HID round trips by command and channel.\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_hid_seconds histogram\n");
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (g_hist_xfer[i][j].count == 0) continue;
+            snprintf(labels, sizeof(labels), "command=\"%s\",channel=\"%s\"", xfer_cmd_names[i], xfer_channel_names[j]);
+            metrics_hist(f, "fw16_kbd_uleds_hid_seconds", labels, &g_hist_xfer[i][j]);
+        }
+    }
+
+    fprintf(f, "# HELP fw16_kbd_uleds_target_hid_seconds Successful HID round trips by target.\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_target_hid_seconds histogram\n");
+    for (size_t i = 0; i < g_target_stats_len; i++) {
+        const target_stats_t *st = &g_target_stats[i];
+        snprintf(labels, sizeof(labels), "target=\"%04x:%04x\"", st->vid, st->pid);
+        metrics_hist(f, "fw16_kbd_uleds_target_hid_seconds", labels, &st->rtt_hist);
+    }
+    fprintf(f, "# HELP fw16_kbd_uleds_target_errors_total Failed HID transactions by target.\n");
+    fprintf(f, "# TYPE fw16_kbd_uleds_target_errors_total counter\n");
+    for (size_t i = 0; i < g_target_stats_len; i++) {
+        const target_stats_t *st = &g_target_stats[i];
+        fprintf(f, "fw16_kbd_uleds_target_errors_total{target=\"%04x:%04x\"} %llu\n", st->vid, st->pid,
+                (unsigned long long)st->err_count);
+    }
+
+    if (fclose(f) != 0 || rename(tmp, m->path) < 0) {
+        dbg(1, "metrics: cannot write %s: %s\n", m->path, strerror(errno));
+        (void)unlink(tmp);
+    }
 }
 
-static void autodetect_targets(const uint16_t *vids, size_t num_vids, target_t *out, size_t *len, size_t cap) {
-    const uint16_t pids[] = { 0x0012, 0x0018, 0x0019, 0x0014, 0x0013 };
+/* -------------------- Latency-sensitive mode -------------------- */
 
-    for (size_t v = 0; v < num_vids; v++) {
-        for (size_t i = 0; i < sizeof(pids)/sizeof(pids[0]); i++) {
-            char hidraw[64] = "";
-            if (find_raw_hidraw(vids[v], pids[i], hidraw, sizeof(hidraw)) == 0) {
-                if (*len < cap) {
-                    target_t t = { .vid = vids[v], .pid = pids[i] };
-                    snprintf(t.hidraw, sizeof(t.hidraw), "%s", hidraw);
-                    if (!target_in_list(out, *len, &t)) {
-                        out[*len] = t;
-                        (*len)++;
-                    }
-                }
-            }
-        }
+// --realtime <prio>: run the daemon under SCHED_FIFO so slider changes reach
+// the modules promptly on a loaded machine. The daemon starts no children
+// itself; SCHED_RESET_ON_FORK is kept so anything a library might spawn
+// does not inherit a real-time priority it never asked for. Memory is
+// locked and pre-faulted so the apply path never waits on a page fault.
+
+#define RT_STACK_PREFAULT (256 * 1024)
+
+static void rt_prefault_stack(void) {
+    volatile unsigned char buf[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(buf); i += 4096) buf[i] = 0;
+}
+
+static void rt_enable(int prio) {
+    struct sched_param sp = { .sched_priority = prio };
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp) < 0) {
+        fprintf(stderr, "warning: SCHED_FIFO %d unavailable (%s); using nice -10\n", prio, strerror(errno));
+        if (setpriority(PRIO_PROCESS, 0, -10) < 0)
+            fprintf(stderr, "warning: setpriority failed: %s\n", strerror(errno));
     }
+
+    // Keep freed heap mapped (and locked) instead of returning it to the kernel
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "warning: mlockall failed: %s\n", strerror(errno));
+    rt_prefault_stack();
+    dbg(1, "realtime: SCHED_FIFO priority %d, memory locked\n", prio);
 }
 
-/* -------------------- uleds LED creation -------------------- */
+/* -------------------- Flight recorder dump -------------------- */
 
-static int create_uleds_led(const char *name, unsigned max_brightness) {
-    int fd = open("/dev/uleds", O_RDWR | O_CLOEXEC);
-    if (fd < 0) {
-        perror("open /dev/uleds");
-        return -1;
-    }
+// Also used from fatal signal handlers after a crash, where snprintf() is
+// off limits (it is not async-signal-safe; float formatting may lock and
+// allocate), so lines are built with these integer-only helpers.
+typedef struct {
+    char *d;
+    size_t len;
+    size_t cap;
+} fr_buf_t;
 
-    struct uleds_user_dev u;
-    memset(&u, 0, sizeof(u));
-    snprintf(u.name, sizeof(u.name), "%s", name);
-    u.max_brightness = max_brightness;
+static void fr_str(fr_buf_t *b, const char *s) {
+    while (*s && b->len < b->cap) b->d[b->len++] = *s++;
+}
 
-    if (write(fd, &u, sizeof(u)) != (ssize_t)sizeof(u)) {
-        perror("write uleds");
-        close(fd);
-        return -1;
+// `v` in `base`, left-padded with `pad` to `width`
+static void fr_num(fr_buf_t *b, uint64_t v, unsigned base, unsigned width, char pad) {
+    char tmp[24];
+    unsigned n = 0;
+    do {
+        tmp[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    while (width > n && b->len < b->cap) {
+        b->d[b->len++] = pad;
+        width--;
     }
-    return fd;
+    while (n && b->len < b->cap) b->d[b->len++] = tmp[--n];
 }
 
-/* -------------------- uevent hotplug -------------------- */
+static void fr_int(fr_buf_t *b, int64_t v) {
+    if (v < 0) fr_str(b, "-");
+    fr_num(b, v < 0 ? (uint64_t)-v : (uint64_t)v, 10, 0, ' ');
+}
 
-static int open_uevent_sock(void) {
-    int s = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
-    if (s < 0) return -1;
+// `us` as milliseconds with three decimals, right-aligned in 12 columns
+static void fr_ms(fr_buf_t *b, int64_t us) {
+    char tmp[24];
+    fr_buf_t t = { tmp, 0, sizeof(tmp) };
+    uint64_t a = us < 0 ? (uint64_t)-us : (uint64_t)us;
+    if (us < 0) fr_str(&t, "-");
+    fr_num(&t, a / 1000, 10, 0, ' ');
+    fr_str(&t, ".");
+    fr_num(&t, a % 1000, 10, 3, '0');
+    for (size_t i = t.len; i < 12 && b->len < b->cap; i++) b->d[b->len++] = ' ';
+    for (size_t i = 0; i < t.len && b->len < b->cap; i++) b->d[b->len++] = tmp[i];
+    fr_str(b, "ms ");
+}
 
-    struct sockaddr_nl snl;
-    memset(&snl, 0, sizeof(snl));
-    snl.nl_family = AF_NETLINK;
-    snl.nl_pid = (uint32_t)getpid();
-    snl.nl_groups = 1; // receive broadcast uevents
+// Write the recorder to `fd`, oldest first, with times relative to the dump.
+static void flight_dump(int fd, const char *why) {
+    char line[160];
+    fr_buf_t b = { line, 0, sizeof(line) - 1 };
+    uint64_t now = now_us();
+    uint64_t total = g_flight_next;
+    uint64_t first = (total > FLIGHT_LEN) ? total - FLIGHT_LEN : 0;
+    fr_str(&b, "flight recorder (");
+    fr_str(&b, why);
+    fr_str(&b, "): ");
+    fr_num(&b, total, 10, 0, ' ');
+    fr_str(&b, " events, showing ");
+    fr_num(&b, total - first, 10, 0, ' ');
+    fr_str(&b, "\n");
+    if (write(fd, line, b.len) < 0) return;
 
-    if (bind(s, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
-        close(s);
-        return -1;
+    for (uint64_t i = first; i < total; i++) {
+        const flight_rec_t *r = &g_flight[i % FLIGHT_LEN];
+        b.len = 0;
+        fr_ms(&b, (int64_t)(r->t_us - now));
+        switch (r->type) {
+            case FR_HID:
+                fr_str(&b, "hid ");
+                fr_num(&b, r->vid, 16, 4, '0');
+                fr_str(&b, ":");
+                fr_num(&b, r->pid, 16, 4, '0');
+                fr_str(&b, " cmd=0x");
+                fr_num(&b, r->a, 16, 2, '0');
+                fr_str(&b, " ch=");
+                fr_num(&b, r->b, 10, 0, ' ');
+                fr_str(&b, " rc=");
+                fr_int(&b, r->v1);
+                fr_str(&b, " ");
+                fr_int(&b, r->v2);
+                fr_str(&b, "us");
+                break;
+            case FR_ULEDS:
+                fr_str(&b, "uleds ");
+                fr_str(&b, type_names[r->a & 3]);
+                fr_str(&b, " raw=");
+                fr_int(&b, r->v1);
+                fr_str(&b, " level=");
+                fr_int(&b, r->v2);
+                break;
+            case FR_UEVENT:
+                fr_str(&b, "uevent len=");
+                fr_int(&b, r->v1);
+                break;
+            case FR_LEVEL:
+                fr_str(&b, "level ");
+                fr_str(&b, type_names[r->a & 3]);
+                fr_str(&b, " ");
+                fr_int(&b, r->v1);
+                fr_str(&b, " (want ");
+                fr_int(&b, r->v2);
+                fr_str(&b, " holds 0x");
+                fr_num(&b, r->c, 16, 0, ' ');
+                fr_str(&b, ") ");
+                fr_str(&b, r->b < ORIGIN_COUNT ? origin_names[r->b] : "?");
+                break;
+            case FR_RESCAN:
+                fr_str(&b, "rescan targets=");
+                fr_int(&b, r->v1);
+                fr_str(&b, " ");
+                fr_int(&b, r->v2);
+                fr_str(&b, "us");
+                break;
+            case FR_RESUME:
+                fr_str(&b, "resume suspended=");
+                fr_int(&b, r->v1);
+                fr_str(&b, "ms");
+                break;
+            default:
+                continue;
+        }
+        fr_str(&b, "\n");
+        if (write(fd, line, b.len) < 0) return;
     }
+}
 
-    // Increase buffer to avoid drops under churn
-    int rcvbuf = 1024 * 1024;
-    (void)setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+static void flight_on_sigusr1(int sig) {
+    (void)sig;
+    g_flight_dump_req = 1;
+}
 
-    return s;
+static void flight_on_fatal(int sig) {
+    char why[32];
+    fr_buf_t b = { why, 0, sizeof(why) - 1 };
+    fr_str(&b, "signal ");
+    fr_int(&b, sig);
+    why[b.len] = '\0';
+    flight_dump(STDERR_FILENO, why);
+    raise(sig); // SA_RESETHAND restored the default action
 }
 
-// Quick filter: check if uevent message appears relevant to hid subsystem or contains "HID_ID="
-// (Message is NUL-separated strings, e.g. "add@/devices/... \0 ACTION=add \0 SUBSYSTEM=hid \0 ...")
-static int uevent_maybe_relevant(const char *buf, ssize_t len) {
-    if (len <= 0) return 0;
-    // Do a cheap substring scan; buffer is NUL-separated but still searchable.
-    if (memmem(buf, (size_t)len, "SUBSYSTEM=hid", 13)) return 1;
-    if (memmem(buf, (size_t)len, "SUBSYSTEM=hidraw", 16)) return 1;
-    if (memmem(buf, (size_t)len, "HID_ID=", 7)) return 1;
-    return 0;
+static void flight_install_handlers(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    // No SA_RESTART: poll() returns EINTR and the main loop dumps right away
+    sa.sa_handler = flight_on_sigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    sa.sa_handler = flight_on_fatal;
+    sa.sa_flags = SA_RESETHAND;
+    const int fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) sigaction(fatal[i], &sa, NULL);
 }
 
 /* -------------------- CLI -------------------- */
@@ -463,6 +4379,33 @@ static void usage(const char *prog) {
     fprintf(stderr, "  -v, --vid <list>               Comma-separated VIDs or VID:PID (default: 32ac)\n");
     fprintf(stderr, "  -b, --max-brightness <val>     Maximum brightness value (default: 3)\n");
     fprintf(stderr, "  -p, --poll-ms <ms>             Hardware polling interval (default: 1000)\n");
+    fprintf(stderr, "  -r, --rgb <spec>               RGB matrix state, e.g. effect=1,speed=128,hue=0,sat=255\n");
+    fprintf(stderr, "  -s, --save-delay-ms <ms>       Save level to module EEPROM after this quiet period (default: 0, off)\n");
+    fprintf(stderr, "  -S, --save-interval-ms <ms>    Minimum time between EEPROM saves (default: 60000)\n");
+    fprintf(stderr, "  -i, --idle-timeout <s>         Dim after this many seconds without input (default: 0, off)\n");
+    fprintf(stderr, "  -I, --idle-level <level>       Level to dim to when idle (default: 0)\n");
+    fprintf(stderr, "  -a, --auto-brightness          Set the level from the ambient light sensor\n");
+    fprintf(stderr, "  -A, --als-thresholds <a,b,c>   Lux thresholds for levels 3/2/1/0 (default: 10,50,200)\n");
+    fprintf(stderr, "  -f, --follow-display           Follow the panel backlight (off at brightness 0 or lid closed)\n");
+    fprintf(stderr, "  -z, --zero-wakeup              Stop hardware polling while there is no input; Fn+Space\n");
+    fprintf(stderr, "                                 alone is then only noticed at the next key or pointer input\n");
+    fprintf(stderr, "  -c, --control-socket <path>    Control socket path, 'none' to disable (default: %s)\n", CTL_DEFAULT_PATH);
+    fprintf(stderr, "  -g, --control-socket-group <group> Group owning the control socket (default: root; mode becomes 0660)\n");
+    fprintf(stderr, "  -K, --control-socket-mode <mode> Control socket permissions in octal (default: 0600)\n");
+    fprintf(stderr, "  -t, --state-file <path>        Status page path, 'none' to disable (default: %s)\n", STATE_DEFAULT_PATH);
+    fprintf(stderr, "  -d, --dbus-service             Export a KbdBacklight service as %s\n", BUS_SERVICE_NAME);
+    fprintf(stderr, "  -R, --realtime <prio>          Run with SCHED_FIFO at this priority and lock memory (default: 0, off)\n");
+    fprintf(stderr, "  -T, --trace                    Write one JSON trace record per brightness change to stderr\n");
+    fprintf(stderr, "  -M, --metrics-file <path>      Write Prometheus metrics to this file (default: off)\n");
+    fprintf(stderr, "  -B, --via-broker <path>        Serve raw VIA requests for other tools on this socket (default: off)\n");
+    fprintf(stderr, "  -G, --via-broker-group <group> Group owning the broker socket (default: root; mode becomes 0660)\n");
+    fprintf(stderr, "  -k, --via-broker-mode <mode>   Broker socket permissions in octal (default: 0600)\n");
+    fprintf(stderr, "  -X, --transport <spec>         'hidraw' (default) or mock[:PID,...][@LATENCY_US] for testing\n");
+    fprintf(stderr, "  -O, --root <dir>               Use <dir>/sys, <dir>/dev and <dir>/run (hermetic tests)\n");
+    fprintf(stderr, "  -V, --virtual-clock            Skip waits instead of sleeping (hermetic tests)\n");
+    fprintf(stderr, "  -w, --record <file>            Record inputs and device answers to a trace file\n");
+    fprintf(stderr, "  -P, --replay <file>            Run against a recorded trace instead of the hardware\n");
+    fprintf(stderr, "  -C, --ctl <commands>           Send commands to a running daemon and print the reply\n");
     fprintf(stderr, "  -l, --list                     List auto-discovered devices and exit\n");
     fprintf(stderr, "  -h, --help                     Show this help message\n");
     fprintf(stderr, "\nEnvironment Variables:\n");
@@ -471,36 +4414,59 @@ static void usage(const char *prog) {
     fprintf(stderr, "  FW16_KBD_ULEDS_VID             Same as --vid\n");
     fprintf(stderr, "  FW16_KBD_ULEDS_MAX_BRIGHTNESS  Same as --max-brightness\n");
     fprintf(stderr, "  FW16_KBD_ULEDS_POLL_MS         Same as --poll-ms\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_RGB             Same as --rgb\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_IDLE_TIMEOUT    Same as --idle-timeout\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_IDLE_LEVEL      Same as --idle-level\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_AUTO_BRIGHTNESS Same as --auto-brightness (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_ALS_THRESHOLDS  Same as --als-thresholds\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_FOLLOW_DISPLAY  Same as --follow-display (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_ZERO_WAKEUP     Same as --zero-wakeup (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_CONTROL_SOCKET  Same as --control-socket\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_CONTROL_SOCKET_GROUP Same as --control-socket-group\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_CONTROL_SOCKET_MODE Same as --control-socket-mode\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_STATE_FILE      Same as --state-file\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_DBUS_SERVICE    Same as --dbus-service (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_REALTIME        Same as --realtime\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_TRACE           Same as --trace (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_METRICS_FILE    Same as --metrics-file\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_VIA_BROKER      Same as --via-broker\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_VIA_BROKER_GROUP Same as --via-broker-group\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_VIA_BROKER_MODE Same as --via-broker-mode\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_TRANSPORT       Same as --transport\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_ROOT            Same as --root\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_VIRTUAL_CLOCK   Same as --virtual-clock (1 to enable)\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_RECORD          Same as --record\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_REPLAY          Same as --replay\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_SAVE_DELAY_MS   Same as --save-delay-ms\n");
+    fprintf(stderr, "  FW16_KBD_ULEDS_SAVE_INTERVAL_MS Same as --save-interval-ms\n");
 }
 
-typedef enum {
-    FW_MODE_UNIFIED = 0,
-    FW_MODE_SEPARATE
-} fw_mode_t;
+/* -------------------- Main -------------------- */
 
-static fw_mode_t parse_mode(const char *s) {
-    if (!s) return FW_MODE_UNIFIED;
-    if (!strcmp(s, "separate")) return FW_MODE_SEPARATE;
-    if (!strcmp(s, "unified")) return FW_MODE_UNIFIED;
-    return FW_MODE_UNIFIED;
-}
+// Steady-state budget. Once running, a poll tick or a brightness change
+// neither forks nor allocates in the daemon's own code, and costs:
+//   - per loop iteration: one poll() (clocks are read through the vDSO)
+//   - per poll tick and context: one pread() of runtime_status, plus one HID
+//     transaction (drain read, write, poll, read) unless the module sleeps
+//   - per level change and module: two HID transactions (backlight, RGB matrix)
+//   - per daemon-driven change: two pwrite()s to the LED, one send to the
+//     system bus and to each session bus, and the replies' reads
+//   - one send per event subscriber, and two per D-Bus service object for its
+//     BrightnessChanged and BrightnessChangedWithSource signals
+// tests/budget.c checks this (`make check`). Outside the budget: the /run/user rescan (at most every USER_BUS_SCAN_MS),
+// reopening hidraw nodes idle for HIDRAW_IDLE_CLOSE_MS, and the messages
+// libsystemd allocates internally for each D-Bus call (the built-in client
+// does not allocate).
 
-static int get_type(uint16_t pid) {
-    if (pid == 0x0012 || pid == 0x0018 || pid == 0x0019) return 0; // Kbd
-    if (pid == 0x0014) return 1; // Numpad
-    if (pid == 0x0013) return 2; // Macropad
-    return 3; // Misc
+// Lower the poll timeout to the absolute deadline `due` and remember why.
+static void loop_deadline(int *timeout, wake_cause_t *cause, uint64_t due, uint64_t now, wake_cause_t why) {
+    int t = (due <= now) ? 0 : (int)(due - now);
+    if (*timeout < 0 || t < *timeout) {
+        *timeout = t;
+        *cause = why;
+    }
 }
 
-static const char *type_names[] = {
-    "framework::kbd_backlight",
-    "framework::numpad_backlight",
-    "framework::macropad_backlight",
-    "framework::aux_backlight"
-};
-
-/* -------------------- Main -------------------- */
-
 int main(int argc, char **argv) {
     const char *env_debug = getenv("FW16_KBD_ULEDS_DEBUG");
     if (env_debug) {
@@ -509,52 +4475,172 @@ int main(int argc, char **argv) {
         if (g_debug_level > 3) g_debug_level = 3;
     }
 
-    signal(SIGCHLD, SIG_IGN);
-    fw_mode_t mode = FW_MODE_UNIFIED;
-    uint16_t vids[8];
-    size_t num_vids = 0;
-    target_t manual_targets[16];
-    size_t num_manual_targets = 0;
-    unsigned max_brightness = 3;
-    unsigned poll_ms = 1000;
+    flight_install_handlers();
+    log_init();
+    config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.mode = FW_MODE_UNIFIED;
+    cfg.max_brightness = 3;
+    cfg.poll_ms = 1000;
+    cfg.rgb_ov = (rgb_override_t){ -1, -1, -1, -1 };
+    cfg.save_interval_ms = 60000;
+    idle_t idle;
+    memset(&idle, 0, sizeof(idle));
+    als_t als;
+    memset(&als, 0, sizeof(als));
+    als.fd = -1;
+    als.thresholds[0] = 10;
+    als.thresholds[1] = 50;
+    als.thresholds[2] = 200;
+    display_t disp;
+    memset(&disp, 0, sizeof(disp));
+    quiet_t quiet;
+    memset(&quiet, 0, sizeof(quiet));
+    disp.lid_fd = -1;
+    const char *ctl_path = CTL_DEFAULT_PATH;
+    const char *ctl_request = NULL;
+    const char *ctl_group = NULL;
+    const char *ctl_mode = NULL;
+    const char *state_path = STATE_DEFAULT_PATH;
+    int dbus_service = 0;
+    const char *broker_path = NULL;
+    const char *broker_group = NULL;
+    const char *broker_mode = NULL;
+    const char *metrics_path = NULL;
+    const char *transport = NULL;
+    const char *root = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int virtual_clock = 0;
+    int rt_prio = 0;
+    metrics_t metrics;
+    ctl_t ctl;
+    broker_t broker;
 
     // Default VID
-    vids[num_vids++] = 0x32ac;
+    cfg.vids[cfg.num_vids++] = 0x32ac;
 
     // Load from environment first
     const char *env_mode = getenv("FW16_KBD_ULEDS_MODE");
-    if (env_mode) mode = parse_mode(env_mode);
+    if (env_mode) cfg.mode = parse_mode(env_mode);
 
     const char *env_vid = getenv("FW16_KBD_ULEDS_VID");
-    if (env_vid) {
-        num_vids = 0;
-        char *dup = strdup(env_vid);
-        char *saveptr;
-        char *tok = strtok_r(dup, ",", &saveptr);
-        while (tok && (num_vids < 8 || num_manual_targets < 16)) {
-            if (strchr(tok, ':')) {
-                uint16_t v = (uint16_t)strtoul(tok, NULL, 16);
-                uint16_t p = (uint16_t)strtoul(strchr(tok, ':') + 1, NULL, 16);
-                if (num_manual_targets < 16) manual_targets[num_manual_targets++] = (target_t){v, p, ""};
-            } else if (num_vids < 8) {
-                vids[num_vids++] = (uint16_t)strtoul(tok, NULL, 16);
-            }
-            tok = strtok_r(NULL, ",", &saveptr);
-        }
-        free(dup);
-    }
+    if (env_vid) parse_vid_list(env_vid, &cfg);
 
     const char *env_max_brightness = getenv("FW16_KBD_ULEDS_MAX_BRIGHTNESS");
-    if (env_max_brightness) max_brightness = (unsigned)strtoul(env_max_brightness, NULL, 10);
+    if (env_max_brightness) cfg.max_brightness = (unsigned)strtoul(env_max_brightness, NULL, 10);
 
     const char *env_poll = getenv("FW16_KBD_ULEDS_POLL_MS");
-    if (env_poll) poll_ms = (unsigned)strtoul(env_poll, NULL, 10);
+    if (env_poll) cfg.poll_ms = (unsigned)strtoul(env_poll, NULL, 10);
+
+    const char *env_save_delay = getenv("FW16_KBD_ULEDS_SAVE_DELAY_MS");
+    if (env_save_delay) cfg.save_delay_ms = (unsigned)strtoul(env_save_delay, NULL, 10);
+
+    const char *env_save_interval = getenv("FW16_KBD_ULEDS_SAVE_INTERVAL_MS");
+    if (env_save_interval) cfg.save_interval_ms = (unsigned)strtoul(env_save_interval, NULL, 10);
+
+    const char *env_idle_timeout = getenv("FW16_KBD_ULEDS_IDLE_TIMEOUT");
+    if (env_idle_timeout) idle.timeout_ms = (unsigned)strtoul(env_idle_timeout, NULL, 10) * 1000u;
+
+    const char *env_idle_level = getenv("FW16_KBD_ULEDS_IDLE_LEVEL");
+    if (env_idle_level) idle.level = (unsigned)strtoul(env_idle_level, NULL, 10);
+
+    const char *env_auto = getenv("FW16_KBD_ULEDS_AUTO_BRIGHTNESS");
+    if (env_auto) als.enabled = (int)strtol(env_auto, NULL, 10) != 0;
+
+    const char *env_als_thr = getenv("FW16_KBD_ULEDS_ALS_THRESHOLDS");
+    if (env_als_thr && parse_als_thresholds(env_als_thr, &als) < 0)
+        fprintf(stderr, "warning: ignoring invalid FW16_KBD_ULEDS_ALS_THRESHOLDS '%s'\n", env_als_thr);
+
+    const char *env_follow = getenv("FW16_KBD_ULEDS_FOLLOW_DISPLAY");
+    if (env_follow) disp.enabled = (int)strtol(env_follow, NULL, 10) != 0;
+
+    const char *env_zero = getenv("FW16_KBD_ULEDS_ZERO_WAKEUP");
+    if (env_zero) quiet.enabled = (int)strtol(env_zero, NULL, 10) != 0;
+
+    const char *env_ctl = getenv("FW16_KBD_ULEDS_CONTROL_SOCKET");
+    if (env_ctl) ctl_path = env_ctl;
+
+    const char *env_ctl_group = getenv("FW16_KBD_ULEDS_CONTROL_SOCKET_GROUP");
+    if (env_ctl_group) ctl_group = env_ctl_group;
+
+    const char *env_ctl_mode = getenv("FW16_KBD_ULEDS_CONTROL_SOCKET_MODE");
+    if (env_ctl_mode) ctl_mode = env_ctl_mode;
+
+    const char *env_state = getenv("FW16_KBD_ULEDS_STATE_FILE");
+    if (env_state) state_path = env_state;
+
+    const char *env_dbus = getenv("FW16_KBD_ULEDS_DBUS_SERVICE");
+    if (env_dbus) dbus_service = (int)strtol(env_dbus, NULL, 10) != 0;
+
+    const char *env_rt = getenv("FW16_KBD_ULEDS_REALTIME");
+    if (env_rt) rt_prio = (int)strtol(env_rt, NULL, 10);
+
+    const char *env_trace = getenv("FW16_KBD_ULEDS_TRACE");
+    if (env_trace) g_trace.enabled = (int)strtol(env_trace, NULL, 10) != 0;
+
+    const char *env_metrics = getenv("FW16_KBD_ULEDS_METRICS_FILE");
+    if (env_metrics) metrics_path = env_metrics;
+
+    const char *env_broker = getenv("FW16_KBD_ULEDS_VIA_BROKER");
+    if (env_broker) broker_path = env_broker;
+
+    const char *env_broker_group = getenv("FW16_KBD_ULEDS_VIA_BROKER_GROUP");
+    if (env_broker_group) broker_group = env_broker_group;
+
+    const char *env_broker_mode = getenv("FW16_KBD_ULEDS_VIA_BROKER_MODE");
+    if (env_broker_mode) broker_mode = env_broker_mode;
+
+    const char *env_transport = getenv("FW16_KBD_ULEDS_TRANSPORT");
+    if (env_transport) transport = env_transport;
+
+    const char *env_root = getenv("FW16_KBD_ULEDS_ROOT");
+    if (env_root) root = env_root;
+
+    const char *env_record = getenv("FW16_KBD_ULEDS_RECORD");
+    if (env_record) record_path = env_record;
+
+    const char *env_replay = getenv("FW16_KBD_ULEDS_REPLAY");
+    if (env_replay) replay_path = env_replay;
+
+    const char *env_vclock = getenv("FW16_KBD_ULEDS_VIRTUAL_CLOCK");
+    if (env_vclock) virtual_clock = (int)strtol(env_vclock, NULL, 10) != 0;
+
+    const char *env_rgb = getenv("FW16_KBD_ULEDS_RGB");
+    if (env_rgb && parse_rgb_spec(env_rgb, &cfg.rgb_ov) < 0)
+        fprintf(stderr, "warning: ignoring invalid parts of FW16_KBD_ULEDS_RGB '%s'\n", env_rgb);
 
     static struct option opts[] = {
         {"mode", required_argument, 0, 'm'},
         {"vid", required_argument, 0, 'v'},
         {"max-brightness", required_argument, 0, 'b'},
         {"poll-ms", required_argument, 0, 'p'},
+        {"rgb", required_argument, 0, 'r'},
+        {"save-delay-ms", required_argument, 0, 's'},
+        {"save-interval-ms", required_argument, 0, 'S'},
+        {"idle-timeout", required_argument, 0, 'i'},
+        {"idle-level", required_argument, 0, 'I'},
+        {"auto-brightness", no_argument, 0, 'a'},
+        {"als-thresholds", required_argument, 0, 'A'},
+        {"follow-display", no_argument, 0, 'f'},
+        {"zero-wakeup", no_argument, 0, 'z'},
+        {"control-socket", required_argument, 0, 'c'},
+        {"control-socket-group", required_argument, 0, 'g'},
+        {"control-socket-mode", required_argument, 0, 'K'},
+        {"state-file", required_argument, 0, 't'},
+        {"dbus-service", no_argument, 0, 'd'},
+        {"realtime", required_argument, 0, 'R'},
+        {"trace", no_argument, 0, 'T'},
+        {"metrics-file", required_argument, 0, 'M'},
+        {"via-broker", required_argument, 0, 'B'},
+        {"via-broker-group", required_argument, 0, 'G'},
+        {"via-broker-mode", required_argument, 0, 'k'},
+        {"transport", required_argument, 0, 'X'},
+        {"root", required_argument, 0, 'O'},
+        {"virtual-clock", no_argument, 0, 'V'},
+        {"record", required_argument, 0, 'w'},
+        {"replay", required_argument, 0, 'P'},
+        {"ctl", required_argument, 0, 'C'},
         {"list", no_argument, 0, 'l'},
         {"help", no_argument, 0, 'h'},
         {0,0,0,0}
@@ -562,45 +4648,90 @@ int main(int argc, char **argv) {
 
     int c;
     int do_list = 0;
-    while ((c = getopt_long(argc, argv, "m:v:b:p:lh", opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "m:v:b:p:r:s:S:i:I:aA:fzc:g:K:t:dR:TM:B:G:k:X:O:Vw:P:C:lh", opts, NULL)) != -1) {
         switch (c) {
-            case 'm': mode = parse_mode(optarg); break;
-            case 'v': {
-                num_vids = 0;
-                num_manual_targets = 0;
-                char *dup = strdup(optarg);
-                char *saveptr;
-                char *tok = strtok_r(dup, ",", &saveptr);
-                while (tok && (num_vids < 8 || num_manual_targets < 16)) {
-                    if (strchr(tok, ':')) {
-                        uint16_t v = (uint16_t)strtoul(tok, NULL, 16);
-                        uint16_t p = (uint16_t)strtoul(strchr(tok, ':') + 1, NULL, 16);
-                        if (num_manual_targets < 16) manual_targets[num_manual_targets++] = (target_t){v, p, ""};
-                    } else if (num_vids < 8) {
-                        vids[num_vids++] = (uint16_t)strtoul(tok, NULL, 16);
-                    }
-                    tok = strtok_r(NULL, ",", &saveptr);
-                }
-                free(dup);
+            case 'm': cfg.mode = parse_mode(optarg); break;
+            case 'v': parse_vid_list(optarg, &cfg); break;
+            case 'b': cfg.max_brightness = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'p': cfg.poll_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 's': cfg.save_delay_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'S': cfg.save_interval_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'r':
+                if (parse_rgb_spec(optarg, &cfg.rgb_ov) < 0)
+                    fprintf(stderr, "warning: ignoring invalid parts of --rgb '%s'\n", optarg);
                 break;
-            }
-            case 'b': max_brightness = (unsigned)strtoul(optarg, NULL, 10); break;
-            case 'p': poll_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'i': idle.timeout_ms = (unsigned)strtoul(optarg, NULL, 10) * 1000u; break;
+            case 'I': idle.level = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'a': als.enabled = 1; break;
+            case 'A':
+                if (parse_als_thresholds(optarg, &als) < 0)
+                    fprintf(stderr, "warning: ignoring invalid --als-thresholds '%s'\n", optarg);
+                break;
+            case 'f': disp.enabled = 1; break;
+            case 'z': quiet.enabled = 1; break;
+            case 'c': ctl_path = optarg; break;
+            case 'g': ctl_group = optarg; break;
+            case 'K': ctl_mode = optarg; break;
+            case 't': state_path = optarg; break;
+            case 'd': dbus_service = 1; break;
+            case 'R': rt_prio = (int)strtol(optarg, NULL, 10); break;
+            case 'T': g_trace.enabled = 1; break;
+            case 'M': metrics_path = optarg; break;
+            case 'B': broker_path = optarg; break;
+            case 'G': broker_group = optarg; break;
+            case 'k': broker_mode = optarg; break;
+            case 'X': transport = optarg; break;
+            case 'O': root = optarg; break;
+            case 'V': virtual_clock = 1; break;
+            case 'w': record_path = optarg; break;
+            case 'P': replay_path = optarg; break;
+            case 'C': ctl_request = optarg; break;
             case 'l': do_list = 1; break;
             case 'h': usage(argv[0]); return 0;
             default: usage(argv[0]); return 1;
         }
     }
 
+    if (ctl_request) return ctl_client(ctl_path, ctl_request);
+
+    if (transport && transport_select(transport) < 0) {
+        fprintf(stderr, "error: invalid transport '%s'\n", transport);
+        return 1;
+    }
+    if (g_transport == &transport_mock) mock_install_stop_handlers();
+    if (root && paths_set_root(root) < 0) {
+        fprintf(stderr, "error: invalid root '%s'\n", root);
+        return 1;
+    }
+    if (virtual_clock) clock_set_virtual();
+
+    gid_t ctl_gid, broker_gid;
+    mode_t ctl_perm, broker_perm;
+    if (sock_perm_parse(ctl_group, ctl_mode, "control", &ctl_perm, &ctl_gid) < 0 ||
+        sock_perm_parse(broker_group, broker_mode, "broker", &broker_perm, &broker_gid) < 0)
+        return 1;
+    if (replay_path) {
+        if (replay_open(replay_path) < 0) {
+            fprintf(stderr, "error: cannot replay '%s': %s\n", replay_path, strerror(errno));
+            return 1;
+        }
+        replay_start();
+        mock_install_stop_handlers();
+    }
+    if (record_path && rec_open(record_path) < 0) {
+        fprintf(stderr, "error: cannot record to '%s': %s\n", record_path, strerror(errno));
+        return 1;
+    }
+
     // Resolve manual targets hidraw nodes
-    for (size_t i = 0; i < num_manual_targets; i++) {
-        (void)find_raw_hidraw(manual_targets[i].vid, manual_targets[i].pid, manual_targets[i].hidraw, sizeof(manual_targets[i].hidraw));
+    for (size_t i = 0; i < cfg.num_manual_targets; i++) {
+        (void)g_transport->find(cfg.manual_targets[i].vid, cfg.manual_targets[i].pid, cfg.manual_targets[i].hidraw, sizeof(cfg.manual_targets[i].hidraw));
     }
 
     if (do_list) {
         target_t disc[16];
         size_t disc_len = 0;
-        autodetect_targets(vids, num_vids, disc, &disc_len, 16);
+        autodetect_targets(cfg.vids, cfg.num_vids, disc, &disc_len, 16);
         
         if (disc_len == 0) {
             printf("No devices auto-discovered.\n");
@@ -623,19 +4754,19 @@ int main(int argc, char **argv) {
         }
         return 0;
     }
-    if (max_brightness == 0) max_brightness = 100;
+    if (cfg.max_brightness == 0) cfg.max_brightness = 100;
 
     // Initial target discovery
     target_t discovered[16];
     size_t discovered_len = 0;
-    autodetect_targets(vids, num_vids, discovered, &discovered_len, 16);
+    autodetect_targets(cfg.vids, cfg.num_vids, discovered, &discovered_len, 16);
 
     // Merge manual and discovered
     target_t all_targets[32];
     size_t all_len = 0;
-    for (size_t i = 0; i < num_manual_targets && all_len < 32; i++) {
-        if (!target_in_list(all_targets, all_len, &manual_targets[i]))
-            all_targets[all_len++] = manual_targets[i];
+    for (size_t i = 0; i < cfg.num_manual_targets && all_len < 32; i++) {
+        if (!target_in_list(all_targets, all_len, &cfg.manual_targets[i]))
+            all_targets[all_len++] = cfg.manual_targets[i];
     }
     for (size_t i = 0; i < discovered_len && all_len < 32; i++) {
         if (!target_in_list(all_targets, all_len, &discovered[i]))
@@ -651,8 +4782,9 @@ int main(int argc, char **argv) {
     uled_ctx_t ctxs[4];
     size_t num_ctxs = 0;
     memset(ctxs, 0, sizeof(ctxs));
+    for (int i = 0; i < 4; i++) ctxs[i].fd = -1; // unused contexts must not poll fd 0
 
-    if (mode == FW_MODE_SEPARATE) {
+    if (cfg.mode == FW_MODE_SEPARATE) {
         for (size_t i = 0; i < all_len; i++) {
             int type = get_type(all_targets[i].pid);
             if (ctxs[type].targets_len == 0) {
@@ -674,7 +4806,7 @@ int main(int argc, char **argv) {
 
     for (int i = 0; i < 4; i++) {
         if (ctxs[i].targets_len > 0) {
-            ctxs[i].fd = create_uleds_led(ctxs[i].name, max_brightness);
+            ctxs[i].fd = g_transport->led_create(ctxs[i].name, cfg.max_brightness);
             if (ctxs[i].fd < 0) return 1;
             num_ctxs++;
 
@@ -692,25 +4824,25 @@ int main(int argc, char **argv) {
             for (int r = 0; r < 5; r++) {
                 pct = qmk_get(&ctxs[i].master);
                 if (pct >= 0) break;
-                usleep(200000); // 200ms
+                clock_sleep_us(200000); // 200ms
             }
             unsigned level = (pct >= 0) ? pct_to_level((unsigned)pct) : 0;
             ctxs[i].last_level = level;
-            dbg(1, "initial state [%s]: %d%% (level %u) master=%04x:%04x\n", 
+            ctxs[i].want_level = level;
+            dbg_fields(1, LOG_FIELDS(ctxs[i].name, ctxs[i].master.vid, ctxs[i].master.pid, (int)level, -1),
+                       "initial state [%s]: %d%% (level %u) master=%04x:%04x\n",
                 ctxs[i].name, pct, level, ctxs[i].master.vid, ctxs[i].master.pid);
             
-            // Immediately sync sysfs and other modules if needed
-            update_sysfs_brightness(ctxs[i].name, (level * max_brightness) / 3);
-            if (ctxs[i].targets_len > 1) {
-                qmk_apply_all(ctxs[i].targets, ctxs[i].targets_len, level, NULL);
+            // Bring the other modules, sysfs and UPower to the master's level
+            ctx_set_level(&ctxs[i], level, cfg.max_brightness, &ctxs[i].master, ORIGIN_STARTUP);
+            for (size_t j = 0; j < ctxs[i].targets_len; j++) {
+                if (target_has_rgb(&ctxs[i].targets[j])) (void)rgb_attach(&ctxs[i].targets[j], &cfg.rgb_ov, level);
             }
-            // Sync UPower state to match initial hardware level
-            sync_ui(level);
         }
     }
 
     // Info logs
-    dbg(1, "mode: %s, targets: %zu\n", (mode == FW_MODE_SEPARATE ? "separate" : "unified"), all_len);
+    dbg(1, "mode: %s, targets: %zu\n", (cfg.mode == FW_MODE_SEPARATE ? "separate" : "unified"), all_len);
     for (int i = 0; i < 4; i++) {
         if (ctxs[i].targets_len > 0) {
             dbg(1, "uleds: %s (%zu targets)\n", ctxs[i].name, ctxs[i].targets_len);
@@ -718,21 +4850,106 @@ int main(int argc, char **argv) {
     }
 
     // Open uevent socket for hotplug
-    int uev_fd = open_uevent_sock();
+    int uev_fd = g_replay.recs ? replay_uevent_fd() : open_uevent_sock();
     if (uev_fd < 0) {
         dbg(1, "warning: failed to open uevent socket; hotplug disabled (%s)\n", strerror(errno));
     } else {
         dbg(1, "hotplug: listening for uevents\n");
     }
 
+    if (idle.level > 3) idle.level = 3;
+    if (idle.timeout_ms > 0 || quiet.enabled) {
+        idle_open_inputs(&idle);
+        if (g_transport == &transport_mock) mock_input_attach(&idle);
+        idle.deadline = now_ms() + idle.timeout_ms;
+        quiet.deadline = now_ms() + QUIET_AFTER_MS;
+    }
+    if (quiet.enabled && prctl(PR_SET_TIMERSLACK, QUIET_TIMER_SLACK_NS) < 0)
+        dbg(1, "quiet: PR_SET_TIMERSLACK failed: %s\n", strerror(errno));
+
+    if (als.enabled && als_open(&als) < 0)
+        fprintf(stderr, "warning: ambient light sensor unavailable; auto-brightness disabled\n");
+    // Start from the level the user already has, so the first reading only
+    // changes it once the ambient light band actually differs.
+    for (int i = 0; i < 4; i++) if (ctxs[i].fd >= 0) { als.level = ctxs[i].last_level; break; }
+
+    if (disp.enabled) {
+        if (uev_fd < 0 || display_open(&disp) < 0) {
+            fprintf(stderr, "warning: cannot follow the display backlight; option ignored\n");
+            disp.enabled = 0;
+        } else {
+            display_update(&disp, ctxs, cfg.max_brightness);
+        }
+    }
+
+    if (ctl_open(&ctl, ctl_path, ctl_perm, ctl_gid) < 0)
+        fprintf(stderr, "warning: failed to open control socket %s: %s\n", ctl_path, strerror(errno));
+
+    if (metrics_open(&metrics, metrics_path) < 0)
+        fprintf(stderr, "warning: metrics file path too long; metrics disabled\n");
+
+    if (broker_open(&broker, broker_path, broker_perm, broker_gid) < 0)
+        fprintf(stderr, "warning: failed to open VIA broker socket %s: %s\n", broker_path, strerror(errno));
+
+    if (dbus_service) {
+        int r = bus_service_open(ctxs, &cfg);
+        if (r < 0) fprintf(stderr, "warning: failed to start D-Bus service: %s\n", strerror(-r));
+    }
+
+    if (state_open(state_path) < 0)
+        fprintf(stderr, "warning: failed to create status page %s: %s\n", state_path, strerror(errno));
+    state_publish(ctxs);
+
+    // After startup, so discovery and the initial sync don't run locked
+    if (rt_prio > 0) rt_enable(rt_prio > 99 ? 99 : rt_prio);
+
     uint64_t next_hw_poll = now_ms() + 500;
-    struct pollfd pfds[5]; // up to 4 uleds + 1 uevent
+    uint64_t last_suspended = suspended_ms();
+    uint64_t resumed_at = 0;
+    // up to 4 uleds + uevent + ALS + lid + bus + control and broker listeners
+    // and clients + idle inputs
+    struct pollfd pfds[10 + USER_BUS_MAX + CTL_MAX_CLIENTS + BROKER_MAX_CLIENTS + IDLE_MAX_INPUTS];
     for (;;) {
+        if (g_mock_stop) break;
+        if (g_mock.script && mock_script_pump()) break;
+        if (g_replay.recs && replay_pump(ctxs, &cfg)) break;
+        if (g_flight_dump_req) {
+            g_flight_dump_req = 0;
+            flight_dump(STDERR_FILENO, "SIGUSR1");
+        }
+
         uint64_t now = now_ms();
         int timeout = -1;
+        wake_cause_t timeout_cause = WAKE_HW_POLL;
+
+        if (!quiet.active) loop_deadline(&timeout, &timeout_cause, next_hw_poll, now, WAKE_HW_POLL);
+        if (g_replay.recs) loop_deadline(&timeout, &timeout_cause, replay_deadline(), now, WAKE_REPLAY);
+        uint64_t script_due = mock_script_deadline();
+        if (script_due) loop_deadline(&timeout, &timeout_cause, script_due, now, WAKE_REPLAY);
+
+        for (int i = 0; i < 4; i++) {
+            if (ctxs[i].holds) continue;
+            uint64_t due = save_deadline(&ctxs[i], cfg.save_interval_ms);
+            if (due != 0) loop_deadline(&timeout, &timeout_cause, due, now, WAKE_SAVE);
+        }
+
+        uint64_t als_due = als_deadline(&als);
+        if (als_due) loop_deadline(&timeout, &timeout_cause, als_due, now, WAKE_ALS_TIMER);
 
-        int hw_t = (next_hw_poll <= now) ? 0 : (int)(next_hw_poll - now);
-        timeout = hw_t;
+        uint64_t metrics_due = metrics_deadline(&metrics);
+        if (metrics_due) loop_deadline(&timeout, &timeout_cause, metrics_due, now, WAKE_METRICS);
+
+        if (idle.timeout_ms > 0 && !idle.dimmed)
+            loop_deadline(&timeout, &timeout_cause, idle.deadline, now, WAKE_IDLE_TIMER);
+
+        if (quiet.enabled && !quiet.active)
+            loop_deadline(&timeout, &timeout_cause, quiet.deadline, now, WAKE_QUIET_TIMER);
+
+        uint64_t hidraw_due = g_transport->idle_deadline();
+        if (hidraw_due) loop_deadline(&timeout, &timeout_cause, hidraw_due, now, WAKE_HIDRAW_CLOSE);
+
+        uint64_t log_due = log_deadline();
+        if (log_due) loop_deadline(&timeout, &timeout_cause, log_due, now, WAKE_LOG);
 
         int pidx = 0;
         for (int i = 0; i < 4; i++) {
@@ -751,37 +4968,245 @@ int main(int argc, char **argv) {
             pfds[pidx].revents = 0;
             pidx++;
         }
+        int als_idx = -1;
+        if (als.fd >= 0) {
+            als_idx = pidx;
+            pfds[pidx].fd = als.fd;
+            pfds[pidx].events = POLLIN;
+            pfds[pidx].revents = 0;
+            pidx++;
+        }
+        int lid_idx = -1;
+        if (disp.enabled && disp.lid_fd >= 0) {
+            lid_idx = pidx;
+            pfds[pidx].fd = disp.lid_fd;
+            pfds[pidx].events = POLLIN;
+            pfds[pidx].revents = 0;
+            pidx++;
+        }
+        int bus_idx = -1;
+        if (g_system_bus) {
+            bus_idx = pidx;
+            int bus_t = bus_poll_setup(&pfds[pidx]);
+            if (bus_t >= 0 && (timeout < 0 || bus_t < timeout)) {
+                timeout = bus_t;
+                timeout_cause = WAKE_BUS_TIMER;
+            }
+            pidx++;
+        }
+        int ubus_idx = -1;
+        if (user_bus_any()) {
+            ubus_idx = pidx;
+            int ubus_t = user_bus_poll_setup(&pfds[pidx]);
+            if (ubus_t >= 0 && (timeout < 0 || ubus_t < timeout)) {
+                timeout = ubus_t;
+                timeout_cause = WAKE_BUS_TIMER;
+            }
+            pidx += USER_BUS_MAX;
+        }
+        int ctl_idx = -1;
+        if (ctl.listen_fd >= 0) {
+            ctl_idx = pidx;
+            pfds[pidx].fd = ctl.listen_fd;
+            pfds[pidx].events = POLLIN;
+            pfds[pidx].revents = 0;
+            pidx++;
+            for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+                pfds[pidx].fd = ctl.clients[i]; // negative fds are ignored by poll()
+                pfds[pidx].events = POLLIN | (sub_pending(i) ? POLLOUT : 0);
+                pfds[pidx].revents = 0;
+                pidx++;
+            }
+        }
+        int broker_idx = -1;
+        if (broker.listen_fd >= 0) {
+            broker_idx = pidx;
+            pfds[pidx].fd = broker.listen_fd;
+            pfds[pidx].events = POLLIN;
+            pfds[pidx].revents = 0;
+            pidx++;
+            for (int i = 0; i < BROKER_MAX_CLIENTS; i++) {
+                pfds[pidx].fd = broker.clients[i];
+                pfds[pidx].events = POLLIN;
+                pfds[pidx].revents = 0;
+                pidx++;
+            }
+        }
+        // Input nodes are only watched while dimmed or quiet (see idle_t)
+        int idle_idx = -1;
+        if (idle.dimmed || quiet.active) {
+            idle_idx = pidx;
+            for (size_t i = 0; i < idle.fds_len; i++) {
+                pfds[pidx].fd = idle.fds[i];
+                pfds[pidx].events = POLLIN;
+                pfds[pidx].revents = 0;
+                pidx++;
+            }
+        }
 
-        int pr = poll(pfds, pidx, timeout);
+        state_publish(ctxs);
+        rec_flush();
+        int pr = clock_poll(pfds, (nfds_t)pidx, timeout);
+        uint64_t wake_us = now_us();
+        now = wake_us / 1000ULL;
+        g_wake.total++;
+        wake_roll(now);
         if (pr < 0) {
-            if (errno == EINTR) continue;
+            if (errno == EINTR) {
+                g_wake.count[WAKE_SIGNAL]++;
+                continue;
+            }
             perror("poll");
+            flight_dump(STDERR_FILENO, "poll failed");
             break;
         }
+        if (pr == 0) {
+            g_wake.count[timeout_cause]++;
+        } else {
+            // One count per kind of fd that is ready
+            const struct { int start; int len; wake_cause_t cause; } kinds[] = {
+                { 0, (int)num_ctxs, WAKE_ULEDS },
+                { uev_idx, 1, WAKE_UEVENT },
+                { als_idx, 1, WAKE_ALS },
+                { lid_idx, 1, WAKE_LID },
+                { bus_idx, 1, WAKE_BUS },
+                { ubus_idx, USER_BUS_MAX, WAKE_BUS },
+                { ctl_idx, 1 + CTL_MAX_CLIENTS, WAKE_CONTROL },
+                { broker_idx, 1 + BROKER_MAX_CLIENTS, WAKE_BROKER },
+                { idle_idx, (int)idle.fds_len, WAKE_INPUT },
+            };
+            for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+                for (int j = 0; kinds[k].start >= 0 && j < kinds[k].len; j++) {
+                    if (pfds[kinds[k].start + j].revents) {
+                        g_wake.count[kinds[k].cause]++;
+                        break;
+                    }
+                }
+            }
+        }
 
-        now = now_ms();
+        // Resume: push cached RGB state back in case the modules lost power
+        uint64_t susp = suspended_ms();
+        if (susp > last_suspended + 1000) {
+            dbg(1, "resume detected (suspended %llums)\n", (unsigned long long)(susp - last_suspended));
+            flight_rec(FR_RESUME, 0, 0, 0, 0, 0, (int32_t)(susp - last_suspended), 0);
+            resumed_at = now;
+            for (int i = 0; i < 4; i++) {
+                for (size_t j = 0; j < ctxs[i].targets_len; j++) {
+                    const target_t *t = &ctxs[i].targets[j];
+                    if (target_has_rgb(t)) (void)rgb_attach(t, &cfg.rgb_ov, ctxs[i].last_level);
+                }
+            }
+        }
+        last_suspended = susp;
 
-        // Hardware polling
-        if (now >= next_hw_poll) {
+        // Hardware polling (stopped while quiet). A module in USB runtime
+        // suspend is skipped: polling would resume it, and its level cannot
+        // change without a key press, which wakes it up first.
+        if (!quiet.active && now >= next_hw_poll) {
             for (int i = 0; i < 4; i++) {
                 if (ctxs[i].fd >= 0) {
+                    if (g_transport->suspended(ctxs[i].master.hidraw)) {
+                        g_counters.hw_polls_skipped++;
+                        continue;
+                    }
+                    // Modules that come back from suspend report their EEPROM level
+                    origin_t origin = (now < resumed_at + 5000) ? ORIGIN_RESUME : ORIGIN_HW_KEY;
+                    int traced = trace_begin(origin_names[origin], ctxs[i].name, now_us());
                     int pct = qmk_get(&ctxs[i].master);
-                    if (pct >= 0) {
-                        unsigned level = pct_to_level((unsigned)pct);
-                        if (level != ctxs[i].last_level) {
-                            dbg(1, "hardware change detected on [%s] (via %04x:%04x): %u -> %u\n", 
-                                ctxs[i].name, ctxs[i].master.vid, ctxs[i].master.pid, ctxs[i].last_level, level);
-                            ctxs[i].last_level = level;
-                            // Apply to all OTHER targets in this context to keep them in sync
-                            // We skip the master because it already changed at the hardware level
-                            qmk_apply_all(ctxs[i].targets, ctxs[i].targets_len, level, &ctxs[i].master);
-                            update_sysfs_brightness(ctxs[i].name, (level * max_brightness) / 3);
-                            sync_ui(level);
-                        }
+                    unsigned level = (pct >= 0) ? pct_to_level((unsigned)pct) : ctxs[i].last_level;
+                    if (level == ctxs[i].last_level) {
+                        if (traced) trace_discard();
+                        continue;
                     }
+                    g_counters.hw_changes++;
+                    dbg_fields(1, LOG_FIELDS(ctxs[i].name, ctxs[i].master.vid, ctxs[i].master.pid, (int)level, -1),
+                               "hardware change detected on [%s] (via %04x:%04x): %u -> %u\n",
+                        ctxs[i].name, ctxs[i].master.vid, ctxs[i].master.pid, ctxs[i].last_level, level);
+                    // Apply to all OTHER targets in this context to keep them in sync
+                    // We skip the master because it already changed at the hardware level
+                    ctx_set_level(&ctxs[i], level, cfg.max_brightness, &ctxs[i].master, origin);
+                    // The key press is user activity, so it also ends an idle dim
+                    ctxs[i].want_level = level;
+                    ctxs[i].holds &= ~HOLD_IDLE;
+                    ctx_update(&ctxs[i], cfg.max_brightness, origin);
+                    save_schedule(&ctxs[i], now, cfg.save_delay_ms);
+                    if (traced) trace_end(ctxs[i].last_level);
                 }
             }
-            next_hw_poll = now + poll_ms;
+            next_hw_poll = now + cfg.poll_ms;
+        }
+
+        // Ambient light
+        if (als_idx >= 0 && (pfds[als_idx].revents & POLLIN)) (void)als_read(&als);
+        als_due = als_deadline(&als);
+        if (als_due && now >= als_due) {
+            dbg(1, "als: ambient %.1f lux, setting level %u\n", als.filtered, als.level);
+            for (int i = 0; i < 4; i++) {
+                if (ctxs[i].fd >= 0) ctx_request_level(&ctxs[i], als.level, cfg.max_brightness, ORIGIN_AMBIENT);
+            }
+            als.pending = 0;
+            als.last_apply = now;
+        }
+
+        // Lid switch
+        if (lid_idx >= 0 && (pfds[lid_idx].revents & POLLIN)) {
+            display_read_lid(&disp);
+            display_update(&disp, ctxs, cfg.max_brightness);
+        }
+
+        // D-Bus service (also runs its timeouts), only when the connection
+        // has something to do, so other wakeups don't cost a recv()
+        if (bus_idx >= 0 && g_system_bus && (pfds[bus_idx].revents || (pr == 0 && timeout_cause == WAKE_BUS_TIMER)))
+            bus_process();
+        if (ubus_idx >= 0) user_bus_process(&pfds[ubus_idx], pr == 0 && timeout_cause == WAKE_BUS_TIMER);
+
+        // Control requests
+        if (ctl_idx >= 0) {
+            for (int i = 0; i < CTL_MAX_CLIENTS; i++) {
+                if (ctl.clients[i] >= 0 && pfds[ctl_idx + 1 + i].revents)
+                    ctl_handle(&ctl, i, pfds[ctl_idx + 1 + i].revents, ctxs, &cfg, now);
+            }
+            if (pfds[ctl_idx].revents & POLLIN) ctl_accept(&ctl);
+        }
+
+        // Brokered VIA requests
+        if (broker_idx >= 0) {
+            // One request per iteration; the others stay readable for the next poll()
+            for (int k = 0; k < BROKER_MAX_CLIENTS; k++) {
+                int i = (broker.next + k) % BROKER_MAX_CLIENTS;
+                if (broker.clients[i] < 0 || !pfds[broker_idx + 1 + i].revents) continue;
+                broker_handle(&broker, i, ctxs);
+                broker.next = (i + 1) % BROKER_MAX_CLIENTS;
+                break;
+            }
+            if (pfds[broker_idx].revents & POLLIN)
+                seqpacket_accept(broker.listen_fd, broker.clients, BROKER_MAX_CLIENTS, "broker");
+        }
+
+        // Input while dimmed or quiet
+        int input = 0;
+        for (size_t i = 0; idle_idx >= 0 && i < idle.fds_len && !input; i++) {
+            if (pfds[idle_idx + (int)i].revents & POLLIN) input = 1;
+        }
+        if (input && idle.dimmed) idle_wake(&idle, ctxs, cfg.max_brightness, now);
+        if (input && quiet.active) {
+            quiet_wake(&quiet, &idle, now);
+            next_hw_poll = now; // the input may have been the backlight key
+        }
+
+        // Idle auto-dim
+        if (idle.timeout_ms > 0 && !idle.dimmed && now >= idle.deadline && idle_expired(&idle, now))
+            idle_dim(&idle, ctxs, cfg.max_brightness);
+
+        // Zero-wakeup mode
+        if (quiet.enabled && !quiet.active && now >= quiet.deadline) (void)quiet_expired(&quiet, &idle, now);
+
+        // Debounced EEPROM saves (never persist a dimmed or display-off level)
+        for (int i = 0; i < 4; i++) {
+            if (ctxs[i].holds) continue;
+            uint64_t due = save_deadline(&ctxs[i], cfg.save_interval_ms);
+            if (due != 0 && now >= due) save_run(&ctxs[i], now);
         }
 
         // uleds events
@@ -789,16 +5214,48 @@ int main(int argc, char **argv) {
         for (int i = 0; i < 4; i++) {
             if (ctxs[i].fd >= 0) {
                 if (pfds[pidx].revents & POLLIN) {
+                    // The change starts at the wakeup, so event_read covers the read itself
                     unsigned char buf[8];
+                    uint64_t ev_us = wake_us;
                     ssize_t r = read(ctxs[i].fd, buf, sizeof(buf));
                     if (r > 0) {
+                        rec_input(RR_ULEDS, (uint8_t)i, buf, (size_t)r);
+                        g_counters.uleds_events++;
+                        int traced = trace_begin(origin_names[ORIGIN_UI], ctxs[i].name, ev_us);
+                        trace_mark("event_read", 0, 0, 0, 0);
                         unsigned raw = decode_uleds(buf, r);
-                        unsigned level = pct_to_level((raw * 100) / max_brightness);
-                        dbg(2, "event [%s]: raw=%u max=%u level=%u last=%u\n", 
-                            ctxs[i].name, raw, max_brightness, level, ctxs[i].last_level);
-                        if (level != ctxs[i].last_level) {
-                            qmk_apply_all(ctxs[i].targets, ctxs[i].targets_len, level, NULL);
-                            ctxs[i].last_level = level;
+                        unsigned level = pct_to_level((raw * 100) / cfg.max_brightness);
+                        trace_mark("decode", 0, 0, 0, 0);
+                        flight_rec(FR_ULEDS, 0, 0, (uint8_t)i, 0, 0, (int32_t)raw, (int32_t)level);
+                        dbg_fields(2, LOG_FIELDS(ctxs[i].name, 0, 0, (int)level, -1),
+                                   "event [%s]: raw=%u max=%u level=%u last=%u\n",
+                            ctxs[i].name, raw, cfg.max_brightness, level, ctxs[i].last_level);
+                        // Under a hold, the slider can land on the level already
+                        // applied while the user wants another; that is still a
+                        // choice, unless it is the echo of the daemon's own write.
+                        int chosen = level != ctxs[i].last_level ||
+                                     (ctxs[i].holds && level != ctxs[i].want_level && raw != ctxs[i].led_raw);
+                        if (chosen) {
+                            // An explicit choice ends an idle dim; with the display
+                            // off it is only remembered for when it comes back.
+                            ctxs[i].want_level = level;
+                            ctxs[i].holds &= ~HOLD_IDLE;
+                            if (ctx_effective_level(&ctxs[i]) == level) {
+                                if (level != ctxs[i].last_level) {
+                                    qmk_apply_all(ctxs[i].targets, ctxs[i].targets_len, level, NULL);
+                                    hist_observe(&g_hist_apply[ORIGIN_UI], now_us() - ev_us);
+                                    ctxs[i].last_level = level;
+                                    notify_level(&ctxs[i], ORIGIN_UI);
+                                    trace_mark("notify", 0, 0, 0, 0);
+                                }
+                            } else {
+                                ctx_update(&ctxs[i], cfg.max_brightness, ORIGIN_UI);
+                            }
+                            save_schedule(&ctxs[i], now, cfg.save_delay_ms);
+                            if (traced) trace_end(ctxs[i].last_level);
+                        } else {
+                            g_counters.uleds_coalesced++;
+                            if (traced) trace_discard();
                         }
                     }
                 }
@@ -806,57 +5263,51 @@ int main(int argc, char **argv) {
             }
         }
 
+        metrics_due = metrics_deadline(&metrics);
+        if (metrics_due && now >= metrics_due) metrics_write(&metrics, ctxs, now);
+        log_flush(now, 0);
+
+        g_transport->close_idle(now);
+
         // Hotplug
         if (uev_idx >= 0 && (pfds[uev_idx].revents & POLLIN)) {
             char ubuf[8192];
             ssize_t r = recv(uev_fd, ubuf, sizeof(ubuf), 0);
-            if (r > 0 && uevent_maybe_relevant(ubuf, r)) {
-                target_t new_all[32];
-                size_t new_len = 0;
-
-                target_t disc[16];
-                size_t disc_len = 0;
-                autodetect_targets(vids, num_vids, disc, &disc_len, 16);
-
-                for (size_t i = 0; i < num_manual_targets && new_len < 32; i++) {
-                    if (!target_in_list(new_all, new_len, &manual_targets[i]))
-                        new_all[new_len++] = manual_targets[i];
-                }
-                for (size_t i = 0; i < disc_len && new_len < 32; i++) {
-                    if (!target_in_list(new_all, new_len, &disc[i]))
-                        new_all[new_len++] = disc[i];
-                }
-
-                // Simplified hotplug sync: just update targets in existing contexts
-                for (int i = 0; i < 4; i++) {
-                    size_t old_targets_len = ctxs[i].targets_len;
-                    target_t old_targets[16];
-                    memcpy(old_targets, ctxs[i].targets, sizeof(target_t) * old_targets_len);
-                    ctxs[i].targets_len = 0;
-
-                    for (size_t j = 0; j < new_len; j++) {
-                        int type = (mode == FW_MODE_SEPARATE) ? get_type(new_all[j].pid) : 0;
-                        if (type == i && ctxs[i].targets_len < 16) {
-                            target_t t = new_all[j];
-                            if (!target_in_list(old_targets, old_targets_len, &t)) {
-                                dbg(1, "hotplug [%s]: new device %04x:%04x (%s)\n", ctxs[i].name, t.vid, t.pid, t.hidraw);
-                                qmk_set(&t, level_to_qmk_pct(ctxs[i].last_level));
-                            }
-                            ctxs[i].targets[ctxs[i].targets_len++] = t;
-                        }
-                    }
-
-                    for (size_t j = 0; j < old_targets_len; j++) {
-                        if (!target_in_list(ctxs[i].targets, ctxs[i].targets_len, &old_targets[j])) {
-                            dbg(1, "hotplug [%s]: device removed %04x:%04x\n", ctxs[i].name, old_targets[j].vid, old_targets[j].pid);
-                        }
-                    }
-                }
+            if (r > 0) {
+                rec_input(RR_UEVENT, 0, ubuf, (size_t)r);
+                g_counters.uevents++;
+                flight_rec(FR_UEVENT, 0, 0, 0, 0, 0, (int32_t)r, 0);
+                PROBE(uevent, r);
             }
+            if (r > 0 && (idle.timeout_ms > 0 || quiet.enabled) && memmem(ubuf, (size_t)r, "DEVNAME=input/event", 19)) {
+                idle_open_inputs(&idle);
+                if (g_transport == &transport_mock) mock_input_attach(&idle);
+                // Queued input was discarded with the old fds; count the change as activity
+                if (!idle.dimmed) idle.deadline = now + idle.timeout_ms;
+                if (!quiet.active) quiet.deadline = now + QUIET_AFTER_MS;
+            }
+            if (r > 0 && disp.enabled && memmem(ubuf, (size_t)r, "SUBSYSTEM=backlight", 19))
+                display_update(&disp, ctxs, cfg.max_brightness);
+            if (r > 0 && uevent_maybe_relevant(ubuf, r)) rescan_targets(ctxs, &cfg, now);
         }
     }
 
     for (int i = 0; i < 4; i++) if (ctxs[i].fd >= 0) close(ctxs[i].fd);
     if (uev_fd >= 0) close(uev_fd);
+    idle_close_inputs(&idle);
+    als_close(&als);
+    display_close(&disp);
+    ctl_close(&ctl);
+    broker_close(&broker);
+    state_close(state_path);
+    if (g_transport == &transport_mock || g_rec.inner == &transport_mock || g_replay.recs) mock_report();
+    if (g_replay.recs) {
+        replay_report();
+        replay_free();
+    }
+    rec_close();
+    g_transport->close_all();
+    sync_ui_close();
+    log_flush(0, 1);
     return 0;
 }
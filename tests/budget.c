@@ -0,0 +1,386 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// tests/budget.c
+//
+// Checks the steady-state budget listed at the top of the daemon's main loop.
+// The daemon is compiled in with its main() renamed (as in fuzz/fuzz.h) and
+// with the C library's allocator, process creation and the syscalls it makes
+// on the hot path interposed by counting wrappers. It runs against the mock
+// transport on the virtual clock with the built-in D-Bus client connected to
+// a minimal bus in a child process, so the D-Bus service signals are sent
+// too. After a warm-up, scripted slider moves and Fn+Space presses drive
+// level changes in both directions; in that window nothing may be allocated,
+// forked or opened, and the syscalls per poll tick and per change must stay
+// within the budget. See `make check`.
+
+#undef _FORTIFY_SOURCE // the _chk variants would bypass the wrappers
+
+#define main fw16_kbd_uleds_main
+#include "../fw16-kbd-uleds.c"
+#undef main
+
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#ifndef FW16_DBUS_BUILTIN
+#error "the budget covers the built-in D-Bus client; build with -DFW16_DBUS_BUILTIN"
+#endif
+
+/* -------------------- Counting wrappers -------------------- */
+
+#define WARMUP_MS 1000
+#define WINDOW_MS 10000
+#define POLL_MS 100
+
+typedef enum {
+    CNT_ALLOC = 0,
+    CNT_SPAWN,
+    CNT_OPEN,   // open, openat, socket, connect, accept, close
+    CNT_POLL,
+    CNT_READ,   // read, pread, recv, recvfrom, recvmsg
+    CNT_WRITE,  // write, pwrite, send, sendto, sendmsg
+    CNT_COUNT
+} cnt_t;
+
+static const char *const cnt_names[CNT_COUNT] = { "alloc", "spawn", "open", "poll", "read", "write" };
+static uint64_t g_cnt[CNT_COUNT];
+
+// Only the window after the warm-up counts, and only until the script ends
+static int budget_window(void) {
+    return g_mock.script_t0_us && g_clock_us >= g_mock.script_t0_us + WARMUP_MS * 1000ULL &&
+           g_mock.script_next < g_mock.script_len;
+}
+
+static void count(cnt_t c) {
+    if (budget_window()) g_cnt[c]++;
+}
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t n) {
+    count(CNT_ALLOC);
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    count(CNT_ALLOC);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    count(CNT_ALLOC);
+    return __libc_realloc(p, n);
+}
+
+// Resolved on first use, the real function behind each wrapper
+#define REAL(name) \
+    static __typeof__(name) *real_##name; \
+    if (!real_##name) real_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name)
+
+pid_t fork(void) {
+    REAL(fork);
+    count(CNT_SPAWN);
+    return real_fork();
+}
+
+int posix_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *fa, const posix_spawnattr_t *attr,
+                char *const argv[], char *const envp[]) {
+    REAL(posix_spawn);
+    count(CNT_SPAWN);
+    return real_posix_spawn(pid, path, fa, attr, argv, envp);
+}
+
+int posix_spawnp(pid_t *pid, const char *file, const posix_spawn_file_actions_t *fa, const posix_spawnattr_t *attr,
+                 char *const argv[], char *const envp[]) {
+    REAL(posix_spawnp);
+    count(CNT_SPAWN);
+    return real_posix_spawnp(pid, file, fa, attr, argv, envp);
+}
+
+int open(const char *path, int flags, ...) {
+    REAL(open);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) ? (mode_t)va_arg(ap, int) : 0;
+    va_end(ap);
+    count(CNT_OPEN);
+    return real_open(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    REAL(openat);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) ? (mode_t)va_arg(ap, int) : 0;
+    va_end(ap);
+    count(CNT_OPEN);
+    return real_openat(dirfd, path, flags, mode);
+}
+
+int socket(int domain, int type, int protocol) {
+    REAL(socket);
+    count(CNT_OPEN);
+    return real_socket(domain, type, protocol);
+}
+
+int connect(int fd, const struct sockaddr *sa, socklen_t len) {
+    REAL(connect);
+    count(CNT_OPEN);
+    return real_connect(fd, sa, len);
+}
+
+int accept4(int fd, struct sockaddr *sa, socklen_t *len, int flags) {
+    REAL(accept4);
+    count(CNT_OPEN);
+    return real_accept4(fd, sa, len, flags);
+}
+
+int close(int fd) {
+    REAL(close);
+    count(CNT_OPEN);
+    return real_close(fd);
+}
+
+int poll(struct pollfd *fds, nfds_t n, int timeout) {
+    REAL(poll);
+    count(CNT_POLL);
+    return real_poll(fds, n, timeout);
+}
+
+ssize_t read(int fd, void *buf, size_t n) {
+    REAL(read);
+    count(CNT_READ);
+    return real_read(fd, buf, n);
+}
+
+ssize_t pread(int fd, void *buf, size_t n, off_t off) {
+    REAL(pread);
+    count(CNT_READ);
+    return real_pread(fd, buf, n, off);
+}
+
+ssize_t recv(int fd, void *buf, size_t n, int flags) {
+    REAL(recv);
+    count(CNT_READ);
+    return real_recv(fd, buf, n, flags);
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t n, int flags, struct sockaddr *sa, socklen_t *len) {
+    REAL(recvfrom);
+    count(CNT_READ);
+    return real_recvfrom(fd, buf, n, flags, sa, len);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags) {
+    REAL(recvmsg);
+    count(CNT_READ);
+    return real_recvmsg(fd, msg, flags);
+}
+
+ssize_t write(int fd, const void *buf, size_t n) {
+    REAL(write);
+    count(CNT_WRITE);
+    return real_write(fd, buf, n);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t n, off_t off) {
+    REAL(pwrite);
+    count(CNT_WRITE);
+    return real_pwrite(fd, buf, n, off);
+}
+
+ssize_t send(int fd, const void *buf, size_t n, int flags) {
+    REAL(send);
+    count(CNT_WRITE);
+    return real_send(fd, buf, n, flags);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t n, int flags, const struct sockaddr *sa, socklen_t len) {
+    REAL(sendto);
+    count(CNT_WRITE);
+    return real_sendto(fd, buf, n, flags, sa, len);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    REAL(sendmsg);
+    count(CNT_WRITE);
+    return real_sendmsg(fd, msg, flags);
+}
+
+/* -------------------- Bus -------------------- */
+
+// Just enough of a message bus for the daemon's system bus connection:
+// accept the authentication, answer Hello and RequestName, drop the rest.
+static int fake_hello(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)userdata; (void)err;
+    return sd_bus_reply_method_return(m, "s", ":1.1");
+}
+
+static int fake_request_name(sd_bus_message *m, void *userdata, sd_bus_error *err) {
+    (void)userdata; (void)err;
+    return sd_bus_reply_method_return(m, "u", 1);
+}
+
+static const sd_bus_vtable fake_bus_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Hello", "", "s", fake_hello, 0),
+    SD_BUS_METHOD("RequestName", "su", "u", fake_request_name, 0),
+    SD_BUS_VTABLE_END
+};
+
+static void fake_bus_serve(int lfd) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) _exit(1);
+    sd_bus *bus;
+    if (sd_bus_new(&bus) < 0) _exit(1);
+    bus->fd = fd;
+    while (!memmem(bus->rbuf, bus->rlen, "BEGIN\r\n", 7)) {
+        ssize_t n = recv(fd, bus->rbuf + bus->rlen, sizeof(bus->rbuf) - bus->rlen, 0);
+        if (n <= 0) _exit(1);
+        bus->rlen += (size_t)n;
+    }
+    static const char ok[] = "OK 0123456789abcdef0123456789abcdef\r\n";
+    if (send(fd, ok, sizeof(ok) - 1, MSG_NOSIGNAL) < 0) _exit(1);
+    unsigned char *begin = memmem(bus->rbuf, bus->rlen, "BEGIN\r\n", 7);
+    size_t skip = (size_t)(begin - bus->rbuf) + 7;
+    memmove(bus->rbuf, bus->rbuf + skip, bus->rlen - skip);
+    bus->rlen -= skip;
+    sd_bus_add_object_vtable(bus, NULL, "/org/freedesktop/DBus", "org.freedesktop.DBus", fake_bus_vtable, NULL);
+    for (;;) {
+        int r;
+        while ((r = sd_bus_process(bus, NULL)) > 0) {}
+        if (r < 0) _exit(0);
+        struct pollfd pfd = { .fd = fd, .events = (short)sd_bus_get_events(bus) };
+        poll(&pfd, 1, -1);
+    }
+}
+
+/* -------------------- Scenario -------------------- */
+
+#define SLIDES 10
+#define KEYS 10
+#define MODULES 2
+
+// The mock's ops in the window, from its op log
+static int window_ops(uint64_t *ops, uint64_t *sets) {
+    uint64_t start = g_mock.script_t0_us + WARMUP_MS * 1000ULL;
+    uint64_t first = g_mock.log_next > MOCK_LOG_LEN ? g_mock.log_next - MOCK_LOG_LEN : 0;
+    if (g_mock.log[first % MOCK_LOG_LEN].t_us >= start) return -1; // wrapped into the window
+    for (uint64_t i = first; i < g_mock.log_next; i++) {
+        const mock_log_t *e = &g_mock.log[i % MOCK_LOG_LEN];
+        if (e->t_us < start) continue;
+        ops[e->op]++;
+        if (e->op == MOCK_OP_XFER && e->req[0] == QMK_CMD_SET_VALUE) (*sets)++;
+    }
+    return 0;
+}
+
+static int budget_line(const char *what, uint64_t got, uint64_t max) {
+    printf("  %-10s %6llu (budget %llu)\n", what, (unsigned long long)got, (unsigned long long)max);
+    return got > max;
+}
+
+// Every poll tick, slider move and key press in the window at its full cost
+// (see the budget at the top of the main loop). The mock stands in for the
+// hidraw syscalls, so HID transactions and LED writes are counted as its ops.
+static int budget_check(void) {
+    uint64_t ops[MOCK_OP_COUNT] = { 0 }, sets = 0;
+    if (window_ops(ops, &sets) < 0) {
+        fprintf(stderr, "mock op log too short for the window\n");
+        return 1;
+    }
+    uint64_t ticks = WINDOW_MS / POLL_MS, changes = SLIDES + KEYS;
+    uint64_t max[CNT_COUNT] = {
+        [CNT_ALLOC] = 0,
+        [CNT_SPAWN] = 0,
+        [CNT_OPEN] = 0,
+        // One per loop iteration: ticks, scripted inputs, and the uleds events
+        [CNT_POLL] = ticks + SLIDES + KEYS + SLIDES,
+        // The uleds events; the service's signals get no replies
+        [CNT_READ] = SLIDES,
+        // The script's uleds writes, and two signals per change
+        [CNT_WRITE] = SLIDES + 2 * changes,
+    };
+    int over = 0;
+    printf("%llu poll ticks, %d slider moves, %d key presses:\n", (unsigned long long)ticks, SLIDES, KEYS);
+    for (int i = 0; i < CNT_COUNT; i++) over |= budget_line(cnt_names[i], g_cnt[i], max[i]);
+    // One get per tick, two sets per module and change (less the module
+    // where a key press came from)
+    over |= budget_line("hid", ops[MOCK_OP_XFER], ticks + 2 * MODULES * changes);
+    // Only for changes made on the hardware
+    over |= budget_line("led_write", ops[MOCK_OP_LED_WRITE], KEYS);
+    over |= budget_line("ui_sync", ops[MOCK_OP_UI_SYNC], KEYS);
+    if (over) {
+        printf("over budget\n");
+        return 1;
+    }
+    // Guard against a run that never got to the changes
+    if (g_cnt[CNT_POLL] < ticks || sets < 2 * MODULES || ops[MOCK_OP_LED_WRITE] == 0) {
+        printf("the scenario did not run: %llu polls, %llu sets\n", (unsigned long long)g_cnt[CNT_POLL],
+               (unsigned long long)sets);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    // In the window: a slider move and a Fn+Space press every second
+    mock_event_t script[SLIDES + KEYS + 1];
+    size_t n = 0;
+    for (unsigned i = 0; i < SLIDES; i++) {
+        script[n++] = (mock_event_t){ WARMUP_MS + i * 1000 + 50, MOCK_EV_SLIDER, 0, (i % 2) ? 200 : 80, NULL };
+        script[n++] = (mock_event_t){ WARMUP_MS + i * 1000 + 550, MOCK_EV_KEY, 0, 0, NULL };
+    }
+    script[n++] = (mock_event_t){ WARMUP_MS + WINDOW_MS, MOCK_EV_END, 0, 0, NULL };
+    g_mock.script = script;
+    g_mock.script_len = n;
+
+    char dir[] = "/tmp/fw16-budget-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/bus", dir);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(lfd, 1) < 0) {
+        perror("bus socket");
+        return 1;
+    }
+    char addr[sizeof(sa.sun_path) + 16];
+    snprintf(addr, sizeof(addr), "unix:path=%s", sa.sun_path);
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", addr, 1);
+    pid_t bus_pid = fork();
+    if (bus_pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (bus_pid == 0) fake_bus_serve(lfd);
+    close(lfd);
+
+    char poll_ms[16];
+    snprintf(poll_ms, sizeof(poll_ms), "%d", POLL_MS);
+    char *argv[] = { "fw16-kbd-uleds", "--transport", "mock:0012,0014", "--virtual-clock", "--control-socket", "none",
+                     "--state-file", "none", "--dbus-service", "--max-brightness", "255", "--poll-ms", poll_ms, NULL };
+    int out = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    int rc = fw16_kbd_uleds_main((int)(sizeof(argv) / sizeof(argv[0])) - 1, argv);
+    dup2(out, STDERR_FILENO);
+    kill(bus_pid, SIGTERM);
+    waitpid(bus_pid, NULL, 0);
+    unlink(sa.sun_path);
+    rmdir(dir);
+    if (rc != 0) {
+        fprintf(stderr, "daemon exited with %d\n", rc);
+        return 1;
+    }
+    return budget_check();
+}
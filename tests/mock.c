@@ -0,0 +1,338 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// tests/mock.c
+//
+// Deterministic tests against the mock transport. The daemon is compiled in
+// with its main() renamed (as in fuzz/fuzz.h); each scenario runs it in a
+// child on the virtual clock with a script of inputs and compares the ops the
+// mock logged with the expected sequence, or runs its own check on what the
+// script observed. See `make check`.
+
+#define main fw16_kbd_uleds_main
+#include "../fw16-kbd-uleds.c"
+#undef main
+
+#include <sys/wait.h>
+
+typedef struct {
+    const char *name;
+    const char *transport;
+    const char *const *args;      // extra daemon options
+    const mock_event_t *script;
+    size_t script_len;
+    const char *const *expect;    // the op log, formatted by op_format(), or NULL
+    size_t expect_len;
+    void (*setup)(void);          // before the run, e.g. to build the script
+    int (*check)(const char *name); // after the run; nonzero on failure
+} scenario_t;
+
+// One op as "ms op target req>resp" (xfers) or "ms op target val", with the
+// time in ms since the script started
+static void op_format(const mock_log_t *e, char *out, size_t len) {
+    long long ms = ((long long)e->t_us - (long long)g_mock.script_t0_us) / 1000;
+    if (e->op == MOCK_OP_XFER)
+        snprintf(out, len, "%lld %s %s %02x%02x%02x%02x>%02x%02x%02x%02x", ms, mock_op_names[e->op], e->target,
+                 e->req[0], e->req[1], e->req[2], e->req[3], e->resp[0], e->resp[1], e->resp[2], e->resp[3]);
+    else if (e->op == MOCK_OP_FIND && e->val >= 0)
+        snprintf(out, len, "%lld %s %s %04x", ms, mock_op_names[e->op], e->target, (unsigned)e->val);
+    else
+        snprintf(out, len, "%lld %s %s %d", ms, mock_op_names[e->op], e->target, e->val);
+}
+
+// Runs in the child: run the daemon until the script ends, then compare its
+// op log, startup included.
+static int scenario_run(const scenario_t *sc) {
+    const char *argv[32];
+    int argc = 0;
+    argv[argc++] = "fw16-kbd-uleds";
+    argv[argc++] = "--transport";
+    argv[argc++] = sc->transport;
+    argv[argc++] = "--virtual-clock";
+    argv[argc++] = "--control-socket";
+    argv[argc++] = "none";
+    argv[argc++] = "--state-file";
+    argv[argc++] = "none";
+    for (size_t i = 0; sc->args[i]; i++) argv[argc++] = sc->args[i];
+    argv[argc] = NULL;
+
+    if (sc->setup) sc->setup();
+    g_mock.script = sc->script;
+    g_mock.script_len = sc->script_len;
+    int out = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    int rc = fw16_kbd_uleds_main(argc, (char **)argv);
+    dup2(out, STDERR_FILENO);
+    if (rc != 0) {
+        fprintf(stderr, "%s: daemon exited with %d\n", sc->name, rc);
+        return 1;
+    }
+    if (sc->check && sc->check(sc->name)) return 1;
+    if (!sc->expect) return 0;
+    if (g_mock.log_next > MOCK_LOG_LEN) {
+        fprintf(stderr, "%s: op log overflowed\n", sc->name);
+        return 1;
+    }
+
+    size_t n = 0;
+    int fail = 0;
+    for (uint64_t i = 0; i < g_mock.log_next; i++) {
+        const mock_log_t *e = &g_mock.log[i];
+        char got[128];
+        op_format(e, got, sizeof(got));
+        const char *want = (n < sc->expect_len) ? sc->expect[n] : "(end)";
+        if (strcmp(got, want) != 0) {
+            fprintf(stderr, "%s: op %zu: got \"%s\", want \"%s\"\n", sc->name, n, got, want);
+            fail = 1;
+        }
+        n++;
+    }
+    if (n < sc->expect_len) {
+        fprintf(stderr, "%s: only %zu of %zu ops, next want \"%s\"\n", sc->name, n, sc->expect_len, sc->expect[n]);
+        fail = 1;
+    }
+    return fail;
+}
+
+// A slider dragged from 0 to full and back to the middle in 5 ms steps: raw
+// values that map to the current level are coalesced, each level change is
+// one set per module, and the EEPROM save waits until the drag settles.
+static const mock_event_t drag_script[] = {
+    { 0, MOCK_EV_SLIDER, 0, 0, NULL },
+    { 5, MOCK_EV_SLIDER, 0, 40, NULL },
+    { 10, MOCK_EV_SLIDER, 0, 80, NULL },
+    { 15, MOCK_EV_SLIDER, 0, 120, NULL },
+    { 20, MOCK_EV_SLIDER, 0, 160, NULL },
+    { 25, MOCK_EV_SLIDER, 0, 200, NULL },
+    { 30, MOCK_EV_SLIDER, 0, 255, NULL },
+    { 35, MOCK_EV_SLIDER, 0, 200, NULL },
+    { 40, MOCK_EV_SLIDER, 0, 160, NULL },
+    { 45, MOCK_EV_SLIDER, 0, 120, NULL },
+    { 2000, MOCK_EV_END, 0, 0, NULL },
+};
+static const char *const drag_args[] = { "--max-brightness", "255", "--poll-ms", "60000", "--save-delay-ms", "500", "--save-interval-ms", "0", NULL };
+static const char *const drag_expect[] = {
+    "0 find mock0 0012",
+    "0 find - -1",
+    "0 find - -1",
+    "0 find mock1 0014",
+    "0 find - -1",
+    "0 xfer mock0 08010100>080101aa",
+    "0 xfer mock1 070101ab>070101ab",
+    "0 xfer mock1 070301ab>ff0301ab",
+    "0 led_write framework::kbd_backlight 170",
+    "0 ui_sync ui 2",
+    // drag: 40 and 120 map to the level already set, 160 on the way back too
+    "0 xfer mock0 07010100>07010100",
+    "0 xfer mock0 07030100>ff030100",
+    "0 xfer mock1 07010100>07010100",
+    "0 xfer mock1 07030100>ff030100",
+    "10 xfer mock0 07010159>07010159",
+    "10 xfer mock0 07030159>ff030159",
+    "10 xfer mock1 07010159>07010159",
+    "10 xfer mock1 07030159>ff030159",
+    "20 xfer mock0 070101ab>070101ab",
+    "20 xfer mock0 070301ab>ff0301ab",
+    "20 xfer mock1 070101ab>070101ab",
+    "20 xfer mock1 070301ab>ff0301ab",
+    "30 xfer mock0 070101ff>070101ff",
+    "30 xfer mock0 070301ff>ff0301ff",
+    "30 xfer mock1 070101ff>070101ff",
+    "30 xfer mock1 070301ff>ff0301ff",
+    "35 xfer mock0 070101ab>070101ab",
+    "35 xfer mock0 070301ab>ff0301ab",
+    "35 xfer mock1 070101ab>070101ab",
+    "35 xfer mock1 070301ab>ff0301ab",
+    "45 xfer mock0 07010159>07010159",
+    "45 xfer mock0 07030159>ff030159",
+    "45 xfer mock1 07010159>07010159",
+    "45 xfer mock1 07030159>ff030159",
+    "500 xfer mock0 08010100>08010159",
+    // one save, 500 ms after the last change
+    "545 xfer mock0 09010000>09010000",
+    "545 xfer mock0 09030000>ff030000",
+    "545 xfer mock1 09010000>09010000",
+    "545 xfer mock1 09030000>ff030000",
+};
+
+// Fn+Space on the keyboard: the next poll sees the new level, sets it on the
+// other module and tells the UI.
+static const mock_event_t key_script[] = {
+    { 550, MOCK_EV_KEY, 0, 0, NULL },
+    { 1000, MOCK_EV_END, 0, 0, NULL },
+};
+static const char *const key_args[] = { "--poll-ms", "100", NULL };
+static const char *const key_expect[] = {
+    "0 find mock0 0012",
+    "0 find - -1",
+    "0 find - -1",
+    "0 find mock1 0014",
+    "0 find - -1",
+    "0 xfer mock0 08010100>080101aa",
+    "0 xfer mock1 070101ab>070101ab",
+    "0 xfer mock1 070301ab>ff0301ab",
+    "0 led_write framework::kbd_backlight 2",
+    "0 ui_sync ui 2",
+    "500 xfer mock0 08010100>080101aa",
+    // Fn+Space at 550 is picked up by the poll at 600
+    "600 xfer mock0 08010100>080101ff",
+    "600 xfer mock1 070101ff>070101ff",
+    "600 xfer mock1 070301ff>ff0301ff",
+    "600 led_write framework::kbd_backlight 3",
+    "600 ui_sync ui 3",
+    "700 xfer mock0 08010100>080101ff",
+    "800 xfer mock0 08010100>080101ff",
+    "900 xfer mock0 08010100>080101ff",
+    "1000 xfer mock0 08010100>080101ff",
+};
+
+// --idle-timeout dims to the idle level; the uleds echo of that write is not
+// a choice and input restores the level from before. Dimmed again, a slider
+// move to the dimmed level is the user's choice, so input keeps it.
+static const mock_event_t idle_script[] = {
+    { 1001, MOCK_EV_SLIDER, 0, 85, NULL },
+    { 1500, MOCK_EV_INPUT, 0, 0, NULL },
+    { 2501, MOCK_EV_SLIDER, 0, 85, NULL },
+    { 3000, MOCK_EV_SLIDER, 0, 80, NULL },
+    { 3500, MOCK_EV_INPUT, 0, 0, NULL },
+    { 4000, MOCK_EV_END, 0, 0, NULL },
+};
+static const char *const idle_args[] = { "--max-brightness", "255", "--poll-ms", "60000", "--save-delay-ms", "0",
+                                         "--idle-timeout", "1", "--idle-level", "1", NULL };
+static const char *const idle_expect[] = {
+    "0 find mock0 0012",
+    "0 find - -1",
+    "0 find - -1",
+    "0 find - -1",
+    "0 find - -1",
+    "0 xfer mock0 08010100>080101aa",
+    "0 led_write framework::kbd_backlight 170",
+    "0 ui_sync ui 2",
+    "500 xfer mock0 08010100>080101aa",
+    "1000 xfer mock0 07010159>07010159",
+    "1000 xfer mock0 07030159>ff030159",
+    "1000 led_write framework::kbd_backlight 85",
+    "1000 ui_sync ui 1",
+    "1500 xfer mock0 070101ab>070101ab",
+    "1500 xfer mock0 070301ab>ff0301ab",
+    "1500 led_write framework::kbd_backlight 170",
+    "1500 ui_sync ui 2",
+    "2500 xfer mock0 07010159>07010159",
+    "2500 xfer mock0 07030159>ff030159",
+    "2500 led_write framework::kbd_backlight 85",
+    "2500 ui_sync ui 1",
+    // the slider at 3000 picked level 1, so the input at 3500 changes nothing
+};
+
+// A status bar subscribed on the control socket: every change is pushed as
+// it happens. While it does not read, the socket buffer and then its
+// 32-event ring fill up; the oldest events are dropped, and once it reads
+// again it gets "dropped <n>" followed by the newest 32.
+#define SUB_CHANGES 2000
+#define SUB_READS 5
+
+static char sub_path[64];
+static int sub_fd = -1;
+static char sub_msgs[SUB_CHANGES + 8][SUB_EVENT_MAX];
+static size_t sub_msgs_len;
+static mock_event_t sub_script[1 + SUB_CHANGES + SUB_READS + 1];
+static const char *const sub_args[] = { "--control-socket", sub_path, "--control-socket-mode", "0666",
+                                        "--max-brightness", "255", "--poll-ms", "60000", NULL };
+
+static void sub_connect(unsigned unused) {
+    (void)unused;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", sub_path);
+    sub_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sub_fd < 0 || connect(sub_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || send(sub_fd, "subscribe", 9, 0) != 9)
+        _exit(2);
+}
+
+static void sub_read(unsigned unused) {
+    (void)unused;
+    char buf[SUB_EVENT_MAX];
+    ssize_t n;
+    while (sub_msgs_len < sizeof(sub_msgs) / sizeof(sub_msgs[0]) &&
+           (n = recv(sub_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+        buf[n] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+        snprintf(sub_msgs[sub_msgs_len++], sizeof(sub_msgs[0]), "%s", buf);
+    }
+}
+
+static void sub_setup(void) {
+    snprintf(sub_path, sizeof(sub_path), "/tmp/fw16-kbd-uleds-test-%d", (int)getpid());
+    size_t n = 0;
+    sub_script[n++] = (mock_event_t){ 0, MOCK_EV_CALL, 0, 0, sub_connect };
+    // Level 1 and 2 in turn, starting from 2
+    for (unsigned i = 0; i < SUB_CHANGES; i++)
+        sub_script[n++] = (mock_event_t){ 100 + i, MOCK_EV_SLIDER, 0, (i % 2) ? 200 : 80, NULL };
+    for (unsigned i = 0; i < SUB_READS; i++)
+        sub_script[n++] = (mock_event_t){ 3000 + i * 10, MOCK_EV_CALL, 0, 0, sub_read };
+    sub_script[n++] = (mock_event_t){ 4000, MOCK_EV_END, 0, 0, NULL };
+}
+
+static int sub_check(const char *name) {
+    unlink(sub_path);
+    // The reply to subscribe, the events the socket queued before the ring
+    // was needed, then the drop note and the newest 32
+    size_t queued = 0;
+    while (1 + queued < sub_msgs_len && strncmp(sub_msgs[1 + queued], "dropped ", 8) != 0) queued++;
+    size_t dropped = SUB_CHANGES - queued - SUB_QUEUE_LEN;
+    int fail = 0;
+    if (sub_msgs_len != 1 + queued + 1 + SUB_QUEUE_LEN || queued == 0 || queued >= SUB_CHANGES - SUB_QUEUE_LEN) {
+        fprintf(stderr, "%s: got %zu messages, %zu before the drop note\n", name, sub_msgs_len, queued);
+        return 1;
+    }
+    char want[SUB_EVENT_MAX];
+    for (size_t i = 0; i < sub_msgs_len; i++) {
+        if (i == 0) {
+            snprintf(want, sizeof(want), "ok");
+        } else if (i == 1 + queued) {
+            snprintf(want, sizeof(want), "dropped %zu", dropped);
+        } else {
+            size_t change = (i <= queued) ? i - 1 : i - 2 + dropped;
+            snprintf(want, sizeof(want), "level framework::kbd_backlight %u ui", (change % 2) ? 2u : 1u);
+        }
+        if (strcmp(sub_msgs[i], want) != 0) {
+            fprintf(stderr, "%s: message %zu: got \"%s\", want \"%s\"\n", name, i, sub_msgs[i], want);
+            fail = 1;
+        }
+    }
+    return fail;
+}
+
+#define SCENARIO(n, t, a, s, e) { n, t, a, s, sizeof(s) / sizeof(s[0]), e, sizeof(e) / sizeof(e[0]), NULL, NULL }
+#define SCENARIO_CHECK(n, t, a, s, setup, check) { n, t, a, s, sizeof(s) / sizeof(s[0]), NULL, 0, setup, check }
+
+static const scenario_t scenarios[] = {
+    SCENARIO("slider-drag", "mock:0012,0014", drag_args, drag_script, drag_expect),
+    SCENARIO("hardware-key", "mock:0012,0014", key_args, key_script, key_expect),
+    SCENARIO("idle-choice", "mock", idle_args, idle_script, idle_expect),
+    SCENARIO_CHECK("subscribe-drop", "mock", sub_args, sub_script, sub_setup, sub_check),
+};
+
+int main(void) {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) _exit(scenario_run(&scenarios[i]));
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("FAIL %s\n", scenarios[i].name);
+            failed++;
+        } else {
+            printf("ok   %s\n", scenarios[i].name);
+        }
+    }
+    return failed ? 1 : 0;
+}
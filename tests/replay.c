@@ -0,0 +1,117 @@
+/*
+ * fw16-kbd-uleds
+ * Copyright (c) 2026 paco3346
+ * Licensed under the MIT License. See LICENSE file.
+ */
+
+// tests/replay.c
+//
+// Round trip of a --record trace through --replay. The daemon is compiled in
+// with its main() renamed (as in fuzz/fuzz.h); the test records the daemon's
+// own set/get requests and VIA broker reports against the mock transport on
+// the virtual clock, then replays the same calls at the same times and
+// checks that every answer, all 32 bytes of it, comes back as recorded. See
+// `make check`.
+
+#define main fw16_kbd_uleds_main
+#include "../fw16-kbd-uleds.c"
+#undef main
+
+#define STEP_US 1000
+#define N_OWN 4 // the daemon's own requests come first
+
+typedef struct {
+    const char *name;
+    unsigned char req[VIA_REPORT_LEN];
+    unsigned char resp[VIA_REPORT_LEN];
+    int rc;
+} call_t;
+
+// Broker reports share command, channel and address and only differ past
+// the first eight bytes, where a truncated trace would mix them up.
+static void calls_init(call_t *c, size_t n) {
+    static const unsigned char own[N_OWN][4] = {
+        { QMK_CMD_GET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, 0 },
+        { QMK_CMD_SET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, 0x80 },
+        { QMK_CMD_GET_VALUE, QMK_CH_BACKLIGHT, QMK_ADDR_BRIGHTNESS, 0 },
+        { QMK_CMD_CUSTOM_SAVE, QMK_CH_BACKLIGHT, 0, 0 },
+    };
+    for (size_t i = 0; i < n; i++) {
+        memset(&c[i], 0, sizeof(c[i]));
+        if (i < N_OWN) {
+            c[i].name = "own";
+            memcpy(c[i].req, own[i], sizeof(own[i]));
+            continue;
+        }
+        c[i].name = "broker";
+        c[i].req[0] = 0x12; // dynamic_keymap_get_buffer
+        c[i].req[1] = 0x00;
+        c[i].req[2] = 0x40;
+        for (size_t j = 3; j < VIA_REPORT_LEN; j++) c[i].req[j] = (unsigned char)(i * 31 + j);
+    }
+}
+
+static int run(const char *path) {
+    call_t calls[8], got;
+    size_t n = sizeof(calls) / sizeof(calls[0]);
+    char hidraw[64];
+    calls_init(calls, n);
+
+    if (transport_select("mock") < 0 || rec_open(path) < 0) {
+        perror("record");
+        return 1;
+    }
+    if (g_transport->find(0x32ac, 0x0012, hidraw, sizeof(hidraw)) < 0) {
+        fprintf(stderr, "record: mock module not found\n");
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        clock_sleep_us(STEP_US);
+        calls[i].rc = g_transport->xfer(hidraw, calls[i].req, calls[i].resp);
+    }
+    rec_close();
+
+    if (replay_open(path) < 0) {
+        perror("replay");
+        return 1;
+    }
+    replay_start();
+    int failed = 0;
+    char found[64];
+    if (replay_find(0x32ac, 0x0012, found, sizeof(found)) < 0 || strcmp(found, hidraw)) {
+        fprintf(stderr, "replay: find answered differently\n");
+        failed = 1;
+    }
+    // The daemon's own calls at their recorded times, the broker's in reverse
+    // order, so each has to find its own answer rather than the latest one
+    for (size_t k = 0; k < n; k++) {
+        size_t i = strcmp(calls[k].name, "broker") ? k : n - 1 - (k - N_OWN);
+        clock_sleep_us(STEP_US);
+        memset(got.resp, 0xAA, sizeof(got.resp));
+        got.rc = replay_xfer(hidraw, calls[i].req, got.resp);
+        if (got.rc != calls[i].rc || memcmp(got.resp, calls[i].resp, sizeof(got.resp))) {
+            fprintf(stderr, "replay: call %zu (%s, cmd 0x%02x) answered differently\n", i, calls[i].name,
+                    calls[i].req[0]);
+            for (size_t j = 0; j < VIA_REPORT_LEN; j++)
+                if (got.resp[j] != calls[i].resp[j])
+                    fprintf(stderr, "  byte %zu: recorded %02x, replayed %02x\n", j, calls[i].resp[j], got.resp[j]);
+            failed = 1;
+        }
+    }
+    if (g_replay.misses) {
+        fprintf(stderr, "replay: %llu misses\n", (unsigned long long)g_replay.misses);
+        failed = 1;
+    }
+    replay_free();
+    return failed;
+}
+
+int main(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/fw16-kbd-uleds-test-%d.trace", (int)getpid());
+    clock_set_virtual();
+    int failed = run(path);
+    unlink(path);
+    printf("%s round-trip\n", failed ? "FAIL" : "ok  ");
+    return failed;
+}